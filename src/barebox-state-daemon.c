@@ -0,0 +1,585 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * barebox-state-daemon.c - keep states in memory and serve them over a socket
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * The daemon loads the states once and serves requests on a unix socket. The
+ * protocol is line based, each request is answered with any number of data
+ * lines starting with '+', followed by a status line which is either "OK" or
+ * "ERR <errno>":
+ *
+ *   get <variable>          the value of the variable
+ *   set <variable>=<value>  set the variable, the state is saved later
+ *   dump [<state>]          all variables as printed by --dump, only those of
+ *                           <state> without a prefix if given
+ *   sync                    answered once all previous sets are saved
+ *   states                  "<state> <backend>@<offset>" for each state
+ *
+ * Variables of other than the first state are prefixed with "<state>.". The
+ * backend and offset returned by "states" identify the lock the daemon holds,
+ * so clients know which states they have to access through the daemon.
+ *
+ * A client has to wait for the answer before sending the next request. Sets
+ * are not saved immediately. The first set arms a timer, all sets until
+ * it expires are written with a single state_save(). Clients which need the
+ * data to be stored send a sync request afterwards.
+ *
+ * Only the user running the daemon can access the socket. Connections of
+ * other users except root are rejected as well.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <barebox-state/state.h>
+#include <barebox-state.h>
+#include <dt/dt.h>
+#include <state.h>
+
+#define STATE_DAEMON_LINE_MAX	4096
+
+struct state_client {
+	int fd;
+	char buf[STATE_DAEMON_LINE_MAX];
+	size_t len;
+	/* waiting for the pending save to answer a sync request */
+	bool sync;
+	struct list_head list;
+};
+
+struct state_daemon {
+	struct state_list *states;
+	int nr_states;
+	int save_delay_ms;
+	/* CLOCK_MONOTONIC time of the pending save in ms, 0 if none */
+	uint64_t save_at;
+	struct list_head clients;
+};
+
+static volatile sig_atomic_t state_daemon_stop;
+
+static void state_daemon_signal(int sig)
+{
+	state_daemon_stop = 1;
+}
+
+static uint64_t state_daemon_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool state_daemon_dirty(struct state_daemon *daemon)
+{
+	struct state_list *state;
+
+	list_for_each_entry(state, &daemon->states->list, list) {
+		if (state->state->dirty)
+			return true;
+	}
+
+	return false;
+}
+
+static void state_daemon_arm(struct state_daemon *daemon)
+{
+	if (!daemon->save_at)
+		daemon->save_at = state_daemon_now() + daemon->save_delay_ms;
+}
+
+static void state_client_reply(FILE *reply, int ret)
+{
+	if (ret)
+		fprintf(reply, "ERR %d\n", -ret);
+	else
+		fprintf(reply, "OK\n");
+}
+
+static int state_client_send(struct state_client *client, const char *buf,
+			     size_t len)
+{
+	ssize_t now;
+
+	while (len) {
+		now = write(client->fd, buf, len);
+		if (now < 0)
+			return -errno;
+		buf += now;
+		len -= now;
+	}
+
+	return 0;
+}
+
+static void state_client_free(struct state_client *client)
+{
+	list_del(&client->list);
+	close(client->fd);
+	free(client);
+}
+
+/*
+ * Saves all dirty states and answers the clients waiting for it. The storage
+ * is pre-erased afterwards if enabled, the clients don't need to wait for it.
+ */
+static int state_daemon_save(struct state_daemon *daemon)
+{
+	struct state_list *state;
+	struct state_client *client;
+	bool pre_erase = false;
+	int ret = 0, err;
+
+	daemon->save_at = 0;
+
+	list_for_each_entry(state, &daemon->states->list, list) {
+		if (!state->state->dirty)
+			continue;
+
+		err = state_save(state->state);
+		if (err) {
+			pr_err("Failed to save state %s: %s\n", state->name,
+			       strerror(-err));
+			ret = err;
+			continue;
+		}
+		pre_erase |= state->state->storage.pre_erase;
+	}
+
+	list_for_each_entry(client, &daemon->clients, list) {
+		if (client->sync) {
+			dprintf(client->fd, ret ? "ERR %d\n" : "OK\n", -ret);
+			client->sync = false;
+		}
+	}
+
+	if (pre_erase) {
+		list_for_each_entry(state, &daemon->states->list, list)
+			state_pre_erase(state->state);
+	}
+
+	return ret;
+}
+
+static int state_daemon_dump(struct state_daemon *daemon, FILE *reply,
+			     const char *name)
+{
+	struct state_list *state, one, states;
+	char *buf = NULL, *line, *next;
+	size_t size;
+	FILE *out;
+	int ret;
+
+	if (name) {
+		list_for_each_entry(state, &daemon->states->list, list) {
+			if (!strcmp(state->name, name))
+				break;
+		}
+		if (&state->list == &daemon->states->list)
+			return -ENOENT;
+
+		/* A list with only a copy of the entry, which has to stay put */
+		one = *state;
+		INIT_LIST_HEAD(&states.list);
+		list_add(&one.list, &states.list);
+	}
+
+	out = open_memstream(&buf, &size);
+	if (!out)
+		return -errno;
+
+	if (name)
+		ret = state_list_dump(out, &states, 1, STATE_DUMP_PLAIN, false);
+	else
+		ret = state_list_dump(out, daemon->states, daemon->nr_states,
+				      STATE_DUMP_PLAIN, false);
+	fclose(out);
+
+	for (line = buf; !ret && *line; line = next) {
+		next = strchr(line, '\n');
+		*next++ = '\0';
+		fprintf(reply, "+%s\n", line);
+	}
+
+	free(buf);
+
+	return ret;
+}
+
+/* Handles a single request. Returns 1 if the answer is deferred. */
+static int state_daemon_request(struct state_daemon *daemon,
+				struct state_client *client, FILE *reply,
+				char *line)
+{
+	struct state_list *state;
+	char *arg, *val;
+	int ret;
+
+	pr_debug("request: %s\n", line);
+
+	if (!strcmp(line, "dump"))
+		return state_daemon_dump(daemon, reply, NULL);
+
+	if (!strncmp(line, "dump ", 5))
+		return state_daemon_dump(daemon, reply, line + 5);
+
+	if (!strcmp(line, "states")) {
+		list_for_each_entry(state, &daemon->states->list, list)
+			fprintf(reply, "+%s %s@%lld\n", state->name,
+				state->state->storage.path,
+				(long long)state->state->storage.offset);
+		return 0;
+	}
+
+	if (!strcmp(line, "sync")) {
+		if (!state_daemon_dirty(daemon))
+			return 0;
+
+		state_daemon_arm(daemon);
+		client->sync = true;
+		return 1;
+	}
+
+	if (!strncmp(line, "get ", 4)) {
+		arg = line + 4;
+		state = state_list_find(daemon->states, &arg);
+		val = state_get_var(state->state, arg);
+		if (!val)
+			return -ENOENT;
+
+		fprintf(reply, "+%s\n", val);
+		free(val);
+		return 0;
+	}
+
+	if (!strncmp(line, "set ", 4)) {
+		arg = line + 4;
+		val = strchr(arg, '=');
+		if (!val)
+			return -EINVAL;
+		*val++ = '\0';
+
+		state = state_list_find(daemon->states, &arg);
+		ret = state_set_var(state->state, arg, val);
+		if (ret)
+			return ret;
+
+		if (state->state->dirty)
+			state_daemon_arm(daemon);
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+/* Reads from the client and handles all complete requests */
+static int state_daemon_receive(struct state_daemon *daemon,
+				struct state_client *client)
+{
+	char *line, *end, *buf = NULL;
+	size_t size;
+	FILE *reply;
+	ssize_t now;
+	int ret;
+
+	now = read(client->fd, client->buf + client->len,
+		   sizeof(client->buf) - client->len);
+	if (now <= 0)
+		return now ? -errno : -ECONNRESET;
+
+	client->len += now;
+
+	/* Collect the answers to send them at once */
+	reply = open_memstream(&buf, &size);
+	if (!reply)
+		return -errno;
+
+	line = client->buf;
+	while ((end = memchr(line, '\n', client->buf + client->len - line))) {
+		*end = '\0';
+
+		ret = state_daemon_request(daemon, client, reply, line);
+		if (ret <= 0)
+			state_client_reply(reply, ret);
+
+		line = end + 1;
+	}
+
+	fclose(reply);
+	ret = state_client_send(client, buf, size);
+	free(buf);
+	if (ret)
+		return ret;
+
+	client->len -= line - client->buf;
+	if (client->len == sizeof(client->buf))
+		return -EMSGSIZE;
+
+	memmove(client->buf, line, client->len);
+
+	return 0;
+}
+
+/* Only root and the user running the daemon may access the states */
+static bool state_daemon_peer_allowed(int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+		pr_warn("Failed to get peer credentials: %m\n");
+		return false;
+	}
+
+	if (cred.uid == 0 || cred.uid == geteuid())
+		return true;
+
+	pr_warn("Rejecting connection of uid %u\n", cred.uid);
+
+	return false;
+}
+
+static int state_daemon_listen(const char *socket_path)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	mode_t mask;
+	int fd, ret;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		pr_err("Socket path too long: %s\n", socket_path);
+		return -ENAMETOOLONG;
+	}
+	strcpy(addr.sun_path, socket_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		ret = -errno;
+		pr_err("Failed to create socket: %m\n");
+		return ret;
+	}
+
+	/* We hold the lock, so a socket left behind is stale */
+	unlink(socket_path);
+
+	/* Create the socket accessible by its owner only */
+	mask = umask(077);
+	ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+
+	if (ret < 0 || listen(fd, 16) < 0) {
+		ret = -errno;
+		pr_err("Failed to listen on %s: %m\n", socket_path);
+		close(fd);
+		return ret;
+	}
+
+	return fd;
+}
+
+/**
+ * state_daemon - Serve the given states over a unix socket
+ * @param states The loaded states
+ * @param nr_states Number of states
+ * @param socket_path Path of the unix socket to listen on
+ * @param save_delay_ms Time to collect sets before saving them
+ * @return 0 when stopped by a signal, -errno on failure
+ *
+ * The daemon has to be the only user of the states' storage while running,
+ * so it should be called with the states locked for writing.
+ */
+int state_daemon(struct state_list *states, int nr_states,
+		 const char *socket_path, int save_delay_ms)
+{
+	struct state_daemon daemon = {
+		.states = states,
+		.nr_states = nr_states,
+		.save_delay_ms = save_delay_ms,
+	};
+	struct state_client *client, *tmp;
+	struct sigaction sa = {
+		.sa_handler = state_daemon_signal,
+	};
+	struct pollfd *pfds = NULL;
+	int listen_fd, nfds, timeout, i;
+	int ret = 0;
+
+	INIT_LIST_HEAD(&daemon.clients);
+
+	listen_fd = state_daemon_listen(socket_path);
+	if (listen_fd < 0)
+		return listen_fd;
+
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	pr_info("Serving states on %s\n", socket_path);
+
+	while (!state_daemon_stop) {
+		nfds = 1;
+		list_for_each_entry(client, &daemon.clients, list)
+			nfds++;
+
+		free(pfds);
+		pfds = xzalloc(nfds * sizeof(*pfds));
+		pfds[0].fd = listen_fd;
+		pfds[0].events = POLLIN;
+		i = 1;
+		list_for_each_entry(client, &daemon.clients, list) {
+			pfds[i].fd = client->fd;
+			pfds[i++].events = POLLIN;
+		}
+
+		timeout = -1;
+		if (daemon.save_at) {
+			uint64_t now = state_daemon_now();
+
+			timeout = daemon.save_at > now ? daemon.save_at - now : 0;
+		}
+
+		if (poll(pfds, nfds, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			pr_err("poll failed: %m\n");
+			break;
+		}
+
+		if (daemon.save_at && state_daemon_now() >= daemon.save_at)
+			state_daemon_save(&daemon);
+
+		/* Clients accepted below are not in pfds yet */
+		i = 1;
+		list_for_each_entry_safe(client, tmp, &daemon.clients, list) {
+			if (pfds[i++].revents &&
+			    state_daemon_receive(&daemon, client))
+				state_client_free(client);
+		}
+
+		if (pfds[0].revents & POLLIN) {
+			int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+			if (fd < 0) {
+				pr_warn("Failed to accept connection: %m\n");
+				continue;
+			}
+
+			if (!state_daemon_peer_allowed(fd)) {
+				close(fd);
+				continue;
+			}
+
+			client = xzalloc(sizeof(*client));
+			client->fd = fd;
+			list_add_tail(&client->list, &daemon.clients);
+		}
+	}
+
+	free(pfds);
+
+	if (state_daemon_dirty(&daemon))
+		state_daemon_save(&daemon);
+
+	list_for_each_entry_safe(client, tmp, &daemon.clients, list)
+		state_client_free(client);
+
+	close(listen_fd);
+	unlink(socket_path);
+
+	return ret;
+}
+
+/**
+ * state_client_connect - Connect to a running daemon
+ * @param socket_path Path of the daemon's unix socket
+ * @return The connection to pass to state_client_request(), NULL with errno
+ * set if no daemon is running
+ */
+FILE *state_client_connect(const char *socket_path)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	FILE *conn;
+	int fd, err;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	strcpy(addr.sun_path, socket_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return NULL;
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		goto err;
+
+	conn = fdopen(fd, "r");
+	if (conn)
+		return conn;
+
+err:
+	err = errno;
+	close(fd);
+	errno = err;
+	return NULL;
+}
+
+/**
+ * state_client_request - Send a request to the daemon
+ * @param conn The connection as returned by state_client_connect()
+ * @param out The data lines of the answer are written here
+ * @param fmt printf style format of the request
+ * @return 0 on success, -errno on failure
+ */
+int state_client_request(FILE *conn, FILE *out, const char *fmt, ...)
+{
+	char line[STATE_DAEMON_LINE_MAX];
+	va_list args;
+	int err;
+
+	va_start(args, fmt);
+	vdprintf(fileno(conn), fmt, args);
+	va_end(args);
+	dprintf(fileno(conn), "\n");
+
+	while (fgets(line, sizeof(line), conn)) {
+		if (line[0] == '+')
+			fputs(line + 1, out);
+		else if (!strcmp(line, "OK\n"))
+			return 0;
+		else if (sscanf(line, "ERR %d", &err) == 1)
+			return -err;
+		else
+			return -EPROTO;
+	}
+
+	return ferror(conn) ? -EIO : -ECONNRESET;
+}
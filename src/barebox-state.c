@@ -19,6 +19,9 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -26,464 +29,832 @@
 #include <string.h>
 #include <unistd.h>
 
-#include <sys/file.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
 #include <sys/types.h>
 
 #include <linux/fs.h>
+#include <linux/magic.h>
 #include <mtd/mtd-abi.h>
 
 #include <barebox-state/state.h>
 #include <barebox-state.h>
 #include <dt/dt.h>
+#include <dt/fdt.h>
 #include <state.h>
 
-#define BAREBOX_STATE_LOCKFILE "/run/barebox-state.lock"
-
-struct state_variable;
+enum opt {
+	OPT_DUMP_SHELL = UCHAR_MAX + 1,
+	OPT_VERSION    = UCHAR_MAX + 2,
+	OPT_CHECK      = UCHAR_MAX + 3,
+	OPT_DAEMON     = UCHAR_MAX + 4,
+	OPT_SOCKET     = UCHAR_MAX + 5,
+	OPT_SAVE_DELAY = UCHAR_MAX + 6,
+	OPT_DUMP_JSON  = UCHAR_MAX + 7,
+	OPT_EXPORT_DTB = UCHAR_MAX + 8,
+	OPT_WATCH      = UCHAR_MAX + 9,
+	OPT_WATCH_INTERVAL = UCHAR_MAX + 10,
+};
 
-static int __state_uint8_set(struct state_variable *var, const char *val);
-static int __state_uint32_set(struct state_variable *var, const char *val);
-static char *__state_uint32_get(struct state_variable *var);
-static int __state_enum32_set(struct state_variable *sv, const char *val);
-static char *__state_enum32_get(struct state_variable *var);
-static void __state_enum32_info(struct state_variable *var);
-static int __state_mac_set(struct state_variable *var, const char *val);
-static char *__state_mac_get(struct state_variable *var);
-static int __state_string_set(struct state_variable *var, const char *val);
-static char *__state_string_get(struct state_variable *var);
+static struct option long_options[] = {
+	{"get",		required_argument,	0,	'g' },
+	{"set",		required_argument,	0,	's' },
+	{"name",	required_argument,	0,	'n' },
+	{"input",	required_argument,	0,	'i' },
+	{"dump",	no_argument,		0,	'd' },
+	{"dump-shell",	no_argument,		0,	OPT_DUMP_SHELL },
+	{"dump-json",	no_argument,		0,	OPT_DUMP_JSON },
+	{"force",	no_argument,		0,	'f' },
+	{"check",	no_argument,		0,	OPT_CHECK },
+	{"export-dtb",	required_argument,	0,	OPT_EXPORT_DTB },
+	{"watch",	no_argument,		0,	OPT_WATCH },
+	{"watch-interval", required_argument,	0,	OPT_WATCH_INTERVAL },
+	{"daemon",	no_argument,		0,	OPT_DAEMON },
+	{"socket",	required_argument,	0,	OPT_SOCKET },
+	{"save-delay",	required_argument,	0,	OPT_SAVE_DELAY },
+	{"verbose",	no_argument,		0,	'v' },
+	{"quiet",	no_argument,		0,	'q' },
+	{"version",	no_argument,		0,	OPT_VERSION },
+	{"help",	no_argument,		0,	'h' },
+	{ }
+};
 
-struct variable_str_type {
-	enum state_variable_type type;
-	char *type_name;
+static void usage(char *name)
+{
+	printf(
+"Usage: %s [OPTIONS]\n"
+"\n"
+"-g, --get <variable>                      get the value of a variable\n"
+"-s, --set <variable>=<value>              set the value of a variable\n"
+"-n, --name <name>                         specify the state to use (default=\"state\"). Multiple states are allowed.\n"
+"-i, --input <name>                        load the devicetree from a file instead of using the system devicetree.\n"
+"-d, --dump                                dump the state\n"
+"--dump-shell                              dump the state suitable for shell sourcing\n"
+"--dump-json                               dump all states as JSON object\n"
+"-f, --force                               do not check for state manipulation via the HMAC\n"
+"--check                                   check that all redundant copies are valid and up to date\n"
+"--export-dtb <file>                       write a devicetree with only the states and their backends to <file>\n"
+"--watch                                   keep the states loaded and print every variable that changes\n"
+"--watch-interval <ms>                     how often --watch probes backends without change notification (default=1000)\n"
+"--daemon                                  keep the states loaded and serve requests on a unix socket\n"
+"--socket <path>                           unix socket of the daemon (default=\"" BAREBOX_STATE_SOCKET "\")\n"
+"--save-delay <ms>                         time the daemon collects changes before saving them (default=100)\n"
+"-v, --verbose                             increase verbosity\n"
+"-q, --quiet                               decrease verbosity\n"
+"--version                                 display version\n"
+"-h, --help                                this help\n",
+	name);
+}
 
-	char *(*get)(struct state_variable *var);
-	int (*set)(struct state_variable *var, const char *val);
-	void (*info)(struct state_variable *var);
-};
+#define state_for_each_var(state, var) \
+	list_for_each_entry(var, &(state)->variables, list)
 
-static struct variable_str_type types[] =  {
-	{
-		.type = STATE_VARIABLE_TYPE_UINT8,
-		.type_name = "uint8",
-		.set = __state_uint8_set,
-		.get = __state_uint32_get,
-	}, {
-		.type = STATE_VARIABLE_TYPE_UINT32,
-		.type_name = "uint32",
-		.set = __state_uint32_set,
-		.get = __state_uint32_get,
-	}, {
-		.type = STATE_VARIABLE_TYPE_ENUM32,
-		.type_name = "enum32",
-		.set = __state_enum32_set,
-		.get = __state_enum32_get,
-		.info = __state_enum32_info,
-	}, {
-		.type = STATE_VARIABLE_TYPE_MAC,
-		.type_name = "mac",
-		.set = __state_mac_set,
-		.get = __state_mac_get,
-	}, {
-		.type = STATE_VARIABLE_TYPE_STRING,
-		.type_name = "string",
-		.set = __state_string_set,
-		.get = __state_string_get,
-	},
+struct state_set_get {
+	char *arg;
+	int get;
+	struct list_head list;
 };
 
-static struct variable_str_type *state_find_type(enum state_variable_type type)
+/*
+ * Dumps the state the daemon serves for @state, with the name of @state as
+ * prefix if there are more than one like a local dump.
+ */
+static int state_client_dump(FILE *conn, struct state_list *state,
+			     int nr_states)
 {
-	int i;
+	char *buf = NULL, *line, *next;
+	size_t size;
+	FILE *out;
+	int ret;
 
-	for (i = 0; i < ARRAY_SIZE(types); i++) {
-		if (type == types[i].type) {
-			return &types[i];
-		}
+	out = open_memstream(&buf, &size);
+	if (!out)
+		return -errno;
+
+	ret = state_client_request(conn, out, "dump %s", state->served);
+	fclose(out);
+
+	for (line = buf; !ret && *line; line = next) {
+		next = strchr(line, '\n');
+		*next++ = '\0';
+		if (nr_states > 1)
+			printf("%s.", state->name);
+		printf("%s\n", line);
 	}
 
-	return NULL;
+	free(buf);
+
+	return ret;
 }
 
-static int __state_uint32_set(struct state_variable *var, const char *val)
+/*
+ * Handles --dump, --get and --set by a running daemon. Without @states the
+ * daemon's own states are used, the given states otherwise, which all have
+ * to be served by the daemon. Returns the exit code of the program.
+ */
+static int state_client_run(FILE *conn, int do_dump, struct list_head *sg_list,
+			    struct state_list *states, int nr_states)
 {
-	struct state_uint32 *su32 = to_state_uint32(var);
+	struct state_list *state;
+	struct state_set_get *sg;
+	bool dirty = false;
+	char *arg;
+	int ret;
 
-	su32->value = strtoul(val, NULL, 0);
+	if (do_dump && !states) {
+		ret = state_client_request(conn, stdout, "dump");
+		if (ret) {
+			pr_err("Failed to dump state: %s\n", strerror(-ret));
+			return 1;
+		}
+	} else if (do_dump) {
+		list_for_each_entry(state, &states->list, list) {
+			ret = state_client_dump(conn, state, nr_states);
+			if (ret) {
+				pr_err("Failed to dump state: %s\n",
+				       strerror(-ret));
+				return 1;
+			}
+		}
+	}
 
-	return 0;
-}
+	list_for_each_entry(sg, sg_list, list) {
+		if (!sg->get && !strchr(sg->arg, '=')) {
+			pr_err("usage: -s var=val\n");
+			return 1;
+		}
 
-static int __state_uint8_set(struct state_variable *var, const char *val)
-{
-	struct state_uint32 *su32 = to_state_uint32(var);
-	unsigned long num;
+		/* Always name the state, the daemon's first one may differ */
+		if (states) {
+			arg = sg->arg;
+			state = state_list_find(states, &arg);
+			arg = basprintf("%s.%s", state->served, arg);
+		} else {
+			arg = xstrdup(sg->arg);
+		}
 
-	num = strtoul(val, NULL, 0);
-	if (num > UINT8_MAX)
-		return -ERANGE;
+		ret = state_client_request(conn, stdout, "%s %s",
+					   sg->get ? "get" : "set", arg);
+		free(arg);
+		if (!sg->get)
+			dirty = true;
+		if (ret == -ENOENT && sg->get) {
+			pr_err("no such variable: %s\n", sg->arg);
+			return 1;
+		}
+		if (ret) {
+			pr_err("Failed to %s %s: %s\n", sg->get ? "get" : "set",
+			       sg->arg, strerror(-ret));
+			return 1;
+		}
+	}
 
-	su32->value = num;
+	/* Return only after the changes are stored */
+	if (dirty) {
+		ret = state_client_request(conn, stdout, "sync");
+		if (ret) {
+			pr_err("Failed to save state: %s\n", strerror(-ret));
+			return 1;
+		}
+	}
 
 	return 0;
 }
 
-static char *__state_uint32_get(struct state_variable *var)
+/*
+ * Finds out which of @states the daemon on @conn serves. The daemon holds the
+ * lock of their backends as long as it runs, so they can only be accessed
+ * through it. The name of the daemon's state is stored in the served member.
+ * Returns the number of served states or a negative error code.
+ */
+static int state_client_served(FILE *conn, struct state_list *states,
+			       const char *dtb)
 {
-	struct state_uint32 *su32 = to_state_uint32(var);
-	char *str;
-	int ret;
+	struct device_node *root, *node;
+	struct state_list *state;
+	char *buf = NULL, *line, *sep, *backend, *path;
+	size_t len, size;
+	off_t offset;
+	int ret, served = 0;
+	FILE *out;
+
+	out = open_memstream(&buf, &len);
+	if (!out)
+		return -errno;
+
+	ret = state_client_request(conn, out, "states");
+	fclose(out);
+	if (ret)
+		goto out;
 
-	ret = asprintf(&str, "%u", su32->value);
-	if (ret < 0)
-		return ERR_PTR(-ENOMEM);
+	/* "<state> <backend>@<offset>" lines, terminated for strcmp() */
+	for (line = buf; (line = strchr(line, '\n')); line++)
+		*line = '\0';
 
-	return str;
-}
+	root = state_read_devicetree(dtb);
+	if (IS_ERR(root)) {
+		ret = PTR_ERR(root);
+		goto out;
+	}
 
+	list_for_each_entry(state, &states->list, list) {
+		node = state_find_node(root, state->name);
+		if (IS_ERR(node)) {
+			ret = PTR_ERR(node);
+			break;
+		}
 
-static int __state_enum32_set(struct state_variable *sv, const char *val)
-{
-	struct state_enum32 *enum32 = to_state_enum32(sv);
-	int i;
+		path = state_backend_of_node(node, &offset, &size);
+		if (IS_ERR(path)) {
+			ret = PTR_ERR(path);
+			break;
+		}
+
+		backend = basprintf("%s@%lld", path, (long long)offset);
+		free(path);
 
-	for (i = 0; i < enum32->num_names; i++) {
-		if (!strcmp(enum32->names[i], val)) {
-			enum32->value = i;
-			return 0;
+		for (line = buf; line < buf + len; line += strlen(line) + 1) {
+			sep = strchr(line, ' ');
+			if (sep && !strcmp(sep + 1, backend)) {
+				state->served = xstrndup(line, sep - line);
+				served++;
+				break;
+			}
 		}
+		free(backend);
+
+		/* The default state is known by the daemon's name */
+		if (!state->name && state->served)
+			state->name = state->served;
 	}
 
-	return -EINVAL;
+	state_put_devicetree();
+out:
+	free(buf);
+
+	return ret ? ret : served;
 }
 
-static char *__state_enum32_get(struct state_variable *var)
+/*
+ * Looks up the state a variable argument refers to. If *arg starts with the
+ * name of one of the states followed by a '.', *arg is advanced behind it.
+ * The first state is used otherwise.
+ */
+struct state_list *state_list_find(struct state_list *states, char **arg)
 {
-	struct state_enum32 *enum32 = to_state_enum32(var);
-	char *str;
-	int ret;
+	struct state_list *state;
+	char *statename_end = strchr(*arg, '.');
+	int statename_len;
+
+	if (statename_end) {
+		statename_len = statename_end - *arg;
 
-	ret = asprintf(&str, "%s", enum32->names[enum32->value]);
-	if (ret < 0)
-		return ERR_PTR(-ENOMEM);
+		list_for_each_entry(state, &states->list, list) {
+			if (strlen(state->name) == statename_len &&
+			    !strncmp(state->name, *arg, statename_len)) {
+				*arg = statename_end + 1;
+				return state;
+			}
+		}
+	}
 
-	return str;
+	return list_first_entry(&states->list, struct state_list, list);
 }
 
-static void __state_enum32_info(struct state_variable *var)
+/* Writes a variable name with "." replaced by "_" to make it shell compatible */
+static void state_put_shell_name(FILE *out, const char *name)
 {
-	struct state_enum32 *enum32 = to_state_enum32(var);
-	int i;
-
-	printf(", values=[");
-
-	for (i = 0; i < enum32->num_names; i++)
-		printf("%s%s", enum32->names[i],
-				i == enum32->num_names - 1 ? "" : ",");
-	printf("]");
+	for (; *name; name++)
+		fputc(*name == '.' ? '_' : *name, out);
 }
 
-static int string_to_ethaddr(const char *str, uint8_t enetaddr[6])
+static int state_dump_var(FILE *out, struct state_list *state,
+			  struct state_variable *v, int nr_states,
+			  enum state_dump_format format, bool verbose)
 {
-	int reg;
-	char *e;
+	struct variable_str_type *vtype;
 
-	if (!str || strlen(str) != 17) {
-		memset(enetaddr, 0, 6);
+	vtype = state_find_type(v->type->type);
+	if (!vtype) {
+		pr_err("no such type: %d\n", v->type->type);
 		return -EINVAL;
 	}
 
-	if (str[2] != ':' || str[5] != ':' || str[8] != ':' ||
-			str[11] != ':' || str[14] != ':')
-		return -EINVAL;
-
-	for (reg = 0; reg < 6; ++reg) {
-		enetaddr[reg] = strtoul(str, &e, 16);
-		str = e + 1;
+	switch (format) {
+	case STATE_DUMP_PLAIN:
+		if (nr_states > 1)
+			fprintf(out, "%s.", state->name);
+		fprintf(out, "%s=", v->name);
+		vtype->put(v, out, false);
+		if (verbose) {
+			fprintf(out, ", type=%s", vtype->type_name);
+			if (vtype->info)
+				vtype->info(v, out);
+		}
+		fputc('\n', out);
+		break;
+	case STATE_DUMP_SHELL:
+		fprintf(out, "%s_", state->name);
+		state_put_shell_name(out, v->name);
+		fputs("=\"", out);
+		vtype->put(v, out, false);
+		fputs("\"\n", out);
+		break;
+	case STATE_DUMP_JSON:
+		fprintf(out, "    \"%s\": ", v->name);
+		vtype->put(v, out, true);
+		break;
 	}
 
 	return 0;
 }
 
-static int __state_mac_set(struct state_variable *var, const char *val)
+/*
+ * Prints all variables of all states. In the plain format of --dump the
+ * variable names are prefixed with the state name if there is more than one
+ * state. The JSON format is an object of all states, each an object of all
+ * its variables by name.
+ */
+int state_list_dump(FILE *out, struct state_list *states, int nr_states,
+		    enum state_dump_format format, bool verbose)
 {
-	struct state_mac *mac = to_state_mac(var);
-	uint8_t mac_save[6];
+	struct state_list *state;
+	struct state_variable *v;
+	const char *state_sep = "", *var_sep;
 	int ret;
 
-	ret = string_to_ethaddr(val, mac_save);
-	if (ret)
-		return ret;
+	if (format == STATE_DUMP_JSON)
+		fputs("{", out);
 
-	memcpy(mac->value, mac_save, ARRAY_SIZE(mac_save));
+	list_for_each_entry(state, &states->list, list) {
+		if (format == STATE_DUMP_JSON) {
+			fprintf(out, "%s\n  \"%s\": {", state_sep, state->name);
+			state_sep = ",";
+		}
 
-	return 0;
-}
+		var_sep = "";
+		state_for_each_var(state->state, v) {
+			if (format == STATE_DUMP_JSON) {
+				fprintf(out, "%s\n", var_sep);
+				var_sep = ",";
+			}
 
-static char *__state_mac_get(struct state_variable *var)
-{
-	struct state_mac *mac = to_state_mac(var);
-	char *str;
-	int ret;
+			ret = state_dump_var(out, state, v, nr_states, format,
+					     verbose);
+			if (ret)
+				return ret;
+		}
 
-	ret = asprintf(&str, "%02x:%02x:%02x:%02x:%02x:%02x",
-			mac->value[0], mac->value[1], mac->value[2],
-			mac->value[3], mac->value[4], mac->value[5]);
-	if (ret < 0)
-		return ERR_PTR(-ENOMEM);
+		if (format == STATE_DUMP_JSON)
+			fputs("\n  }", out);
+	}
 
-	return str;
+	if (format == STATE_DUMP_JSON)
+		fputs("\n}\n", out);
+
+	return 0;
 }
 
-static int __state_string_set(struct state_variable *sv, const char *val)
+static void state_export_copy_properties(struct device_node *to,
+					 const struct device_node *from)
 {
-	struct state_string *string = to_state_string(sv);
-	int ret;
-
-	ret = state_string_copy_to_raw(string, val);
-	if (ret)
-		return ret;
-	free(string->value);
-	string->value = xstrdup(val);
+	struct property *p;
 
-	return 0;
+	list_for_each_entry(p, &from->properties, list)
+		of_new_property(to, p->name, p->value, p->length);
 }
 
-static char *__state_string_get(struct state_variable *var)
+/*
+ * Returns the copy of @node in the exported tree @root. Missing parents are
+ * copied with all their properties, but without their other children.
+ */
+static struct device_node *state_export_node(struct device_node *root,
+					     struct device_node *node)
 {
-	struct state_string *string = to_state_string(var);
-	char *str;
+	struct device_node *parent, *copy;
+
+	if (!node->parent)
+		return root;
+
+	parent = state_export_node(root, node->parent);
 
-	if (string->raw[0])
-		str = strndup(string->raw, string->var.size);
-	else
-		str = strdup("");
+	copy = of_get_child_by_name(parent, node->name);
+	if (copy)
+		return copy;
 
-	if (!str)
-		return ERR_PTR(-ENOMEM);
+	copy = of_new_node(parent, node->name);
+	state_export_copy_properties(copy, node);
 
-	return str;
+	return copy;
 }
 
-char *state_get_var(struct state *state, const char *var)
+static void state_export_children(struct device_node *to,
+				  const struct device_node *from)
 {
-	struct state_variable *sv;
-	struct variable_str_type *vtype;
+	struct device_node *child, *copy;
+
+	for_each_child_of_node(from, child) {
+		copy = of_new_node(to, child->name);
+		state_export_copy_properties(copy, child);
+		state_export_children(copy, child);
+	}
+}
+
+struct state_loader {
+	struct state_list *state;
+	struct device_node *node;
+	bool readonly;
+	bool auth;
+	pthread_t thread;
+	bool threaded;
+};
 
-	sv = state_find_var(state, var);
-	if (IS_ERR(sv))
-		return NULL;
+static void *state_loader_run(void *data)
+{
+	struct state_loader *loader = data;
 
-	vtype = state_find_type(sv->type->type);
-	if (!vtype)
-		return NULL;
+	loader->state->state = state_get_node(loader->node, loader->readonly,
+					      loader->auth,
+					      &loader->state->lock);
 
-	return vtype->get(sv);
+	return NULL;
 }
 
-static int state_set_var(struct state *state, const char *var, const char *val)
+/*
+ * Gets all states from the devicetree, which is read only once. The states
+ * are on different backends or at least at different offsets, so they are
+ * created and loaded in parallel threads. Returns 0 if all states could be
+ * created.
+ */
+static int state_list_get(struct state_list *states, int nr_states,
+			  const char *dtb, bool readonly, bool auth)
 {
-	struct state_variable *sv;
-	struct variable_str_type *vtype;
-	char *oldval;
-	int ret;
+	struct state_loader *loaders, *loader;
+	struct device_node *root, *node;
+	struct state_list *state;
+	int ret = 0;
+
+	root = state_read_devicetree(dtb);
+	if (IS_ERR(root))
+		return PTR_ERR(root);
+
+	loaders = xzalloc(nr_states * sizeof(*loaders));
+	loader = loaders;
+	list_for_each_entry(state, &states->list, list) {
+		node = state_find_node(root, state->name);
+		if (IS_ERR(node)) {
+			ret = PTR_ERR(node);
+			break;
+		}
 
-	sv = state_find_var(state, var);
-	if (IS_ERR(sv))
-		return PTR_ERR(sv);
+		loader->state = state;
+		loader->node = node;
+		loader->readonly = readonly;
+		loader->auth = auth;
+
+		/* Load in this thread if there is nothing to wait for */
+		if (nr_states > 1 &&
+		    !pthread_create(&loader->thread, NULL, state_loader_run,
+				    loader))
+			loader->threaded = true;
+		else
+			state_loader_run(loader);
+		loader++;
+	}
 
-	vtype = state_find_type(sv->type->type);
-	if (!vtype)
-		return -ENODEV;
+	for (loader = loaders; loader < loaders + nr_states; loader++) {
+		if (loader->threaded)
+			pthread_join(loader->thread, NULL);
 
-	if (!vtype->set)
-		return -EPERM;
+		state = loader->state;
+		if (!state)
+			continue;
 
-	oldval = vtype->get(sv);
-	if (!IS_ERR(oldval)) {
-		bool equal = strcmp(oldval, val) == 0;
-		free(oldval);
-		if (equal)
-			return 0;
+		if (IS_ERR(state->state))
+			ret = PTR_ERR(state->state);
+		else if (!state->name)
+			state->name = state->state->name;
 	}
 
-	ret = vtype->set(sv, val);
-	if (ret)
-		return ret;
-
-	state->dirty = 1;
+	free(loaders);
 
-	return 0;
+	return ret;
 }
 
-
-struct state *state_get(const char *name, const char *filename, bool readonly, bool auth)
+/*
+ * Writes a devicetree which only contains the given states, their aliases
+ * and the nodes needed to resolve their backends to @filename. It is meant
+ * to be installed as state.dtb into the ESP for systems without devicetree.
+ */
+static int state_export_dtb(const char *dtb, struct state_list *states,
+			    const char *filename)
 {
-	struct device_node *root, *node;
-	struct state *state;
-	int ret;
+	struct device_node *root, *export, *aliases, *export_aliases = NULL;
+	struct device_node *node, *backend;
+	struct state_list *state;
+	struct property *p;
+	void *fdt = NULL;
+	int fd, ret;
 
-	if (filename) {
-		void *fdt;
+	root = state_read_devicetree(dtb);
+	if (IS_ERR(root))
+		return PTR_ERR(root);
 
-		fdt = read_file(filename, NULL);
-		if (!fdt) {
-			pr_err("Unable to read devicetree file '%s'\n",
-			       filename);
-			return ERR_PTR(-ENOENT);
-		}
+	export = of_new_node(NULL, NULL);
+	state_export_copy_properties(export, root);
 
-		root = of_unflatten_dtb(fdt);
-		free(fdt);
-		if (IS_ERR(root)) {
-			pr_err("Unable to read devicetree. %s\n",
-			       strerror(-PTR_ERR(root)));
-			return ERR_CAST(root);
-		}
-	} else {
-		root = of_read_proc_devicetree();
-
-		/* No device-tree in procfs / sysfs, try dtb file in the ESP */
-		if (-PTR_ERR(root) == ENOENT) {
-			const char *paths[] = {
-				/* default mount paths used by systemd */
-				"/boot/EFI/BAREBOX/state.dtb",
-				"/boot/efi/EFI/BAREBOX/state.dtb",
-				"/efi/EFI/BAREBOX/state.dtb",
-				NULL
-			};
-			void *fdt;
-			int i;
-
-			for (i = 0; paths[i]; ++i) {
-				fdt = read_file(paths[i], NULL);
-				if (fdt)
-					break;
-			}
-			if (fdt) {
-				root = of_unflatten_dtb(fdt);
-				free(fdt);
-			}
-			else
-				root = ERR_PTR(-ENOENT);
-		}
-		if (IS_ERR(root)) {
-			pr_err("Unable to read devicetree. %s\n",
-			       strerror(-PTR_ERR(root)));
-			return ERR_CAST(root);
+	aliases = of_find_node_by_path_from(root, "/aliases");
+
+	list_for_each_entry(state, &states->list, list) {
+		node = state_find_node(root, state->name);
+		if (IS_ERR(node)) {
+			ret = PTR_ERR(node);
+			goto out;
 		}
-	}
 
-	of_set_root_node(root);
+		if (of_find_node_by_path_from(export, node->full_name))
+			continue;
+
+		state_export_children(state_export_node(export, node), node);
 
-	if (name) {
-		node = of_find_node_by_path_or_alias(root, name);
-		if (!node) {
-			pr_err("no such node: %s\n", name);
-			return ERR_PTR(-ENOENT);
+		backend = of_parse_phandle(node, "backend", 0);
+		if (!backend) {
+			pr_err("%s: Cannot resolve \"backend\" phandle\n",
+			       node->full_name);
+			ret = -EINVAL;
+			goto out;
 		}
-	} else {
-		node = of_find_node_by_path_or_alias(root, "state");
-		if (!node)
-			node = of_find_node_by_path_or_alias(root, "/state");
-		if (!node) {
-			pr_err("Neither /aliases/state nor /state found\n");
-			return ERR_PTR(-ENOENT);
+		state_export_node(export, backend);
+
+		if (!aliases)
+			continue;
+
+		list_for_each_entry(p, &aliases->properties, list) {
+			const char *path = p->value;
+
+			if (!p->length || path[p->length - 1] ||
+			    of_find_node_by_path_from(root, path) != node)
+				continue;
+
+			if (!export_aliases)
+				export_aliases = of_new_node(export, "aliases");
+			of_new_property(export_aliases, p->name, p->value,
+					p->length);
 		}
 	}
 
-	pr_debug("found state node %s:\n", node->full_name);
-	if (pr_level_get() > 6)
-		of_print_nodes(node, 0);
+	fdt = of_flatten_dtb(export);
+	if (!fdt) {
+		ret = -ENOMEM;
+		goto out;
+	}
 
-	state = state_new_from_node(node, readonly);
-	if (IS_ERR(state)) {
-		pr_err("unable to initialize state: %s\n",
-				strerror(-PTR_ERR(state)));
-		return ERR_CAST(state);
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		ret = -errno;
+		pr_err("Failed to open %s: %m\n", filename);
+		goto out;
 	}
 
-	if (auth)
-		ret = state_load(state);
-	else
-		ret = state_load_no_auth(state);
+	ret = write_full(fd, fdt,
+			 fdt32_to_cpu(((struct fdt_header *)fdt)->totalsize));
+	if (ret < 0) {
+		ret = -errno;
+		pr_err("Failed to write %s: %m\n", filename);
+	} else {
+		ret = 0;
+	}
 
-	if (ret)
-		pr_err("Failed to load persistent state, continuing with defaults, %d\n", ret);
+	close(fd);
+out:
+	free(fdt);
+	of_delete_node(export);
+	state_put_devicetree();
 
-	return state;
+	return ret;
 }
 
-enum opt {
-	OPT_DUMP_SHELL = UCHAR_MAX + 1,
-	OPT_VERSION    = UCHAR_MAX + 2,
+struct state_watch {
+	struct state_list *state;
+	/* The raw values of all variables as printed last */
+	uint8_t *values;
+	/* Writes to the backend are signalled by inotify */
+	bool notify;
 };
 
-static struct option long_options[] = {
-	{"get",		required_argument,	0,	'g' },
-	{"set",		required_argument,	0,	's' },
-	{"name",	required_argument,	0,	'n' },
-	{"input",	required_argument,	0,	'i' },
-	{"dump",	no_argument,		0,	'd' },
-	{"dump-shell",	no_argument,		0,	OPT_DUMP_SHELL },
-	{"force",	no_argument,		0,	'f' },
-	{"verbose",	no_argument,		0,	'v' },
-	{"quiet",	no_argument,		0,	'q' },
-	{"version",	no_argument,		0,	OPT_VERSION },
-	{"help",	no_argument,		0,	'h' },
-	{ }
-};
+static volatile sig_atomic_t state_watch_stop;
 
-static void usage(char *name)
+static void state_watch_signal(int sig)
 {
-	printf(
-"Usage: %s [OPTIONS]\n"
-"\n"
-"-g, --get <variable>                      get the value of a variable\n"
-"-s, --set <variable>=<value>              set the value of a variable\n"
-"-n, --name <name>                         specify the state to use (default=\"state\"). Multiple states are allowed.\n"
-"-i, --input <name>                        load the devicetree from a file instead of using the system devicetree.\n"
-"-d, --dump                                dump the state\n"
-"--dump-shell                              dump the state suitable for shell sourcing\n"
-"-f, --force                               do not check for state manipulation via the HMAC\n"
-"-v, --verbose                             increase verbosity\n"
-"-q, --quiet                               decrease verbosity\n"
-"--version                                 display version\n"
-"-h, --help                                this help\n",
-	name);
+	state_watch_stop = 1;
 }
 
-#define state_for_each_var(state, var) \
-	list_for_each_entry(var, &(state)->variables, list)
+/*
+ * inotify reports writes to files and block devices, but not to MTD devices
+ * or to files in sysfs, like EEPROMs exposed by nvmem. Those are probed
+ * periodically instead.
+ */
+static bool state_watch_add_notify(int notify_fd, const char *path)
+{
+	struct statfs sfs;
+	struct stat s;
 
-struct state_set_get {
-	char *arg;
-	int get;
-	struct list_head list;
-};
+	if (stat(path, &s) < 0 || statfs(path, &sfs) < 0)
+		return false;
 
-struct state_list {
-	const char *name;
-	struct state *state;
-	struct list_head list;
-};
+	if (!S_ISBLK(s.st_mode) &&
+	    !(S_ISREG(s.st_mode) && sfs.f_type != SYSFS_MAGIC))
+		return false;
 
-int main(int argc, char *argv[])
+	return inotify_add_watch(notify_fd, path, IN_MODIFY | IN_CLOSE_WRITE) >= 0;
+}
+
+static void state_watch_snapshot(struct state_watch *watch)
+{
+	struct state_variable *v;
+	size_t size = 0;
+
+	state_for_each_var(watch->state->state, v)
+		size += v->size;
+
+	watch->values = xmalloc(size);
+
+	size = 0;
+	state_for_each_var(watch->state->state, v) {
+		memcpy(watch->values + size, v->raw, v->size);
+		size += v->size;
+	}
+}
+
+/* Prints the variables whose values differ from the snapshot and updates it */
+static int state_watch_print(FILE *out, struct state_watch *watch,
+			     int nr_states)
 {
 	struct state_variable *v;
+	uint8_t *value = watch->values;
+	int ret;
+
+	state_for_each_var(watch->state->state, v) {
+		if (memcmp(value, v->raw, v->size)) {
+			ret = state_dump_var(out, watch->state, v, nr_states,
+					     STATE_DUMP_PLAIN, false);
+			if (ret)
+				return ret;
+			memcpy(value, v->raw, v->size);
+		}
+		value += v->size;
+	}
+
+	return 0;
+}
+
+/*
+ * Reloads the state if its storage changed. Returns 1 if it was reloaded, 0
+ * if unchanged, -errno otherwise. The backend is only locked for reading
+ * while doing so, the storage is left to writers otherwise.
+ */
+static int state_watch_reload(struct state_watch *watch, bool auth)
+{
+	struct state *state = watch->state->state;
+	struct state_lock *lock;
+	int ret;
+
+	ret = state_lock(state, false, &lock);
+	if (ret)
+		return ret;
+
+	ret = state_storage_probe(&state->storage);
+	if (ret > 0) {
+		if (auth)
+			ret = state_load(state);
+		else
+			ret = state_load_no_auth(state);
+		if (!ret)
+			ret = 1;
+	}
+
+	state_unlock(lock);
+
+	return ret;
+}
+
+/*
+ * Keeps the states loaded and prints a line as printed by --dump for every
+ * variable that changes. Storage changes are detected by inotify where
+ * possible and by probing the storage every @interval_ms otherwise. Probing
+ * only reads the few bytes every write touches, the state is only reloaded
+ * once they change.
+ */
+static int state_watch(struct state_list *states, int nr_states, bool auth,
+		       int interval_ms)
+{
+	struct sigaction sa = {
+		.sa_handler = state_watch_signal,
+	};
+	struct state_watch *watches, *watch;
+	struct state_list *state;
+	struct pollfd pfd;
+	char events[4096];
+	int i, notify_fd, timeout = -1;
+	int ret = 0;
+
+	notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (notify_fd < 0)
+		pr_warn("Failed to initialize inotify, probing only: %m\n");
+
+	watches = xzalloc(nr_states * sizeof(*watches));
+	watch = watches;
+	list_for_each_entry(state, &states->list, list) {
+		/* Do not keep writers out while waiting */
+		state_unlock(state->lock);
+		state->lock = NULL;
+
+		watch->state = state;
+		state_watch_snapshot(watch);
+		if (notify_fd >= 0)
+			watch->notify = state_watch_add_notify(notify_fd,
+						state->state->storage.path);
+		if (!watch->notify)
+			timeout = interval_ms;
+		watch++;
+	}
+
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
+	pfd.fd = notify_fd;
+	pfd.events = POLLIN;
+
+	while (!state_watch_stop) {
+		pfd.revents = 0;
+		if (poll(&pfd, notify_fd >= 0 ? 1 : 0, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			pr_err("poll failed: %m\n");
+			break;
+		}
+
+		/* Only wakeups are of interest, not the events themselves */
+		if (pfd.revents & POLLIN)
+			while (read(notify_fd, events, sizeof(events)) > 0)
+				;
+
+		for (i = 0; i < nr_states; i++) {
+			watch = &watches[i];
+
+			ret = state_watch_reload(watch, auth);
+			if (ret < 0)
+				pr_warn("%s: Failed to reload state: %s\n",
+					watch->state->name, strerror(-ret));
+			if (ret <= 0)
+				continue;
+
+			ret = state_watch_print(stdout, watch, nr_states);
+			if (ret)
+				goto out;
+		}
+
+		ret = 0;
+		if (fflush(stdout) == EOF) {
+			ret = -errno;
+			break;
+		}
+	}
+
+out:
+	for (i = 0; i < nr_states; i++)
+		free(watches[i].values);
+	free(watches);
+	if (notify_fd >= 0)
+		close(notify_fd);
+
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
 	int ret, c, option_index;
-	int do_dump = 0, do_dump_shell = 0;
+	int do_dump = 0, do_dump_shell = 0, do_dump_json = 0, do_check = 0;
+	int do_daemon = 0, do_watch = 0;
 	struct state_set_get *sg;
 	struct list_head sg_list;
 	struct state_list state_list;
 	struct state_list *state;
-	int lock_fd;
 	int nr_states = 0;
 	bool readonly = true;
+	bool pre_erase = false;
+	pid_t pid = -1;
 	int pr_level = 5;
 	int auth = 1;
 	const char *dtb = NULL;
+	const char *export_dtb = NULL;
+	const char *socket_path = BAREBOX_STATE_SOCKET;
+	int save_delay_ms = 100;
+	int watch_interval_ms = 1000;
+	FILE *conn;
 
 	INIT_LIST_HEAD(&sg_list);
 	INIT_LIST_HEAD(&state_list.list);
@@ -525,6 +896,35 @@ int main(int argc, char *argv[])
 		case OPT_DUMP_SHELL:
 			do_dump_shell = 1;
 			break;
+		case OPT_DUMP_JSON:
+			do_dump_json = 1;
+			break;
+		case OPT_EXPORT_DTB:
+			export_dtb = optarg;
+			break;
+		case OPT_CHECK:
+			do_check = 1;
+			break;
+		case OPT_WATCH:
+			do_watch = 1;
+			break;
+		case OPT_WATCH_INTERVAL:
+			watch_interval_ms = atoi(optarg);
+			if (watch_interval_ms <= 0) {
+				pr_err("Invalid watch interval: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case OPT_DAEMON:
+			do_daemon = 1;
+			readonly = false;
+			break;
+		case OPT_SOCKET:
+			socket_path = optarg;
+			break;
+		case OPT_SAVE_DELAY:
+			save_delay_ms = atoi(optarg);
+			break;
 		case 'v':
 			pr_level++;
 			break;
@@ -561,6 +961,28 @@ int main(int argc, char *argv[])
 
 	pr_level_set(pr_level);
 
+	if (do_watch && (!readonly || do_daemon)) {
+		pr_err("--watch cannot be combined with --set or --daemon\n");
+		exit(1);
+	}
+
+	/* The device node lock is held as long as the state exists */
+	if (do_watch && IS_ENABLED(CONFIG_LOCK_DEVICE_NODE)) {
+		pr_err("--watch would lock out writers with device node locking\n");
+		exit(1);
+	}
+
+	/* Let a running daemon handle the request if it can */
+	if (!do_daemon && !dtb && auth && !do_dump_shell && !do_dump_json &&
+	    !do_check && !export_dtb && !do_watch && !nr_states) {
+		conn = state_client_connect(socket_path);
+		if (conn) {
+			ret = state_client_run(conn, do_dump, &sg_list, NULL, 0);
+			fclose(conn);
+			return ret;
+		}
+	}
+
 	if (nr_states == 0) {
 		struct state_list *new_state;
 
@@ -571,96 +993,127 @@ int main(int argc, char *argv[])
 		++nr_states;
 	}
 
-	if (!IS_ENABLED(CONFIG_LOCK_DEVICE_NODE)) {
-		lock_fd = open(BAREBOX_STATE_LOCKFILE, O_CREAT | O_RDWR, 0600);
-		if (lock_fd < 0) {
-			pr_err("Failed to open lock-file " BAREBOX_STATE_LOCKFILE "\n");
-			exit(1);
+	/*
+	 * A daemon holds the locks of the states it serves as long as it is
+	 * running. Let it handle requests for them if it can and refuse the
+	 * others instead of waiting for the lock forever.
+	 */
+	conn = export_dtb ? NULL : state_client_connect(socket_path);
+	if (conn) {
+		ret = state_client_served(conn, &state_list, dtb);
+		if (ret == nr_states && !do_daemon && auth && !do_dump_shell &&
+		    !do_dump_json && !do_check && !do_watch) {
+			ret = state_client_run(conn, do_dump, &sg_list,
+					       &state_list, nr_states);
+			fclose(conn);
+			return ret;
 		}
+		fclose(conn);
 
-		ret = flock(lock_fd, LOCK_EX);
 		if (ret < 0) {
-			pr_err("Failed to lock " BAREBOX_STATE_LOCKFILE ": %m\n");
-			close(lock_fd);
+			pr_err("Failed to query the daemon on %s: %s\n",
+			       socket_path, strerror(-ret));
+			exit(1);
+		}
+
+		list_for_each_entry(state, &state_list.list, list) {
+			if (!state->served)
+				continue;
+
+			pr_err("The daemon on %s serves state %s. It only handles --get, --set and --dump without other options\n",
+			       socket_path, state->name);
 			exit(1);
 		}
 	}
 
-	list_for_each_entry(state, &state_list.list, list) {
-		state->state = state_get(state->name, dtb, readonly, auth);
-		if (!IS_ERR(state->state) && !state->name)
-			state->name = state->state->name;
-		if (IS_ERR(state->state)) {
-			ret = 1;
-			goto out_unlock;
+	/* Exporting only needs the devicetree, not the states themselves */
+	if (export_dtb) {
+		ret = state_export_dtb(dtb, &state_list, export_dtb);
+		if (ret) {
+			pr_err("Failed to export devicetree: %s\n",
+			       strerror(-ret));
+			return 1;
 		}
+
+		return 0;
+	}
+
+	ret = state_list_get(&state_list, nr_states, dtb, readonly, auth);
+	if (ret) {
+		ret = 1;
+		goto out_unlock;
+	}
+
+	if (do_daemon) {
+		ret = state_daemon(&state_list, nr_states, socket_path,
+				   save_delay_ms) ? 1 : 0;
+		goto out_unlock;
 	}
 
-	if (do_dump) {
+	if (do_check) {
+		int degraded = 0;
+
 		list_for_each_entry(state, &state_list.list, list) {
-			state_for_each_var(state->state, v) {
-				struct variable_str_type *vtype;
-				vtype = state_find_type(v->type->type);
-
-				if (!vtype) {
-					pr_err("no such type: %d\n", v->type->type);
-					ret = 1;
-					goto out_unlock;
-				}
-
-				if (nr_states > 1)
-					printf("%s.%s=%s", state->name, v->name,
-					       vtype->get(v));
-				else
-					printf("%s=%s", v->name, vtype->get(v));
-				if (pr_level_get() > 5) {
-					printf(", type=%s", vtype->type_name);
-					if (vtype->info)
-						vtype->info(v);
-				}
-				printf("\n");
+			if (auth)
+				ret = state_check(state->state);
+			else
+				ret = state_check_no_auth(state->state);
+			if (ret) {
+				pr_err("%s: redundancy check failed: %s\n",
+				       state->name, strerror(-ret));
+				degraded = 1;
 			}
 		}
+
+		if (degraded) {
+			ret = 1;
+			goto out_unlock;
+		}
 	}
 
-	if (do_dump_shell) {
-		list_for_each_entry(state, &state_list.list, list) {
-			state_for_each_var(state->state, v) {
-				struct variable_str_type *vtype;
-				char *name, *ptr;
-
-				/* replace "." by "_" to make it var name shell compatible */
-				name = strdup(v->name);
-				ptr = name;
-				while ((ptr = strchr(ptr, '.')))
-					*ptr++ = '_';
-
-				vtype = state_find_type(v->type->type);
-				printf("%s_%s=\"%s\"\n", state->name, name, vtype->get(v));
-			}
+	if (do_dump || do_dump_shell || do_dump_json) {
+		char *buf = NULL;
+		size_t len = 0;
+		FILE *out;
+
+		/* Render all dumps first and write them at once */
+		out = open_memstream(&buf, &len);
+		if (!out) {
+			pr_err("Failed to allocate dump buffer\n");
+			ret = 1;
+			goto out_unlock;
+		}
+
+		ret = 0;
+		if (do_dump)
+			ret = state_list_dump(out, &state_list, nr_states,
+					      STATE_DUMP_PLAIN, pr_level_get() > 5);
+		if (!ret && do_dump_shell)
+			ret = state_list_dump(out, &state_list, nr_states,
+					      STATE_DUMP_SHELL, false);
+		if (!ret && do_dump_json)
+			ret = state_list_dump(out, &state_list, nr_states,
+					      STATE_DUMP_JSON, false);
+		fclose(out);
+
+		if (!ret) {
+			fflush(stdout);
+			ret = write_full(STDOUT_FILENO, buf, len);
+			if (ret > 0)
+				ret = 0;
+		}
+		free(buf);
+
+		if (ret) {
+			ret = 1;
+			goto out_unlock;
 		}
 	}
 
 	list_for_each_entry(sg, &sg_list, list) {
 		char *arg = sg->arg;
-		char *statename_end = strchr(sg->arg, '.');
-		int statename_len;
-		state = &state_list;
-
-		if (statename_end) {
-			statename_len = statename_end - sg->arg;
-
-			list_for_each_entry(state, &state_list.list, list) {
-				if (strlen(state->name) == statename_len &&
-				    !strncmp(state->name, sg->arg, statename_len)) {
-					arg = statename_end + 1;
-					break;
-				}
-			}
-		}
-		if (state == &state_list) {
-			state = list_first_entry(&state_list.list, struct state_list, list);
-		}
+
+		state = state_list_find(&state_list, &arg);
 		if (sg->get) {
 			char *val = state_get_var(state->state, arg);
 			if (!val) {
@@ -692,6 +1145,12 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (do_watch) {
+		ret = state_watch(&state_list, nr_states, auth,
+				  watch_interval_ms) ? 1 : 0;
+		goto out_unlock;
+	}
+
 	list_for_each_entry(state, &state_list.list, list) {
 		if (state->state->dirty) {
 			ret = state_save(state->state);
@@ -700,14 +1159,56 @@ int main(int argc, char *argv[])
 				ret = 1;
 				goto out_unlock;
 			}
+			pre_erase |= state->state->storage.pre_erase;
 		}
 	}
 
+	/*
+	 * The state is safely stored at this point. Erasing takes long on
+	 * some flashes, so leave it to a child process which inherits the
+	 * lock and releases it when done. Buckets holding the current data
+	 * are never erased, so the child only keeps writers out and lets
+	 * readers in. It must not keep a pipe reading our output open either.
+	 */
+	if (pre_erase) {
+		fflush(stdout);
+		fflush(stderr);
+
+		pid = fork();
+		if (pid < 0)
+			pr_warn("Failed to fork, pre-erasing in the foreground: %m\n");
+
+		if (pid == 0) {
+			int fd = open("/dev/null", O_RDWR);
+
+			if (fd >= 0) {
+				dup2(fd, STDIN_FILENO);
+				dup2(fd, STDOUT_FILENO);
+				dup2(fd, STDERR_FILENO);
+				if (fd > STDERR_FILENO)
+					close(fd);
+			}
+			setsid();
+
+			list_for_each_entry(state, &state_list.list, list)
+				state_lock_downgrade(state->lock);
+		}
+
+		if (pid <= 0) {
+			list_for_each_entry(state, &state_list.list, list)
+				state_pre_erase(state->state);
+		}
+
+		if (pid == 0)
+			_exit(0);
+	}
+
 	ret = 0;
 out_unlock:
-	if (!IS_ENABLED(CONFIG_LOCK_DEVICE_NODE)) {
-		flock(lock_fd, LOCK_UN);
-		close(lock_fd);
+	/* Unlocking would release the lock of the child as well */
+	if (pid <= 0) {
+		list_for_each_entry(state, &state_list.list, list)
+			state_unlock(state->lock);
 	}
 
 	return ret;
@@ -4,7 +4,63 @@
 #ifndef __BAREBOX_STATE__
 #define __BAREBOX_STATE__
 
-struct state *state_get(const char *name, const char *file, bool readonly, bool auth);
+#include <stdio.h>
+
+#include <barebox-state/state.h>
+#include <linux/list.h>
+
+/* Followed by the backend path with "/" replaced by "-" and the offset */
+#define BAREBOX_STATE_LOCKFILE_PREFIX "/run/barebox-state"
+#define BAREBOX_STATE_SOCKET "/run/barebox-state.sock"
+
+struct state_variable;
+
+struct variable_str_type {
+	enum state_variable_type type;
+	char *type_name;
+
+	char *(*get)(struct state_variable *var);
+	int (*set)(struct state_variable *var, const char *val);
+	/* Writes the value, as JSON value if json is set */
+	void (*put)(struct state_variable *var, FILE *out, bool json);
+	void (*info)(struct state_variable *var, FILE *out);
+};
+
+enum state_dump_format {
+	STATE_DUMP_PLAIN,
+	STATE_DUMP_SHELL,
+	STATE_DUMP_JSON,
+};
+
+struct state_list {
+	const char *name;
+	struct state *state;
+	struct state_lock *lock;
+	/* Name of the state in a running daemon, which then serves it */
+	char *served;
+	struct list_head list;
+};
+
+struct variable_str_type *state_find_type(enum state_variable_type type);
+struct device_node *state_read_devicetree(const char *filename);
+struct device_node *state_get_devicetree(void);
+void state_put_devicetree(void);
+struct device_node *state_find_node(struct device_node *root, const char *name);
+struct state *state_get_node(struct device_node *node, bool readonly,
+			     bool auth, struct state_lock **lock);
+struct state *state_get(const char *name, const char *file, bool readonly,
+			bool auth, struct state_lock **lock);
+int state_lock(struct state *state, bool exclusive, struct state_lock **lock);
+void state_lock_downgrade(struct state_lock *lock);
 char *state_get_var(struct state *state, const char *var);
+int state_set_var(struct state *state, const char *var, const char *val);
+struct state_list *state_list_find(struct state_list *states, char **arg);
+int state_list_dump(FILE *out, struct state_list *states, int nr_states,
+		    enum state_dump_format format, bool verbose);
+
+int state_daemon(struct state_list *states, int nr_states,
+		 const char *socket_path, int save_delay_ms);
+FILE *state_client_connect(const char *socket_path);
+int state_client_request(FILE *conn, FILE *out, const char *fmt, ...);
 
 #endif /* __BAREBOX_STATE__ */
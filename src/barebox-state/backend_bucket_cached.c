@@ -0,0 +1,252 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <common.h>
+#include <malloc.h>
+#include <string.h>
+
+#include "state.h"
+
+/*
+ * The cached bucket wraps a raw bucket and keeps the data last read from or
+ * written to it. Repeated reads are served from the cache and writes of data
+ * the raw bucket already holds are skipped. As the generation is stored along
+ * with the data, a write is only skipped if the generation matches as well.
+ */
+struct state_backend_storage_bucket_cache {
+	struct state_backend_storage_bucket bucket;
+
+	struct state_backend_storage_bucket *raw;
+
+	u8 *data;
+	ssize_t size;
+	bool force_write;
+
+	/* For outputs */
+	struct device_d *dev;
+};
+
+static inline struct state_backend_storage_bucket_cache
+    *get_bucket_cache(struct state_backend_storage_bucket *bucket)
+{
+	return container_of(bucket,
+			    struct state_backend_storage_bucket_cache,
+			    bucket);
+}
+
+static inline void state_backend_bucket_cache_drop(
+		struct state_backend_storage_bucket_cache *cache)
+{
+	if (cache->data) {
+		free(cache->data);
+		cache->data = NULL;
+		cache->size = 0;
+	}
+}
+
+/* Takes over the state of the raw bucket the storage looks at */
+static void state_backend_bucket_cache_sync(
+		struct state_backend_storage_bucket_cache *cache)
+{
+	cache->bucket.erase_count = cache->raw->erase_count;
+	cache->bucket.wrong_magic = cache->raw->wrong_magic;
+}
+
+static int state_backend_bucket_cache_fill(
+		struct state_backend_storage_bucket_cache *cache)
+{
+	int ret;
+
+	ret = cache->raw->read(cache->raw, (void **)&cache->data, &cache->size);
+	state_backend_bucket_cache_sync(cache);
+	if (ret && ret != -EUCLEAN)
+		return ret;
+
+	/* The raw bucket needs to be rewritten even if the data is unchanged */
+	cache->force_write = ret == -EUCLEAN;
+
+	return ret;
+}
+
+static int state_backend_bucket_cache_read(struct state_backend_storage_bucket *bucket,
+					   void ** buf_out,
+					   ssize_t * len_hint)
+{
+	struct state_backend_storage_bucket_cache *cache =
+			get_bucket_cache(bucket);
+	int ret;
+
+	if (!cache->data) {
+		ret = state_backend_bucket_cache_fill(cache);
+		if (ret && ret != -EUCLEAN)
+			return ret;
+	}
+
+	*buf_out = xmemdup(cache->data, cache->size);
+	*len_hint = cache->size;
+	bucket->generation = cache->raw->generation;
+
+	/* Keep reporting a bucket which still needs to be rewritten */
+	return cache->force_write ? -EUCLEAN : 0;
+}
+
+static int state_backend_bucket_cache_write(struct state_backend_storage_bucket *bucket,
+					    const void * buf, ssize_t len)
+{
+	struct state_backend_storage_bucket_cache *cache =
+			get_bucket_cache(bucket);
+	int ret;
+
+	if (!cache->force_write && cache->data && cache->size == len &&
+	    cache->raw->generation == bucket->generation &&
+	    !memcmp(cache->data, buf, len)) {
+		dev_dbg(cache->dev, "Skipping write, bucket %d is up to date\n",
+			bucket->num);
+		return 0;
+	}
+
+	state_backend_bucket_cache_drop(cache);
+
+	cache->raw->generation = bucket->generation;
+	ret = cache->raw->write(cache->raw, buf, len);
+	state_backend_bucket_cache_sync(cache);
+	if (ret)
+		return ret;
+
+	cache->data = xmemdup(buf, len);
+	cache->size = len;
+	cache->force_write = false;
+
+	return 0;
+}
+
+static int state_backend_bucket_cache_write_delta(struct state_backend_storage_bucket *bucket,
+						  const void * record, ssize_t len)
+{
+	struct state_backend_storage_bucket_cache *cache =
+			get_bucket_cache(bucket);
+	uint32_t generation = cache->raw->generation;
+	int ret;
+
+	if (cache->force_write)
+		return -ENOSPC;
+
+	cache->raw->generation = bucket->generation;
+	ret = cache->raw->write_delta(cache->raw, record, len);
+	if (ret) {
+		cache->raw->generation = generation;
+		return ret;
+	}
+
+	/* Keep the cache up to date by applying the record to it as well */
+	if (!cache->data ||
+	    state_delta_apply(cache->data, cache->size, record, len,
+			      &generation) < 0)
+		state_backend_bucket_cache_drop(cache);
+
+	return 0;
+}
+
+static int state_backend_bucket_cache_flush(struct state_backend_storage_bucket *bucket)
+{
+	struct state_backend_storage_bucket_cache *cache =
+			get_bucket_cache(bucket);
+
+	return cache->raw->flush(cache->raw);
+}
+
+static bool state_backend_bucket_cache_needs_erase(struct state_backend_storage_bucket *bucket,
+						   ssize_t len)
+{
+	struct state_backend_storage_bucket_cache *cache =
+			get_bucket_cache(bucket);
+
+	return cache->raw->needs_erase(cache->raw, len);
+}
+
+static int state_backend_bucket_cache_erase(struct state_backend_storage_bucket *bucket)
+{
+	struct state_backend_storage_bucket_cache *cache =
+			get_bucket_cache(bucket);
+	int ret;
+
+	state_backend_bucket_cache_drop(cache);
+
+	ret = cache->raw->erase(cache->raw);
+	state_backend_bucket_cache_sync(cache);
+
+	return ret;
+}
+
+static int state_backend_bucket_cache_probe(struct state_backend_storage_bucket *bucket)
+{
+	struct state_backend_storage_bucket_cache *cache =
+			get_bucket_cache(bucket);
+	int ret;
+
+	/* Without a way to tell, the cached data is always outdated */
+	if (!cache->raw->probe) {
+		state_backend_bucket_cache_drop(cache);
+		return 1;
+	}
+
+	ret = cache->raw->probe(cache->raw);
+	state_backend_bucket_cache_sync(cache);
+
+	/* Someone else wrote the bucket, or it could not be checked */
+	if (ret)
+		state_backend_bucket_cache_drop(cache);
+
+	return ret;
+}
+
+static void state_backend_bucket_cache_free(
+		struct state_backend_storage_bucket *bucket)
+{
+	struct state_backend_storage_bucket_cache *cache =
+			get_bucket_cache(bucket);
+
+	state_backend_bucket_cache_drop(cache);
+	cache->raw->free(cache->raw);
+	free(cache);
+}
+
+int state_backend_bucket_cached_create(struct device_d *dev,
+				       struct state_backend_storage_bucket *raw,
+				       struct state_backend_storage_bucket **out)
+{
+	struct state_backend_storage_bucket_cache *cache;
+
+	cache = xzalloc(sizeof(*cache));
+	cache->raw = raw;
+	cache->dev = dev;
+
+	cache->bucket.free = state_backend_bucket_cache_free;
+	cache->bucket.read = state_backend_bucket_cache_read;
+	cache->bucket.write = state_backend_bucket_cache_write;
+	if (raw->write_delta)
+		cache->bucket.write_delta = state_backend_bucket_cache_write_delta;
+	if (raw->flush)
+		cache->bucket.flush = state_backend_bucket_cache_flush;
+	if (raw->needs_erase)
+		cache->bucket.needs_erase = state_backend_bucket_cache_needs_erase;
+	if (raw->erase)
+		cache->bucket.erase = state_backend_bucket_cache_erase;
+	cache->bucket.probe = state_backend_bucket_cache_probe;
+
+	state_backend_bucket_cache_sync(cache);
+
+	*out = &cache->bucket;
+
+	return 0;
+}
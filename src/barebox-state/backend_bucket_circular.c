@@ -15,6 +15,7 @@
 
 #include <asm-generic/ioctl.h>
 #include <common.h>
+#include <crc.h>
 #include <fcntl.h>
 #include <fs.h>
 #include <libfile.h>
@@ -44,6 +45,14 @@
  *
  * If your device is a mtd device, but does not have eraseblocks, like MRAMs, then
  * the direct bucket is used instead.
+ *
+ * The records of the delta log are appended behind the data like the data
+ * itself, but with a different magic in their metadata. Starting at the last
+ * written page, the reader follows their lengths back to the data.
+ *
+ * With the rotating storage type each erase is followed by writing a header
+ * with the number of erases of the eraseblock to its first page. This allows
+ * the storage to spread erases evenly over all eraseblocks.
  */
 struct state_backend_storage_bucket_circular {
 	struct state_backend_storage_bucket bucket;
@@ -53,7 +62,17 @@ struct state_backend_storage_bucket_circular {
 	ssize_t max_size; /* Maximum size of this bucket */
 
 	off_t write_area; /* Start of the write area (relative offset) */
+	off_t data_end; /* End of the data written last, start of its delta log */
 	uint32_t last_written_length; /* Size of the data written in the storage */
+	uint32_t last_generation; /* Generation of the data written last */
+
+	/* The pages around the start of the write area as found by init */
+	void *probe_buf;
+	off_t probe_offset;
+	ssize_t probe_len;
+
+	bool rotating; /* Write an erase counter header after each erase */
+	bool has_header; /* The first page contains the erase counter header */
 
 #ifdef __BAREBOX__
 	struct mtd_info *mtd; /* mtd info (used for io in Barebox)*/
@@ -77,6 +96,30 @@ struct __attribute__((__packed__)) state_backend_storage_bucket_circular_meta {
 };
 
 static const uint32_t circular_magic = 0x14fa2d02;
+static const uint32_t circular_delta_magic = 0x14fa2d03;
+
+/*
+ * The generation is placed directly in front of the metadata. Readers not
+ * aware of it consider it part of the padding behind the data.
+ */
+struct __attribute__((__packed__)) state_backend_storage_bucket_circular_generation {
+	uint32_t magic;
+	uint32_t generation;
+};
+
+static const uint32_t circular_generation_magic = 0x6e65472e;
+
+/*
+ * The header is written to the beginning of the eraseblock right after it was
+ * erased, the data starts at the next writesize aligned offset.
+ */
+struct __attribute__((__packed__)) state_backend_storage_bucket_circular_header {
+	uint32_t magic;
+	uint32_t erase_count;
+	uint32_t crc;
+};
+
+static const uint32_t circular_header_magic = 0x43457261;
 
 static inline struct state_backend_storage_bucket_circular
     *get_bucket_circular(struct state_backend_storage_bucket *bucket)
@@ -86,6 +129,25 @@ static inline struct state_backend_storage_bucket_circular
 			    bucket);
 }
 
+static ssize_t circular_header_size(struct state_backend_storage_bucket_circular *circ)
+{
+	return roundup(sizeof(struct state_backend_storage_bucket_circular_header),
+		       circ->writesize);
+}
+
+/* Start of the data area (relative offset) */
+static off_t circular_data_start(struct state_backend_storage_bucket_circular *circ)
+{
+	return circ->has_header ? circular_header_size(circ) : 0;
+}
+
+/* Writes move the write area, the next probe has to look for it again */
+static void state_backend_bucket_circular_probe_drop(struct state_backend_storage_bucket_circular *circ)
+{
+	free(circ->probe_buf);
+	circ->probe_buf = NULL;
+}
+
 #ifdef __BAREBOX__
 static int state_mtd_peb_read(struct state_backend_storage_bucket_circular *circ,
 			      void *buf, int offset, int len)
@@ -225,19 +287,58 @@ static int state_mtd_peb_erase(struct state_backend_storage_bucket_circular *cir
 }
 #endif
 
+/*
+ * Replays the delta log in buf between log_start and log_end onto the first len
+ * bytes. The records are located backwards from the end, so they are
+ * collected first.
+ */
+static void state_backend_bucket_circular_replay(struct state_backend_storage_bucket_circular *circ,
+						 void *buf, ssize_t len,
+						 ssize_t log_start, ssize_t log_end)
+{
+	struct state_backend_storage_bucket_circular_meta *meta;
+	ssize_t *starts;
+	ssize_t end = log_end;
+	int n = 0, ret;
+
+	starts = xmalloc((log_end - log_start) / circ->writesize * sizeof(*starts));
+
+	while (end > log_start) {
+		meta = buf + end - sizeof(*meta);
+		if (meta->magic != circular_delta_magic ||
+		    !meta->written_length ||
+		    meta->written_length % circ->writesize ||
+		    meta->written_length > end - log_start)
+			break;
+		end -= meta->written_length;
+		starts[n++] = end;
+	}
+
+	while (n--) {
+		end = n ? starts[n - 1] : log_end;
+		ret = state_delta_apply(buf, len, buf + starts[n],
+					end - starts[n] - sizeof(*meta),
+					&circ->bucket.generation);
+		if (ret < 0)
+			break;
+	}
+
+	free(starts);
+}
+
 static int state_backend_bucket_circular_read(struct state_backend_storage_bucket *bucket,
 					      void ** buf_out,
 					      ssize_t * len_out)
 {
 	struct state_backend_storage_bucket_circular *circ =
 	    get_bucket_circular(bucket);
-	ssize_t read_len;
+	ssize_t read_len, log_len = 0;
 	off_t offset;
 	void *buf;
 	int ret;
 
 	/* Storage is empty */
-	if (circ->write_area == 0)
+	if (circ->write_area <= circular_data_start(circ))
 		return -ENODATA;
 
 	if (!circ->last_written_length) {
@@ -245,12 +346,13 @@ static int state_backend_bucket_circular_read(struct state_backend_storage_bucke
 		 * Last write did not contain length information, assuming old
 		 * state and reading from the beginning.
 		 */
-		offset = 0;
-		read_len = min(circ->write_area, (off_t)(circ->max_size -
+		offset = circular_data_start(circ);
+		read_len = min(circ->write_area - offset, (off_t)(circ->max_size -
 			       sizeof(struct state_backend_storage_bucket_circular_meta)));
 		circ->write_area = 0;
+		circ->last_generation = 0;
 		dev_info(circ->dev, "Detected old on-storage format\n");
-	} else if (circ->last_written_length > circ->write_area
+	} else if (circ->last_written_length > circ->data_end
 		   || (circ->last_written_length % circ->writesize != 0)) {
 		circ->write_area = 0;
 		dev_err(circ->dev, "Error, invalid number of bytes written last time %d\n",
@@ -263,33 +365,106 @@ static int state_backend_bucket_circular_read(struct state_backend_storage_bucke
 		 * (last_written_length)
 		 */
 		read_len = circ->last_written_length;
-		offset = circ->write_area - read_len;
+		offset = circ->data_end - read_len;
+		/* The delta log is read along with the data */
+		log_len = circ->write_area - circ->data_end;
 	}
 
-	buf = xmalloc(read_len);
+	buf = xmalloc(read_len + log_len);
 	if (!buf)
 		return -ENOMEM;
 
 	dev_dbg(circ->dev, "Read state from PEB %u global offset %lld length %zd\n",
-		circ->eraseblock, (long long) offset, read_len);
+		circ->eraseblock, (long long) offset, read_len + log_len);
 
-	ret = state_mtd_peb_read(circ, buf, offset, read_len);
+	ret = state_mtd_peb_read(circ, buf, offset, read_len + log_len);
 	if (ret < 0 && ret != -EUCLEAN) {
 		dev_err(circ->dev, "Failed to read circular storage len %zd, %d\n",
-			read_len, ret);
+			read_len + log_len, ret);
 		free(buf);
 		return ret;
 	}
 
 	*buf_out = buf;
+	bucket->generation = circ->last_generation;
 	/* When reading old state there is no circular bucket metadata */
-	if (circ->last_written_length)
+	if (circ->last_written_length) {
+		if (log_len && bucket->generation)
+			state_backend_bucket_circular_replay(circ, buf,
+					read_len - sizeof(struct state_backend_storage_bucket_circular_meta),
+					read_len, read_len + log_len);
 		read_len -= sizeof(struct state_backend_storage_bucket_circular_meta);
+	}
 	*len_out = read_len;
 
 	return ret;
 }
 
+static uint32_t circular_written_length(struct state_backend_storage_bucket_circular *circ,
+					ssize_t len)
+{
+	return roundup(len +
+		       sizeof(struct state_backend_storage_bucket_circular_generation) +
+		       sizeof(struct state_backend_storage_bucket_circular_meta),
+		       circ->writesize);
+}
+
+static int state_backend_bucket_circular_write_header(
+		struct state_backend_storage_bucket_circular *circ)
+{
+	struct state_backend_storage_bucket_circular_header *header;
+	ssize_t header_size = circular_header_size(circ);
+	int ret;
+
+	header = xmalloc(header_size);
+	memset(header, 0xff, header_size);
+	header->magic = circular_header_magic;
+	header->erase_count = circ->bucket.erase_count + 1;
+	header->crc = crc32(0, header, sizeof(*header) - sizeof(uint32_t));
+
+	ret = state_mtd_peb_write(circ, header, 0, header_size);
+	if (ret < 0 && ret != -EUCLEAN) {
+		dev_err(circ->dev, "Failed to write header to PEB %u, %d\n",
+			circ->eraseblock, ret);
+		goto out_free;
+	}
+
+	circ->bucket.erase_count = header->erase_count;
+	circ->has_header = true;
+	circ->write_area = header_size;
+	ret = 0;
+
+out_free:
+	free(header);
+	return ret;
+}
+
+static int state_backend_bucket_circular_erase(struct state_backend_storage_bucket *bucket)
+{
+	struct state_backend_storage_bucket_circular *circ =
+	    get_bucket_circular(bucket);
+	int ret;
+
+	dev_dbg(circ->dev, "Erasing PEB %u\n", circ->eraseblock);
+	ret = state_mtd_peb_erase(circ);
+	if (ret) {
+		dev_err(circ->dev, "Failed to erase PEB %u\n",
+			circ->eraseblock);
+		return ret;
+	}
+
+	circ->has_header = false;
+	circ->write_area = 0;
+	circ->last_written_length = 0;
+	state_backend_bucket_circular_probe_drop(circ);
+	circ->last_generation = 0;
+
+	if (circ->rotating)
+		return state_backend_bucket_circular_write_header(circ);
+
+	return 0;
+}
+
 static int state_backend_bucket_circular_write(struct state_backend_storage_bucket *bucket,
 					       const void * buf,
 					       ssize_t len)
@@ -298,11 +473,16 @@ static int state_backend_bucket_circular_write(struct state_backend_storage_buck
 	    get_bucket_circular(bucket);
 	off_t offset;
 	struct state_backend_storage_bucket_circular_meta *meta;
-	uint32_t written_length = roundup(len + sizeof(*meta), circ->writesize);
+	struct state_backend_storage_bucket_circular_generation *gen;
+	uint32_t written_length = circular_written_length(circ, len);
+	ssize_t max_size = circ->max_size;
 	int ret;
 	void *write_buf;
 
-	if (written_length > circ->max_size) {
+	if (circ->rotating)
+		max_size -= circular_header_size(circ);
+
+	if (written_length > max_size) {
 		dev_err(circ->dev, "Error, state data too big to be written, to write: %u, writesize: %zd, length: %zd, available: %zd\n",
 			written_length, circ->writesize, len, circ->max_size);
 		return -E2BIG;
@@ -319,10 +499,14 @@ static int state_backend_bucket_circular_write(struct state_backend_storage_buck
 			(write_buf + written_length - sizeof(*meta));
 	meta->magic = circular_magic;
 	meta->written_length = written_length;
+	gen = (struct state_backend_storage_bucket_circular_generation *)meta - 1;
+	gen->magic = circular_generation_magic;
+	gen->generation = bucket->generation;
 
 	if (circ->write_area + written_length >= circ->max_size) {
 		circ->write_area = 0;
 	}
+	state_backend_bucket_circular_probe_drop(circ);
 	/*
 	 * If the write area is at the beginning of the eraseblock, erase it and write
 	 * at offset 0. As we only erase right before writing there are no
@@ -330,13 +514,9 @@ static int state_backend_bucket_circular_write(struct state_backend_storage_buck
 	 * writing.
 	 */
 	if (circ->write_area == 0) {
-		dev_dbg(circ->dev, "Erasing PEB %u\n", circ->eraseblock);
-		ret = state_mtd_peb_erase(circ);
-		if (ret) {
-			dev_err(circ->dev, "Failed to erase PEB %u\n",
-				circ->eraseblock);
+		ret = state_backend_bucket_circular_erase(bucket);
+		if (ret)
 			goto out_free;
-		}
 	}
 
 	offset = circ->write_area;
@@ -355,6 +535,10 @@ static int state_backend_bucket_circular_write(struct state_backend_storage_buck
 		goto out_free;
 	}
 
+	circ->last_written_length = written_length;
+	circ->last_generation = bucket->generation;
+	circ->data_end = circ->write_area;
+
 	dev_dbg(circ->dev, "Written state to PEB %u offset %lld length %u data length %zd\n",
 		circ->eraseblock, (long long) offset, written_length, len);
 
@@ -363,61 +547,340 @@ out_free:
 	return ret;
 }
 
+static int state_backend_bucket_circular_write_delta(struct state_backend_storage_bucket *bucket,
+						     const void * record,
+						     ssize_t len)
+{
+	struct state_backend_storage_bucket_circular *circ =
+	    get_bucket_circular(bucket);
+	struct state_backend_storage_bucket_circular_meta *meta;
+	uint32_t written_length = roundup(len + sizeof(*meta), circ->writesize);
+	off_t offset = circ->write_area;
+	void *write_buf;
+	int ret;
+
+	/* The delta log is only appended behind data written with metadata */
+	if (!circ->last_written_length ||
+	    circ->write_area + written_length >= circ->max_size)
+		return -ENOSPC;
+
+	state_backend_bucket_circular_probe_drop(circ);
+
+	write_buf = xzalloc(written_length);
+	memcpy(write_buf, record, len);
+	meta = write_buf + written_length - sizeof(*meta);
+	meta->magic = circular_delta_magic;
+	meta->written_length = written_length;
+
+	circ->write_area += written_length;
+
+	ret = state_mtd_peb_write(circ, write_buf, offset, written_length);
+	free(write_buf);
+	if (ret < 0 && ret != -EUCLEAN) {
+		dev_err(circ->dev, "Failed to write delta to %lld length %u, %d\n",
+			(long long) offset, written_length, ret);
+		return ret;
+	}
+
+	circ->last_generation = bucket->generation;
+
+	dev_dbg(circ->dev, "Written delta to PEB %u offset %lld length %u\n",
+		circ->eraseblock, (long long) offset, written_length);
+
+	return 0;
+}
+
+static bool state_backend_bucket_circular_needs_erase(struct state_backend_storage_bucket *bucket,
+						      ssize_t len)
+{
+	struct state_backend_storage_bucket_circular *circ =
+	    get_bucket_circular(bucket);
+
+	return circ->write_area == 0 ||
+	       circ->write_area + circular_written_length(circ, len) >= circ->max_size;
+}
+
+/* Returns 1 if the page at @offset is erased, 0 if not, -errno otherwise */
+static int circular_page_is_free(struct state_backend_storage_bucket_circular *circ,
+				 off_t offset, void *page)
+{
+	int ret;
+
+	ret = state_mtd_peb_read(circ, page, offset, circ->writesize);
+	if (ret && ret != -EUCLEAN)
+		return ret;
+
+	return mtd_buf_all_ff(page, circ->writesize);
+}
+
+/*
+ * Finds the end of the written area by bisecting over the pages, so that only
+ * a few pages are read. Every write starts with the magic of the format or of
+ * a delta log record and ends with the metadata, so neither its first nor its
+ * last page is erased. An erased page found by bisecting which is not behind
+ * the last write lies in the middle of a write; the page in front of it then
+ * carries no metadata pointing back to the start of a write. Returns -EAGAIN
+ * if the result cannot be trusted, the caller has to scan the eraseblock then.
+ */
+static int circular_find_write_area(struct state_backend_storage_bucket_circular *circ,
+				    off_t *write_area)
+{
+	struct state_backend_storage_bucket_circular_meta *meta;
+	off_t lo = circular_data_start(circ);
+	off_t hi = circ->max_size - circ->writesize;
+	uint8_t *page, *lo_page, *tmp;
+	off_t mid;
+	int ret;
+
+	page = xmalloc(circ->writesize);
+	lo_page = xmalloc(circ->writesize);
+
+	ret = circular_page_is_free(circ, lo, lo_page);
+	if (ret) {
+		/* Nothing written yet */
+		if (ret > 0) {
+			*write_area = lo;
+			ret = 0;
+		}
+		goto out;
+	}
+
+	ret = circular_page_is_free(circ, hi, page);
+	if (ret <= 0) {
+		/* Written up to the end */
+		if (!ret)
+			*write_area = circ->max_size;
+		goto out;
+	}
+
+	while (hi - lo > circ->writesize) {
+		mid = lo + (hi - lo) / circ->writesize / 2 * circ->writesize;
+		ret = circular_page_is_free(circ, mid, page);
+		if (ret < 0)
+			goto out;
+		if (ret) {
+			hi = mid;
+		} else {
+			lo = mid;
+			tmp = lo_page;
+			lo_page = page;
+			page = tmp;
+		}
+	}
+
+	meta = (void *)lo_page + circ->writesize - sizeof(*meta);
+	if ((meta->magic != circular_magic &&
+	     meta->magic != circular_delta_magic) ||
+	    !meta->written_length ||
+	    meta->written_length % circ->writesize ||
+	    meta->written_length > hi - circular_data_start(circ)) {
+		ret = -EAGAIN;
+		goto out;
+	}
+
+	ret = circular_page_is_free(circ, hi - meta->written_length, page);
+	if (ret < 0)
+		goto out;
+	if (ret) {
+		ret = -EAGAIN;
+		goto out;
+	}
+
+	*write_area = hi;
+	ret = 0;
+out:
+	free(lo_page);
+	free(page);
+
+	return ret;
+}
+
+/*
+ * Finds the end of the written area by reading the whole eraseblock and
+ * searching backwards for the last page which is not erased.
+ */
+static int circular_scan_write_area(struct state_backend_storage_bucket_circular *circ,
+				    off_t *write_area)
+{
+	off_t sub_offset;
+	uint8_t *buf;
+	int ret;
+
+	buf = xmalloc(circ->max_size);
+
+	ret = state_mtd_peb_read(circ, buf, 0, circ->max_size);
+	if (ret && ret != -EUCLEAN)
+		goto out;
+
+	for (sub_offset = circ->max_size - circ->writesize;
+	     sub_offset >= circular_data_start(circ);
+	     sub_offset -= circ->writesize) {
+		if (!mtd_buf_all_ff(buf + sub_offset, circ->writesize))
+			break;
+	}
+
+	*write_area = sub_offset + circ->writesize;
+	ret = 0;
+out:
+	free(buf);
+
+	return ret;
+}
+
+/* Reads the generation and metadata in front of @end */
+static int circular_read_meta(struct state_backend_storage_bucket_circular *circ,
+			      off_t end,
+			      struct state_backend_storage_bucket_circular_generation *gen,
+			      struct state_backend_storage_bucket_circular_meta *meta)
+{
+	struct __attribute__((__packed__)) {
+		struct state_backend_storage_bucket_circular_generation gen;
+		struct state_backend_storage_bucket_circular_meta meta;
+	} tail;
+	int ret;
+
+	memset(&tail, 0, sizeof(tail));
+
+	if (end >= sizeof(tail))
+		ret = state_mtd_peb_read(circ, &tail, end - sizeof(tail),
+					 sizeof(tail));
+	else
+		ret = state_mtd_peb_read(circ, &tail.meta, end - sizeof(tail.meta),
+					 sizeof(tail.meta));
+	if (ret && ret != -EUCLEAN)
+		return ret;
+
+	*gen = tail.gen;
+	*meta = tail.meta;
+
+	return 0;
+}
+
 /**
  * state_backend_bucket_circular_init - Initialize circular bucket
  * @param bucket
  * @return 0 on success, -errno otherwise
  *
- * This function searches for the beginning of the written area from the end of
- * the MTD device. This way it knows where the data ends and where the free area
- * starts.
+ * This function searches for the end of the written area of the eraseblock.
+ * This way it knows where the data ends and where the free area starts. Only
+ * the pages needed to find it and the metadata of the data written last are
+ * read. In rotating mode the erase counter is read from the header.
  */
 static int state_backend_bucket_circular_init(
 		struct state_backend_storage_bucket *bucket)
 {
 	struct state_backend_storage_bucket_circular *circ =
 	    get_bucket_circular(bucket);
-	int sub_offset;
+	struct state_backend_storage_bucket_circular_generation gen;
+	struct state_backend_storage_bucket_circular_meta meta;
 	uint32_t written_length = 0;
-	uint8_t *buf;
+	uint32_t generation = 0;
+	off_t write_area, data_end;
 	int ret;
 
-	buf = xmalloc(circ->max_size);
-	if (!buf)
-		return -ENOMEM;
+	circ->has_header = false;
 
-	ret = state_mtd_peb_read(circ, buf, 0, circ->max_size);
-	if (ret && ret != -EUCLEAN)
-		goto out;
+	if (circ->rotating) {
+		struct state_backend_storage_bucket_circular_header header;
 
-	for (sub_offset = circ->max_size - circ->writesize; sub_offset >= 0;
-	     sub_offset -= circ->writesize) {
-		ret = mtd_buf_all_ff(buf + sub_offset, circ->writesize);
-		if (!ret) {
-			struct state_backend_storage_bucket_circular_meta *meta;
-
-			meta = (struct state_backend_storage_bucket_circular_meta *)
-					(buf + sub_offset + circ->writesize - sizeof(*meta));
-
-			if (meta->magic != circular_magic) {
-				written_length = 0;
-				if (meta->magic != ~0 && !!meta->magic)
-					bucket->wrong_magic = 1;
-			} else {
-				written_length = meta->written_length;
-			}
-			break;
+		ret = state_mtd_peb_read(circ, &header, 0, sizeof(header));
+		if (ret && ret != -EUCLEAN)
+			return ret;
+
+		if (header.magic == circular_header_magic &&
+		    header.crc == crc32(0, &header, sizeof(header) - sizeof(uint32_t))) {
+			circ->has_header = true;
+			bucket->erase_count = header.erase_count;
 		}
 	}
 
-	circ->write_area = sub_offset + circ->writesize;
+	ret = circular_find_write_area(circ, &write_area);
+	if (ret == -EAGAIN)
+		ret = circular_scan_write_area(circ, &write_area);
+	if (ret)
+		return ret;
+
+	data_end = write_area;
+	if (write_area > circular_data_start(circ)) {
+		ret = circular_read_meta(circ, data_end, &gen, &meta);
+		if (ret)
+			return ret;
+
+		/* Skip the delta log */
+		while (meta.magic == circular_delta_magic &&
+		       meta.written_length &&
+		       meta.written_length % circ->writesize == 0 &&
+		       meta.written_length < data_end - circular_data_start(circ)) {
+			data_end -= meta.written_length;
+			ret = circular_read_meta(circ, data_end, &gen, &meta);
+			if (ret)
+				return ret;
+		}
+
+		if (meta.magic != circular_magic) {
+			if (meta.magic != ~0 && !!meta.magic &&
+			    meta.magic != circular_delta_magic)
+				bucket->wrong_magic = 1;
+		} else {
+			written_length = meta.written_length;
+			if (gen.magic == circular_generation_magic)
+				generation = gen.generation;
+		}
+	}
+
+	circ->write_area = write_area;
+	circ->data_end = written_length ? data_end : circ->write_area;
 	circ->last_written_length = written_length;
+	circ->last_generation = generation;
 
-	ret = 0;
-out:
-	free(buf);
+	/*
+	 * Any write either changes the last page of the data or goes to the
+	 * empty page behind it, which is enough for a probe to look at.
+	 */
+	state_backend_bucket_circular_probe_drop(circ);
+	circ->probe_offset = circ->write_area > circ->writesize ?
+			     circ->write_area - circ->writesize : 0;
+	circ->probe_len = min(circ->write_area + circ->writesize,
+			      (off_t)circ->max_size) - circ->probe_offset;
+	circ->probe_buf = xmalloc(circ->probe_len);
+	ret = state_mtd_peb_read(circ, circ->probe_buf, circ->probe_offset,
+				 circ->probe_len);
+	if (ret && ret != -EUCLEAN) {
+		state_backend_bucket_circular_probe_drop(circ);
+		return ret;
+	}
 
-	return ret;
+	return 0;
+}
+
+static int state_backend_bucket_circular_probe(struct state_backend_storage_bucket *bucket)
+{
+	struct state_backend_storage_bucket_circular *circ =
+	    get_bucket_circular(bucket);
+	void *buf;
+	int ret;
+
+	if (circ->probe_buf) {
+		buf = xmalloc(circ->probe_len);
+		ret = state_mtd_peb_read(circ, buf, circ->probe_offset,
+					 circ->probe_len);
+		if (ret && ret != -EUCLEAN) {
+			free(buf);
+			return ret;
+		}
+
+		ret = memcmp(buf, circ->probe_buf, circ->probe_len);
+		free(buf);
+		if (!ret)
+			return 0;
+	}
+
+	/* Find the new end of the data */
+	ret = state_backend_bucket_circular_init(bucket);
+	if (ret)
+		return ret;
+
+	return 1;
 }
 
 static void state_backend_bucket_circular_free(struct
@@ -427,6 +890,11 @@ static void state_backend_bucket_circular_free(struct
 	struct state_backend_storage_bucket_circular *circ =
 	    get_bucket_circular(bucket);
 
+#ifndef __BAREBOX__
+	close(circ->fd);
+	free(circ->mtd);
+#endif
+	free(circ->probe_buf);
 	free(circ);
 }
 
@@ -461,7 +929,8 @@ int state_backend_bucket_circular_create(struct device_d *dev, const char *path,
 					 struct state_backend_storage_bucket **bucket,
 					 unsigned int eraseblock,
 					 ssize_t writesize,
-					 struct mtd_info_user *mtd_uinfo)
+					 struct mtd_info_user *mtd_uinfo,
+					 bool rotating)
 {
 	struct state_backend_storage_bucket_circular *circ;
 	int ret;
@@ -473,6 +942,7 @@ int state_backend_bucket_circular_create(struct device_d *dev, const char *path,
 	circ->eraseblock = eraseblock;
 	circ->writesize = writesize;
 	circ->max_size = mtd_uinfo->erasesize;
+	circ->rotating = rotating;
 	circ->dev = dev;
 
 #ifdef __BAREBOX__
@@ -498,6 +968,10 @@ int state_backend_bucket_circular_create(struct device_d *dev, const char *path,
 
 	circ->bucket.read = state_backend_bucket_circular_read;
 	circ->bucket.write = state_backend_bucket_circular_write;
+	circ->bucket.write_delta = state_backend_bucket_circular_write_delta;
+	circ->bucket.needs_erase = state_backend_bucket_circular_needs_erase;
+	circ->bucket.erase = state_backend_bucket_circular_erase;
+	circ->bucket.probe = state_backend_bucket_circular_probe;
 	circ->bucket.free = state_backend_bucket_circular_free;
 	*bucket = &circ->bucket;
 
@@ -13,6 +13,7 @@
  *
  */
 
+#include <crc.h>
 #include <fcntl.h>
 #include <fs.h>
 #include <libfile.h>
@@ -20,6 +21,10 @@
 #include <malloc.h>
 #include <printk.h>
 
+#ifndef __BAREBOX__
+#include <sys/param.h>
+#endif
+
 #include "state.h"
 
 struct state_backend_storage_bucket_direct {
@@ -27,6 +32,14 @@ struct state_backend_storage_bucket_direct {
 
 	ssize_t offset;
 	ssize_t max_size;
+	ssize_t log_end; /* End of the delta log, 0 if there is no delta log */
+
+	uint32_t pagesize; /* Write granularity, 0 if unknown */
+	void *image; /* Meta data, data and generation as stored on the device */
+	ssize_t image_len;
+
+	uint32_t probe_crc; /* Checksum of the samples taken on the last read */
+	bool probe_valid;
 
 	int fd;
 
@@ -39,6 +52,20 @@ struct __attribute__((__packed__)) state_backend_storage_bucket_direct_meta {
 };
 static const uint32_t direct_magic = 0x2354fdf3;
 
+/*
+ * The generation is stored in a trailer directly behind the data, given the
+ * stride leaves room for it. Readers not aware of it ignore everything behind
+ * written_length. Writers not aware of it leave an old trailer in place, so it
+ * carries the crc of the data it belongs to. A stale trailer is ignored.
+ * The records of the delta log follow the trailer back to back.
+ */
+struct __attribute__((__packed__)) state_backend_storage_bucket_direct_generation {
+	uint32_t magic;
+	uint32_t generation;
+	uint32_t data_crc;
+};
+static const uint32_t direct_generation_magic = 0x6e65472e;
+
 static inline struct state_backend_storage_bucket_direct
     *get_bucket_direct(struct state_backend_storage_bucket *bucket)
 {
@@ -46,6 +73,107 @@ static inline struct state_backend_storage_bucket_direct
 			    bucket);
 }
 
+static int state_backend_bucket_direct_read_at(struct state_backend_storage_bucket_direct *direct,
+					       off_t offset, void *buf, size_t len)
+{
+	int ret;
+
+	offset += direct->offset;
+	if (lseek(direct->fd, offset, SEEK_SET) != offset) {
+		dev_err(direct->dev, "Failed to seek file, %d\n", -errno);
+		return -errno;
+	}
+
+	ret = read_full(direct->fd, buf, len);
+	if (ret < 0) {
+		dev_err(direct->dev, "Failed to read from file, %d\n", ret);
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Checksums the meta data, the generation trailer and the place where the
+ * next delta log record goes. Every write changes at least one of them.
+ */
+static int state_backend_bucket_direct_sample(struct state_backend_storage_bucket_direct *direct,
+					      uint32_t *crc)
+{
+	struct __attribute__((__packed__)) {
+		struct state_backend_storage_bucket_direct_meta meta;
+		struct state_backend_storage_bucket_direct_generation gen;
+		struct state_delta_header log;
+	} sample;
+	ssize_t gen_offset;
+	int ret;
+
+	memset(&sample, 0, sizeof(sample));
+
+	ret = state_backend_bucket_direct_read_at(direct, 0, &sample.meta,
+						  sizeof(sample.meta));
+	if (ret)
+		return ret;
+
+	gen_offset = sizeof(sample.meta) + sample.meta.written_length;
+	if (sample.meta.magic == direct_magic &&
+	    sample.meta.written_length <= direct->max_size &&
+	    gen_offset + sizeof(sample.gen) <= direct->max_size) {
+		ret = state_backend_bucket_direct_read_at(direct, gen_offset,
+							  &sample.gen,
+							  sizeof(sample.gen));
+		if (ret)
+			return ret;
+	}
+
+	if (direct->log_end &&
+	    direct->log_end + sizeof(sample.log) <= direct->max_size) {
+		ret = state_backend_bucket_direct_read_at(direct, direct->log_end,
+							  &sample.log,
+							  sizeof(sample.log));
+		if (ret)
+			return ret;
+	}
+
+	*crc = crc32(0, &sample, sizeof(sample));
+
+	return 0;
+}
+
+/* Replays the delta log behind the generation trailer */
+static void state_backend_bucket_direct_replay(struct state_backend_storage_bucket_direct *direct,
+					       void *buf, ssize_t len)
+{
+	struct state_delta_header header;
+	ssize_t record_len;
+	void *record;
+	int ret;
+
+	while (direct->log_end + sizeof(header) <= direct->max_size) {
+		ret = read_full(direct->fd, &header, sizeof(header));
+		if (ret < 0)
+			return;
+
+		record_len = state_delta_record_len(&header);
+		if (record_len < 0 ||
+		    record_len > direct->max_size - direct->log_end)
+			return;
+
+		record = xmalloc(record_len);
+		memcpy(record, &header, sizeof(header));
+		ret = read_full(direct->fd, record + sizeof(header),
+				record_len - sizeof(header));
+		if (ret >= 0)
+			ret = state_delta_apply(buf, len, record, record_len,
+						&direct->bucket.generation);
+		free(record);
+		if (ret < 0)
+			return;
+
+		direct->log_end += record_len;
+	}
+}
+
 static int state_backend_bucket_direct_read(struct state_backend_storage_bucket
 					    *bucket, void ** buf_out,
 					    ssize_t * len_out)
@@ -53,10 +181,18 @@ static int state_backend_bucket_direct_read(struct state_backend_storage_bucket
 	struct state_backend_storage_bucket_direct *direct =
 	    get_bucket_direct(bucket);
 	struct state_backend_storage_bucket_direct_meta meta;
+	struct state_backend_storage_bucket_direct_generation gen;
 	uint32_t read_len;
+	size_t gen_len = 0;
 	void *buf;
 	int ret;
 
+	bucket->generation = 0;
+	direct->log_end = 0;
+	direct->probe_valid = false;
+	free(direct->image);
+	direct->image = NULL;
+
 	if (lseek(direct->fd, direct->offset, SEEK_SET) != direct->offset) {
 		dev_err(direct->dev, "Failed to seek file, %d\n", -errno);
 		return -errno;
@@ -73,6 +209,8 @@ static int state_backend_bucket_direct_read(struct state_backend_storage_bucket
 			return -EINVAL;
 
 		}
+		if (sizeof(meta) + read_len + sizeof(gen) <= direct->max_size)
+			gen_len = sizeof(gen);
 	} else {
 		if (meta.magic != ~0 && !!meta.magic)
 			bucket->wrong_magic = 1;
@@ -90,23 +228,133 @@ static int state_backend_bucket_direct_read(struct state_backend_storage_bucket
 		}
 	}
 
-	buf = xmalloc(read_len);
+	/* read the generation trailer along with the data */
+	buf = xmalloc(read_len + gen_len);
 	if (!buf)
 		return -ENOMEM;
 
-	ret = read_full(direct->fd, buf, read_len);
+	ret = read_full(direct->fd, buf, read_len + gen_len);
 	if (ret < 0) {
 		dev_err(direct->dev, "Failed to read from file, %d\n", ret);
 		free(buf);
 		return ret;
 	}
 
+	/* remember what is on the device to only write changed pages later */
+	if (direct->pagesize && meta.magic == direct_magic) {
+		direct->image_len = sizeof(meta) + read_len + gen_len;
+		direct->image = xmalloc(direct->image_len);
+		memcpy(direct->image, &meta, sizeof(meta));
+		memcpy(direct->image + sizeof(meta), buf, read_len + gen_len);
+	}
+
+	if (gen_len) {
+		memcpy(&gen, buf + read_len, sizeof(gen));
+		if (gen.magic == direct_generation_magic &&
+		    gen.data_crc == crc32(0, buf, read_len))
+			bucket->generation = gen.generation;
+	}
+
+	if (bucket->generation) {
+		direct->log_end = sizeof(meta) + read_len + gen_len;
+		state_backend_bucket_direct_replay(direct, buf, read_len);
+	}
+
+	/* Without meta data there is nothing to tell a write by */
+	if (meta.magic == direct_magic)
+		direct->probe_valid = !state_backend_bucket_direct_sample(direct,
+							&direct->probe_crc);
+
 	*buf_out = buf;
 	*len_out = read_len;
 
 	return 0;
 }
 
+static int state_backend_bucket_direct_write_range(struct state_backend_storage_bucket_direct *direct,
+						   const void *buf, ssize_t start,
+						   ssize_t end)
+{
+	off_t offset = direct->offset + start;
+	int ret;
+
+	if (lseek(direct->fd, offset, SEEK_SET) != offset) {
+		dev_err(direct->dev, "Failed to seek file, %d\n", -errno);
+		return -errno;
+	}
+
+	ret = write_full(direct->fd, buf + start, end - start);
+	if (ret < 0)
+		return ret;
+
+	dev_dbg(direct->dev, "Written %zd bytes at offset %lld\n", end - start,
+		(long long) offset);
+
+	return 0;
+}
+
+/*
+ * Checks that the meta data and the generation trailer on the device still
+ * match the image. Another process may have written the bucket since it was
+ * read, so the image cannot tell the changed pages anymore.
+ */
+static bool state_backend_bucket_direct_image_current(struct state_backend_storage_bucket_direct *direct)
+{
+	struct state_backend_storage_bucket_direct_meta meta;
+	struct state_backend_storage_bucket_direct_generation gen;
+	ssize_t gen_offset;
+
+	if (state_backend_bucket_direct_read_at(direct, 0, &meta, sizeof(meta)))
+		return false;
+	if (memcmp(&meta, direct->image, sizeof(meta)))
+		return false;
+
+	/* Without a trailer there is no generation to compare */
+	gen_offset = sizeof(meta) + meta.written_length;
+	if (gen_offset + sizeof(gen) != direct->image_len)
+		return false;
+
+	if (state_backend_bucket_direct_read_at(direct, gen_offset, &gen,
+						sizeof(gen)))
+		return false;
+
+	return !memcmp(&gen, direct->image + gen_offset, sizeof(gen));
+}
+
+/*
+ * Writes only the pages differing from the image on the device. This is not
+ * less safe than writing everything: an interrupted write leaves this bucket
+ * broken either way, while the other buckets keep a valid copy.
+ */
+static int state_backend_bucket_direct_write_changed(struct state_backend_storage_bucket_direct *direct,
+						     const void *buf, ssize_t len)
+{
+	ssize_t pos, end, start = -1;
+	bool changed;
+	int ret;
+
+	for (pos = 0; pos < len; pos = end) {
+		end = roundup(direct->offset + pos + 1, direct->pagesize) -
+		      direct->offset;
+		end = min(end, len);
+
+		changed = memcmp(direct->image + pos, buf + pos, end - pos);
+		if (changed && start < 0)
+			start = pos;
+
+		/* write consecutive changed pages at once */
+		if (start >= 0 && (!changed || end == len)) {
+			ret = state_backend_bucket_direct_write_range(direct, buf,
+					start, changed ? end : pos);
+			if (ret < 0)
+				return ret;
+			start = -1;
+		}
+	}
+
+	return 0;
+}
+
 static int state_backend_bucket_direct_write(struct state_backend_storage_bucket
 					     *bucket, const void * buf,
 					     ssize_t len)
@@ -114,22 +362,16 @@ static int state_backend_bucket_direct_write(struct state_backend_storage_bucket
 	struct state_backend_storage_bucket_direct *direct =
 	    get_bucket_direct(bucket);
 	int ret;
-	struct state_backend_storage_bucket_direct_meta meta;
-
-	if (lseek(direct->fd, direct->offset, SEEK_SET) != direct->offset) {
-		dev_err(direct->dev, "Failed to seek file, %d\n", -errno);
-		return -errno;
-	}
+	struct state_backend_storage_bucket_direct_meta *meta;
+	struct state_backend_storage_bucket_direct_generation *gen;
+	size_t meta_len = 0, gen_len = 0;
+	void *write_buf;
 
 	/* write the meta data only if there is head room */
-	if (len <= direct->max_size - sizeof(meta)) {
-		meta.magic = direct_magic;
-		meta.written_length = len;
-		ret = write_full(direct->fd, &meta, sizeof(meta));
-		if (ret < 0) {
-			dev_err(direct->dev, "Failed to write metadata to file, %d\n", ret);
-			return ret;
-		}
+	if (len <= direct->max_size - sizeof(*meta)) {
+		meta_len = sizeof(*meta);
+		if (len <= direct->max_size - sizeof(*meta) - sizeof(*gen))
+			gen_len = sizeof(*gen);
 	} else {
 		if (!IS_ENABLED(CONFIG_STATE_BACKWARD_COMPATIBLE)) {
 			dev_dbg(direct->dev, "Too small stride size: must skip metadata! Increase stride size\n");
@@ -137,12 +379,92 @@ static int state_backend_bucket_direct_write(struct state_backend_storage_bucket
 		}
 	}
 
-	ret = write_full(direct->fd, buf, len);
+	/* meta data, data and generation are written from a single buffer */
+	write_buf = xmalloc(meta_len + len + gen_len);
+	memcpy(write_buf + meta_len, buf, len);
+
+	if (meta_len) {
+		meta = write_buf;
+		meta->magic = direct_magic;
+		meta->written_length = len;
+	}
+
+	if (gen_len) {
+		gen = write_buf + meta_len + len;
+		gen->magic = direct_generation_magic;
+		gen->generation = bucket->generation;
+		gen->data_crc = crc32(0, buf, len);
+	}
+
+	if (direct->image && direct->image_len == meta_len + len + gen_len &&
+	    state_backend_bucket_direct_image_current(direct))
+		ret = state_backend_bucket_direct_write_changed(direct, write_buf,
+							meta_len + len + gen_len);
+	else
+		ret = state_backend_bucket_direct_write_range(direct, write_buf,
+					0, meta_len + len + gen_len);
+
+	free(direct->image);
+	direct->image = NULL;
+	direct->probe_valid = false;
+
+	if (ret < 0) {
+		dev_err(direct->dev, "Failed to write file, %d\n", ret);
+		free(write_buf);
+		direct->log_end = 0;
+		return ret;
+	}
+
+	if (direct->pagesize && meta_len) {
+		direct->image = write_buf;
+		direct->image_len = meta_len + len + gen_len;
+	} else {
+		free(write_buf);
+	}
+
+	/* a new delta log starts behind the generation trailer */
+	direct->log_end = gen_len ? meta_len + len + gen_len : 0;
+
+	return 0;
+}
+
+static int state_backend_bucket_direct_write_delta(struct state_backend_storage_bucket
+						   *bucket, const void * record,
+						   ssize_t len)
+{
+	struct state_backend_storage_bucket_direct *direct =
+	    get_bucket_direct(bucket);
+	off_t offset = direct->offset + direct->log_end;
+	int ret;
+
+	if (!direct->log_end || len > direct->max_size - direct->log_end)
+		return -ENOSPC;
+
+	if (lseek(direct->fd, offset, SEEK_SET) != offset) {
+		dev_err(direct->dev, "Failed to seek file, %d\n", -errno);
+		return -errno;
+	}
+
+	direct->probe_valid = false;
+
+	ret = write_full(direct->fd, record, len);
 	if (ret < 0) {
 		dev_err(direct->dev, "Failed to write file, %d\n", ret);
 		return ret;
 	}
 
+	direct->log_end += len;
+
+	return 0;
+}
+
+static int state_backend_bucket_direct_flush(struct state_backend_storage_bucket
+					     *bucket)
+{
+	struct state_backend_storage_bucket_direct *direct =
+	    get_bucket_direct(bucket);
+	int ret;
+
 	ret = flush(direct->fd);
 	if (ret < 0) {
 		dev_err(direct->dev, "Failed to flush file, %d\n", ret);
@@ -152,6 +474,24 @@ static int state_backend_bucket_direct_write(struct state_backend_storage_bucket
 	return 0;
 }
 
+static int state_backend_bucket_direct_probe(struct state_backend_storage_bucket
+					     *bucket)
+{
+	struct state_backend_storage_bucket_direct *direct =
+	    get_bucket_direct(bucket);
+	uint32_t crc;
+	int ret;
+
+	if (!direct->probe_valid)
+		return 1;
+
+	ret = state_backend_bucket_direct_sample(direct, &crc);
+	if (ret)
+		return ret;
+
+	return crc != direct->probe_crc;
+}
+
 static void state_backend_bucket_direct_free(struct
 					     state_backend_storage_bucket
 					     *bucket)
@@ -160,13 +500,14 @@ static void state_backend_bucket_direct_free(struct
 	    get_bucket_direct(bucket);
 
 	close(direct->fd);
+	free(direct->image);
 	free(direct);
 }
 
 int state_backend_bucket_direct_create(struct device_d *dev, const char *path,
 				       struct state_backend_storage_bucket **bucket,
 				       off_t offset, ssize_t max_size,
-				       bool readonly)
+				       uint32_t pagesize, bool readonly)
 {
 	int fd;
 	struct state_backend_storage_bucket_direct *direct;
@@ -180,11 +521,15 @@ int state_backend_bucket_direct_create(struct device_d *dev, const char *path,
 	direct = xzalloc(sizeof(*direct));
 	direct->offset = offset;
 	direct->max_size = max_size;
+	direct->pagesize = pagesize;
 	direct->fd = fd;
 	direct->dev = dev;
 
 	direct->bucket.read = state_backend_bucket_direct_read;
 	direct->bucket.write = state_backend_bucket_direct_write;
+	direct->bucket.write_delta = state_backend_bucket_direct_write_delta;
+	direct->bucket.flush = state_backend_bucket_direct_flush;
+	direct->bucket.probe = state_backend_bucket_direct_probe;
 	direct->bucket.free = state_backend_bucket_direct_free;
 	*bucket = &direct->bucket;
 
@@ -0,0 +1,220 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <common.h>
+#include <linux/kernel.h>
+#include <lzf.h>
+#include <malloc.h>
+
+#include "state.h"
+
+/*
+ * The compressed format wraps another format and compresses the data it packs
+ * before the data is handed to the storage, whose buckets checksum it. Data
+ * which does not get shorter is stored as it is.
+ *
+ * barebox does not know the backend-compression property and reads the
+ * compressed data as the inner format, which fails. Compression must only be
+ * used for states barebox does not access.
+ */
+struct state_backend_format_compressed {
+	struct state_backend_format format;
+
+	struct state_backend_format *inner;
+
+	/* For outputs */
+	struct device_d *dev;
+};
+
+#define STATE_COMPRESSED_MAGIC	0x31465a4c	/* "LZF1" */
+
+/* LZF does not expand a byte to more than about 90 bytes */
+#define STATE_COMPRESSED_MAX_RATIO	100
+
+struct __attribute__((__packed__)) backend_compressed_header {
+	uint32_t magic;
+	uint32_t data_len;	/* Length of the data the inner format packed */
+	uint32_t stored_len;	/* Length of the data stored behind the header */
+};
+
+static inline struct state_backend_format_compressed *get_format_compressed(
+		struct state_backend_format *format)
+{
+	return container_of(format, struct state_backend_format_compressed,
+			    format);
+}
+
+/* Returns the data the inner format packed, or an ERR_PTR() */
+static void *backend_compressed_decompress(
+		struct state_backend_format_compressed *compressed,
+		const void *buf, ssize_t len)
+{
+	const struct backend_compressed_header *header = buf;
+	void *data;
+	ssize_t ret;
+
+	if (len < sizeof(*header) || header->magic != STATE_COMPRESSED_MAGIC) {
+		dev_err(compressed->dev, "Error, no compressed data found\n");
+		return ERR_PTR(-EINVAL);
+	}
+
+	if (header->stored_len > len - sizeof(*header) ||
+	    header->stored_len > header->data_len ||
+	    header->data_len / STATE_COMPRESSED_MAX_RATIO > header->stored_len) {
+		dev_err(compressed->dev, "Error, invalid compressed length %u of %u bytes\n",
+			header->stored_len, header->data_len);
+		return ERR_PTR(-EINVAL);
+	}
+
+	if (header->stored_len == header->data_len)
+		return xmemdup(header + 1, header->data_len);
+
+	data = xmalloc(header->data_len);
+
+	ret = lzf_decompress(header + 1, header->stored_len, data,
+			     header->data_len);
+	if (ret != header->data_len) {
+		dev_err(compressed->dev, "Error, failed to decompress data, %zd\n",
+			ret);
+		free(data);
+		return ERR_PTR(-EINVAL);
+	}
+
+	return data;
+}
+
+static int backend_format_compressed_verify(struct state_backend_format *format,
+					    uint32_t magic, const void * buf,
+					    ssize_t *lenp, enum state_flags flags)
+{
+	struct state_backend_format_compressed *compressed =
+			get_format_compressed(format);
+	const struct backend_compressed_header *header = buf;
+	ssize_t data_len;
+	void *data;
+	int ret;
+
+	data = backend_compressed_decompress(compressed, buf, *lenp);
+	if (IS_ERR(data))
+		return PTR_ERR(data);
+
+	data_len = header->data_len;
+	ret = compressed->inner->verify(compressed->inner, magic, data,
+					&data_len, flags);
+	free(data);
+	if (ret)
+		return ret;
+
+	*lenp = sizeof(*header) + header->stored_len;
+
+	return 0;
+}
+
+static int backend_format_compressed_unpack(struct state_backend_format *format,
+					    struct state *state,
+					    const void * buf, ssize_t len)
+{
+	struct state_backend_format_compressed *compressed =
+			get_format_compressed(format);
+	const struct backend_compressed_header *header = buf;
+	void *data;
+	int ret;
+
+	data = backend_compressed_decompress(compressed, buf, len);
+	if (IS_ERR(data))
+		return PTR_ERR(data);
+
+	ret = compressed->inner->unpack(compressed->inner, state, data,
+					header->data_len);
+	free(data);
+
+	return ret;
+}
+
+static int backend_format_compressed_pack(struct state_backend_format *format,
+					  struct state *state, void ** buf_out,
+					  ssize_t * len_out)
+{
+	struct state_backend_format_compressed *compressed =
+			get_format_compressed(format);
+	struct backend_compressed_header *header;
+	void *data = NULL, *buf;
+	ssize_t data_len = 0, stored_len;
+	int ret;
+
+	/* The image of the state is compressed, the inner format cannot use it */
+	ret = compressed->inner->pack(compressed->inner, state, &data,
+				      &data_len);
+	if (ret)
+		return ret;
+
+	buf = xmalloc(sizeof(*header) + data_len);
+	header = buf;
+
+	stored_len = lzf_compress(data, data_len, header + 1,
+				  data_len ? data_len - 1 : 0);
+	if (stored_len < 0) {
+		memcpy(header + 1, data, data_len);
+		stored_len = data_len;
+	}
+
+	free(data);
+
+	header->magic = STATE_COMPRESSED_MAGIC;
+	header->data_len = data_len;
+	header->stored_len = stored_len;
+
+	dev_dbg(compressed->dev, "Compressed %zd bytes to %zd bytes\n",
+		data_len, stored_len);
+
+	*buf_out = buf;
+	*len_out = sizeof(*header) + stored_len;
+
+	return 0;
+}
+
+static void backend_format_compressed_free(struct state_backend_format *format)
+{
+	struct state_backend_format_compressed *compressed =
+			get_format_compressed(format);
+
+	if (compressed->inner->free)
+		compressed->inner->free(compressed->inner);
+	free(compressed);
+}
+
+int backend_format_compressed_create(struct state_backend_format **format,
+				     const char *compression,
+				     struct device_d *dev)
+{
+	struct state_backend_format_compressed *compressed;
+
+	if (strcmp(compression, "lzf")) {
+		dev_err(dev, "Invalid backend compression %s\n", compression);
+		return -EINVAL;
+	}
+
+	compressed = xzalloc(sizeof(*compressed));
+	compressed->inner = *format;
+	compressed->dev = dev;
+
+	compressed->format.pack = backend_format_compressed_pack;
+	compressed->format.unpack = backend_format_compressed_unpack;
+	compressed->format.verify = backend_format_compressed_verify;
+	compressed->format.free = backend_format_compressed_free;
+	compressed->format.name = compressed->inner->name;
+	compressed->format.compression = "lzf";
+	*format = &compressed->format;
+
+	return 0;
+}
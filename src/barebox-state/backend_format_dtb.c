@@ -26,12 +26,25 @@
 struct state_backend_format_dtb {
 	struct state_backend_format format;
 
-	struct device_node *root;
-
 	/* For outputs */
 	struct device_d *dev;
 };
 
+/* Limits the recursion when unpacking, the state nodes are not nested deeply */
+#define STATE_DTB_MAX_DEPTH	32
+
+/* Walks the structure block of a flattened devicetree checked before */
+struct state_dtb_walk {
+	struct state *state;
+	struct state_backend_format_dtb *fdtb;
+	const void *fdt;
+	const char *strings;
+	uint32_t ofs;
+
+	/* Name of the current variable, large enough for all nested names */
+	char *name;
+};
+
 static inline struct state_backend_format_dtb *get_format_dtb(struct
 							      state_backend_format
 							      *format)
@@ -39,55 +52,302 @@ static inline struct state_backend_format_dtb *get_format_dtb(struct
 	return container_of(format, struct state_backend_format_dtb, format);
 }
 
+static inline uint32_t state_dtb_tag(const void *fdt, uint32_t ofs)
+{
+	return fdt32_to_cpu(*(const uint32_t *)(fdt + ofs));
+}
+
+/*
+ * Checks the structure of the flattened devicetree in place: The blocks have
+ * to lie within the buffer, all tokens, node names and properties within the
+ * structure block, all property names within the strings block and the nodes
+ * have to be nested properly below a single root node.
+ */
+static int state_backend_format_dtb_check(struct state_backend_format_dtb *fdtb,
+					  const void *buf, size_t len)
+{
+	const struct fdt_header *fdt = buf;
+	const struct fdt_property *prop;
+	uint32_t totalsize, off_struct, size_struct, off_strings, size_strings;
+	uint32_t ofs, end, plen, nameoff;
+	const char *strings;
+	size_t namelen;
+	bool root = false;
+	int depth = 0;
+
+	if (len < sizeof(*fdt)) {
+		dev_err(fdtb->dev, "Error, buffer length (%zd) is shorter than the DTB header\n",
+			len);
+		return -EINVAL;
+	}
+
+	if (fdt->magic != cpu_to_fdt32(FDT_MAGIC)) {
+		dev_err(fdtb->dev, "Error, bad DTB magic 0x%08x\n",
+			fdt32_to_cpu(fdt->magic));
+		return -EINVAL;
+	}
+
+	if (fdt->version != cpu_to_fdt32(17)) {
+		dev_err(fdtb->dev, "Error, bad DTB version 0x%08x\n",
+			fdt32_to_cpu(fdt->version));
+		return -EINVAL;
+	}
+
+	totalsize = fdt32_to_cpu(fdt->totalsize);
+	off_struct = fdt32_to_cpu(fdt->off_dt_struct);
+	size_struct = fdt32_to_cpu(fdt->size_dt_struct);
+	off_strings = fdt32_to_cpu(fdt->off_dt_strings);
+	size_strings = fdt32_to_cpu(fdt->size_dt_strings);
+
+	if (totalsize > len) {
+		dev_err(fdtb->dev, "Error, stored DTB length (%u) longer than read buffer (%zd)\n",
+			totalsize, len);
+		return -EINVAL;
+	}
+
+	if (off_struct > totalsize || size_struct > totalsize - off_struct ||
+	    off_strings > totalsize || size_strings > totalsize - off_strings ||
+	    off_struct % FDT_TAGSIZE) {
+		dev_err(fdtb->dev, "Error, DTB blocks exceed the DTB\n");
+		return -EINVAL;
+	}
+
+	strings = buf + off_strings;
+	ofs = off_struct;
+	end = off_struct + size_struct;
+
+	while (ofs <= end && end - ofs >= FDT_TAGSIZE) {
+		switch (state_dtb_tag(buf, ofs)) {
+		case FDT_BEGIN_NODE:
+			if (depth == 0 && root)
+				goto err;
+
+			ofs += FDT_TAGSIZE;
+			namelen = strnlen(buf + ofs, end - ofs);
+			if (namelen == end - ofs || ++depth > STATE_DTB_MAX_DEPTH)
+				goto err;
+
+			root = true;
+			ofs += ALIGN(namelen + 1, FDT_TAGSIZE);
+			break;
+
+		case FDT_END_NODE:
+			if (depth-- == 0)
+				goto err;
+
+			ofs += FDT_TAGSIZE;
+			break;
+
+		case FDT_PROP:
+			prop = buf + ofs;
+			if (depth == 0 || end - ofs < sizeof(*prop))
+				goto err;
+
+			plen = fdt32_to_cpu(prop->len);
+			nameoff = fdt32_to_cpu(prop->nameoff);
+			if (plen > end - ofs - sizeof(*prop) ||
+			    nameoff >= size_strings ||
+			    strnlen(strings + nameoff, size_strings - nameoff) ==
+			    size_strings - nameoff)
+				goto err;
+
+			ofs += ALIGN(sizeof(*prop) + plen, FDT_TAGSIZE);
+			break;
+
+		case FDT_NOP:
+			ofs += FDT_TAGSIZE;
+			break;
+
+		case FDT_END:
+			if (depth || !root)
+				goto err;
+
+			return 0;
+
+		default:
+			goto err;
+		}
+	}
+
+err:
+	dev_err(fdtb->dev, "Error, invalid DTB structure at offset 0x%x\n", ofs);
+
+	return -EINVAL;
+}
+
 static int state_backend_format_dtb_verify(struct state_backend_format *format,
 					   uint32_t magic, const void * buf,
 					   ssize_t *lenp, enum state_flags flags)
 {
 	struct state_backend_format_dtb *fdtb = get_format_dtb(format);
-	struct device_node *root;
-	struct fdt_header *fdt = (struct fdt_header *)buf;
-	size_t dtb_len = fdt32_to_cpu(fdt->totalsize);
-	size_t len = *lenp;
+	const struct fdt_header *fdt = buf;
+	int ret;
 
-	if (dtb_len > len) {
-		dev_err(fdtb->dev, "Error, stored DTB length (%zd) longer than read buffer (%zd)\n",
-			dtb_len, len);
-		return -EINVAL;
+	ret = state_backend_format_dtb_check(fdtb, buf, *lenp);
+	if (ret)
+		return ret;
+
+	*lenp = fdt32_to_cpu(fdt->totalsize);
+
+	return 0;
+}
+
+/* Imports the variable the node just walked describes */
+static int state_dtb_import(struct state_dtb_walk *walk, const char *type,
+			    int type_len, const void *value, int value_len,
+			    bool children)
+{
+	struct state *state = walk->state;
+	const struct variable_type *vtype;
+	struct state_variable *sv;
+
+	/* parents are allowed to have no type */
+	if (!type)
+		return children ? 0 : -EINVAL;
+
+	if (strnlen(type, type_len) >= type_len)
+		return -EILSEQ;
+
+	sv = state_find_var(state, walk->name);
+	if (IS_ERR(sv)) {
+		/* we ignore this error */
+		dev_dbg(&state->dev, "no such variable: %s\n", walk->name);
+		return 0;
 	}
 
-	if (fdtb->root) {
-		of_delete_node(fdtb->root);
-		fdtb->root = NULL;
+	/* The variable usually knows its type already */
+	vtype = sv->type;
+	if (strcmp(type, vtype->type_name))
+		vtype = state_find_type_by_name(type);
+	if (!vtype) {
+		dev_dbg(&state->dev, "Error: invalid variable type '%s'\n", type);
+		return -ENOENT;
 	}
 
-	root = of_unflatten_dtb(buf);
-	if (IS_ERR(root)) {
-		dev_err(fdtb->dev, "Failed to unflatten dtb from buffer with length %zd, %ld\n",
-			len, PTR_ERR(root));
-		return PTR_ERR(root);
+	return vtype->import_value(sv, value, value_len);
+}
+
+/*
+ * Walks the node at the current offset and its children and imports their
+ * values. @name_len is the length of the name of the parent variable.
+ */
+static int state_dtb_unpack_node(struct state_dtb_walk *walk, size_t name_len,
+				 bool is_root)
+{
+	struct state *state = walk->state;
+	const struct fdt_property *prop;
+	const char *node_name, *prop_name, *type = NULL;
+	const void *value = NULL;
+	int type_len = 0, value_len = 0, len;
+	bool children = false, checked = !is_root;
+	uint32_t magic;
+	size_t node_len = name_len;
+	int ret;
+
+	node_name = walk->fdt + walk->ofs + FDT_TAGSIZE;
+	walk->ofs += FDT_TAGSIZE + ALIGN(strlen(node_name) + 1, FDT_TAGSIZE);
+
+	if (!is_root) {
+		len = strcspn(node_name, "@");
+		if (node_len)
+			walk->name[node_len++] = '.';
+		memcpy(walk->name + node_len, node_name, len);
+		node_len += len;
 	}
 
-	fdtb->root = root;
+	while (1) {
+		switch (state_dtb_tag(walk->fdt, walk->ofs)) {
+		case FDT_PROP:
+			prop = walk->fdt + walk->ofs;
+			prop_name = walk->strings + fdt32_to_cpu(prop->nameoff);
+			len = fdt32_to_cpu(prop->len);
+			walk->ofs += ALIGN(sizeof(*prop) + len, FDT_TAGSIZE);
 
-	*lenp = be32_to_cpu(fdt->totalsize);
+			if (is_root && !checked && !strcmp(prop_name, "magic")) {
+				if (len < sizeof(uint32_t))
+					return -EOVERFLOW;
 
-	return 0;
+				magic = fdt32_to_cpu(*(const uint32_t *)prop->data);
+				if (state->magic && state->magic != magic) {
+					dev_err(&state->dev,
+						"invalid magic 0x%08x, should be 0x%08x\n",
+						magic, state->magic);
+					return -EINVAL;
+				}
+				checked = true;
+			} else if (!strcmp(prop_name, "type")) {
+				type = prop->data;
+				type_len = len;
+			} else if (!strcmp(prop_name, "value")) {
+				value = prop->data;
+				value_len = len;
+			}
+			break;
+
+		case FDT_BEGIN_NODE:
+			/* The properties of the state node come first */
+			if (!checked)
+				return -EINVAL;
+
+			children = true;
+			ret = state_dtb_unpack_node(walk, node_len, false);
+			if (ret)
+				return ret;
+			break;
+
+		case FDT_END_NODE:
+			walk->ofs += FDT_TAGSIZE;
+
+			if (!checked)
+				return -EINVAL;
+			if (is_root)
+				return 0;
+
+			walk->name[node_len] = 0;
+
+			return state_dtb_import(walk, type, type_len, value,
+						value_len, children);
+
+		default:
+			walk->ofs += FDT_TAGSIZE;
+			break;
+		}
+	}
 }
 
+/*
+ * Reads the values of the variables directly from the flattened devicetree
+ * instead of unflattening it. The defaults are those of the state's own
+ * devicetree description, the ones stored along with the values are ignored.
+ */
 static int state_backend_format_dtb_unpack(struct state_backend_format *format,
 					   struct state *state,
 					   const void * buf, ssize_t len)
 {
 	struct state_backend_format_dtb *fdtb = get_format_dtb(format);
+	const struct fdt_header *fdt = buf;
+	struct state_dtb_walk walk = {
+		.state = state,
+		.fdtb = fdtb,
+		.fdt = buf,
+	};
 	int ret;
 
-	if (!fdtb->root) {
-		state_backend_format_dtb_verify(format, 0, buf, &len, 0);
-	}
+	ret = state_backend_format_dtb_check(fdtb, buf, len);
+	if (ret)
+		return ret;
 
-	ret = state_from_node(state, fdtb->root, 0);
-	of_delete_node(fdtb->root);
-	fdtb->root = NULL;
+	walk.strings = buf + fdt32_to_cpu(fdt->off_dt_strings);
+	walk.ofs = fdt32_to_cpu(fdt->off_dt_struct);
+	walk.name = xzalloc(fdt32_to_cpu(fdt->size_dt_struct) + 1);
+
+	/* Skip to the root node, the check ensures there is one */
+	while (state_dtb_tag(buf, walk.ofs) != FDT_BEGIN_NODE)
+		walk.ofs += FDT_TAGSIZE;
+
+	ret = state_dtb_unpack_node(&walk, 0, true);
+
+	free(walk.name);
 
 	return ret;
 }
@@ -114,13 +374,11 @@ static int state_backend_format_dtb_pack(struct state_backend_format *format,
 		return -EINVAL;
 	}
 
+	of_delete_node(root);
+
 	*buf = (uint8_t *) fdt;
 	*len = fdt32_to_cpu(fdt->totalsize);
 
-	if (fdtb->root)
-		of_delete_node(fdtb->root);
-	fdtb->root = root;
-
 	return 0;
 }
 
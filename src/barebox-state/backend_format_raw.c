@@ -31,6 +31,8 @@ struct state_backend_format_raw {
 
 	struct digest *digest;
 	unsigned int digest_length;
+	/* The key is set once, the digest keeps it for all later inits */
+	bool digest_has_key;
 
 	/* For outputs */
 	struct device_d *dev;
@@ -38,8 +40,19 @@ struct state_backend_format_raw {
 	char *secret_name;
 	int needs_secret;
 	char *algo;
+
+	/* Header version to write, 0 if not set by the devicetree */
+	uint32_t version;
 };
 
+/*
+ * Version 1 of the header limits the data to 64 KiB and checksums with CRC32.
+ * Version 2 stores the version in place of the reserved field of version 1,
+ * which was always written as zero, has a 32 bit data length and checksums
+ * with CRC32C, which current CPUs compute in hardware.
+ */
+#define RAW_HEADER_VERSION_2	2
+
 struct __attribute__((__packed__)) backend_raw_header {
 	uint32_t magic;
 	uint16_t reserved;
@@ -48,8 +61,30 @@ struct __attribute__((__packed__)) backend_raw_header {
 	uint32_t header_crc;
 };
 
+struct __attribute__((__packed__)) backend_raw_header_v2 {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t flags;
+	uint32_t data_len;
+	uint32_t data_crc;
+	uint32_t header_crc;
+};
+
+/* No flags are defined yet, headers with any flags set are refused */
+#define RAW_HEADER_V2_FLAGS_KNOWN	0
+
 const int format_raw_min_length = sizeof(struct backend_raw_header);
 
+/* The fields of either header version */
+struct backend_raw_header_info {
+	unsigned int version;
+	unsigned int header_len;
+	uint32_t magic;
+	uint32_t data_len;
+	uint32_t data_crc;
+	uint32_t header_crc;
+};
+
 static inline struct state_backend_format_raw *get_format_raw(
 		struct state_backend_format *format)
 {
@@ -72,16 +107,24 @@ static int backend_raw_digest_init(struct state_backend_format_raw *raw)
 		raw->digest_length = digest_length(raw->digest);
 	}
 
-	ret = keystore_get_secret(raw->secret_name, &key, &key_len);
-	if (ret) {
-		dev_err(raw->dev, "Could not get secret '%s'\n",
-			raw->secret_name);
-		return ret;
-	}
+	if (!raw->digest_has_key) {
+		/* The keystore is shared by all states */
+		state_setup_lock();
+		ret = keystore_get_secret(raw->secret_name, &key, &key_len);
+		if (ret) {
+			state_setup_unlock();
+			dev_err(raw->dev, "Could not get secret '%s'\n",
+				raw->secret_name);
+			return ret;
+		}
 
-	ret = digest_set_key(raw->digest, key, key_len);
-	if (ret)
-		return ret;
+		ret = digest_set_key(raw->digest, key, key_len);
+		state_setup_unlock();
+		if (ret)
+			return ret;
+
+		raw->digest_has_key = true;
+	}
 
 	ret = digest_init(raw->digest);
 	if (ret) {
@@ -93,12 +136,45 @@ static int backend_raw_digest_init(struct state_backend_format_raw *raw)
 	return 0;
 }
 
+static uint32_t backend_raw_crc(unsigned int version, const void *buf,
+				unsigned int len)
+{
+	if (version == RAW_HEADER_VERSION_2)
+		return crc32c(0, buf, len);
+
+	return crc32(0, buf, len);
+}
+
+/* Decodes the header at @buf, which has to hold at least a version 1 header */
+static void backend_raw_header_decode(const void *buf,
+				      struct backend_raw_header_info *info)
+{
+	const struct backend_raw_header *header = buf;
+	const struct backend_raw_header_v2 *header_v2 = buf;
+
+	if (header_v2->version == RAW_HEADER_VERSION_2) {
+		info->version = RAW_HEADER_VERSION_2;
+		info->header_len = sizeof(*header_v2);
+		info->magic = header_v2->magic;
+		info->data_len = header_v2->data_len;
+		info->data_crc = header_v2->data_crc;
+		info->header_crc = header_v2->header_crc;
+	} else {
+		info->version = 1;
+		info->header_len = sizeof(*header);
+		info->magic = header->magic;
+		info->data_len = header->data_len;
+		info->data_crc = header->data_crc;
+		info->header_crc = header->header_crc;
+	}
+}
+
 static int backend_format_raw_verify(struct state_backend_format *format,
 				     uint32_t magic, const void * buf,
 				     ssize_t *lenp, enum state_flags flags)
 {
 	uint32_t crc;
-	struct backend_raw_header *header;
+	struct backend_raw_header_info header;
 	int d_len = 0;
 	int ret;
 	const void *data;
@@ -112,17 +188,34 @@ static int backend_format_raw_verify(struct state_backend_format *format,
 		return -EINVAL;
 	}
 
-	header = (struct backend_raw_header *)buf;
-	crc = crc32(0, header, sizeof(*header) - sizeof(uint32_t));
-	if (crc != header->header_crc) {
+	backend_raw_header_decode(buf, &header);
+	if (len < header.header_len) {
+		dev_err(backend_raw->dev, "Error, buffer length (%zd) is shorter than the version %u header\n",
+			len, header.version);
+		return -EINVAL;
+	}
+
+	crc = backend_raw_crc(header.version, buf,
+			      header.header_len - sizeof(uint32_t));
+	if (crc != header.header_crc) {
 		dev_err(backend_raw->dev, "Error, invalid header crc in raw format, calculated 0x%08x, found 0x%08x\n",
-			crc, header->header_crc);
+			crc, header.header_crc);
 		return -EINVAL;
 	}
 
-	if (magic && magic != header->magic) {
+	if (header.version == RAW_HEADER_VERSION_2) {
+		const struct backend_raw_header_v2 *header_v2 = buf;
+
+		if (header_v2->flags & ~RAW_HEADER_V2_FLAGS_KNOWN) {
+			dev_err(backend_raw->dev, "Error, unknown flags 0x%04x in raw format header\n",
+				header_v2->flags);
+			return -EINVAL;
+		}
+	}
+
+	if (magic && magic != header.magic) {
 		dev_err(backend_raw->dev, "Error, invalid magic in raw format 0x%08x, should be 0x%08x\n",
-			header->magic, magic);
+			header.magic, magic);
 		return -EINVAL;
 	}
 
@@ -134,29 +227,29 @@ static int backend_format_raw_verify(struct state_backend_format *format,
 		d_len = digest_length(backend_raw->digest);
 	}
 
-	complete_len = header->data_len + d_len + format_raw_min_length;
+	complete_len = (ssize_t)header.data_len + d_len + header.header_len;
 	if (complete_len > len) {
 		dev_err(backend_raw->dev, "Error, invalid data_len %u in header, have data of len %zu\n",
-			header->data_len, len);
+			header.data_len, len);
 		return -EINVAL;
 	}
 
-	data = buf + sizeof(*header);
+	data = buf + header.header_len;
 
-	crc = crc32(0, data, header->data_len);
-	if (crc != header->data_crc) {
+	crc = backend_raw_crc(header.version, data, header.data_len);
+	if (crc != header.data_crc) {
 		dev_err(backend_raw->dev, "invalid data crc, calculated 0x%08x, found 0x%08x\n",
-			crc, header->data_crc);
+			crc, header.data_crc);
 		return -EINVAL;
 	}
 
-	*lenp = header->data_len + sizeof(*header);
+	*lenp = header.data_len + header.header_len;
 
 	if (backend_raw->algo && !(flags & STATE_FLAG_NO_AUTHENTICATION)) {
-		const void *hmac = data + header->data_len;
+		const void *hmac = data + header.data_len;
 
 		/* hmac over header and data */
-		ret = digest_update(backend_raw->digest, buf, sizeof(*header) + header->data_len);
+		ret = digest_update(backend_raw->digest, buf, header.header_len + header.data_len);
 		if (ret) {
 			dev_err(backend_raw->dev, "Failed to update digest, %d\n",
 				ret);
@@ -179,35 +272,109 @@ static int backend_format_raw_unpack(struct state_backend_format *format,
 				     ssize_t len)
 {
 	struct state_variable *sv;
-	const struct backend_raw_header *header;
-	const void *data;
+	struct backend_raw_header_info header;
+	void *data;
 	struct state_backend_format_raw *backend_raw = get_format_raw(format);
 	int ret = 0;
 
-	header = (const struct backend_raw_header *)buf;
-	data = buf + sizeof(*header);
+	backend_raw_header_decode(buf, &header);
+	data = (void *)buf + header.header_len;
 
 	list_for_each_entry(sv, &state->variables, list) {
-		if (sv->start + sv->size > header->data_len) {
+		if (sv->start + sv->size > header.data_len) {
 			dev_err(backend_raw->dev, "State variable ends behind valid data, %s\n",
 				sv->name);
 			ret = -ENOSPC;
-			continue;
 		}
-		memcpy(sv->raw, data + sv->start, sv->size);
+	}
+
+	/*
+	 * The state keeps the buffer as its image, the values of the variables
+	 * stay where they were read. Without all of them, the buffer is freed.
+	 */
+	list_for_each_entry(sv, &state->variables, list) {
+		if (!ret)
+			sv->raw = data + sv->start;
+		else if (sv->start + sv->size <= header.data_len)
+			memcpy(sv->raw, data + sv->start, sv->size);
 	}
 
 	return ret;
 }
 
+/*
+ * Checks whether the image of the state already holds a packed state of the
+ * current layout, so that it can be packed into in place.
+ */
+static bool backend_format_raw_image_fits(struct state *state, const void *buf,
+					  ssize_t len, unsigned int version,
+					  unsigned int size_data,
+					  unsigned int size_full)
+{
+	struct backend_raw_header_info header;
+
+	if (!buf || len != size_full)
+		return false;
+
+	backend_raw_header_decode(buf, &header);
+
+	return header.version == version && header.magic == state->magic &&
+		header.data_len == size_data;
+}
+
+/*
+ * Moves the values of all variables into @data, the data of the image of the
+ * state, unless they already live there.
+ */
+static void backend_format_raw_attach(struct state *state, void *data)
+{
+	struct state_variable *sv;
+
+	list_for_each_entry(sv, &state->variables, list) {
+		void *raw = data + sv->start;
+
+		if (sv->raw == raw)
+			continue;
+
+		memcpy(raw, sv->raw, sv->size);
+		sv->raw = raw;
+	}
+}
+
+/* Writes a header of @version for the @size_data bytes of data behind it */
+static void backend_raw_header_encode(struct state *state, void *buf,
+				      unsigned int version,
+				      unsigned int size_data)
+{
+	struct backend_raw_header *header = buf;
+	struct backend_raw_header_v2 *header_v2 = buf;
+
+	if (version == RAW_HEADER_VERSION_2) {
+		header_v2->magic = state->magic;
+		header_v2->version = RAW_HEADER_VERSION_2;
+		header_v2->flags = 0;
+		header_v2->data_len = size_data;
+		header_v2->data_crc = crc32c(0, header_v2 + 1, size_data);
+		header_v2->header_crc = crc32c(0, header_v2,
+					sizeof(*header_v2) - sizeof(uint32_t));
+	} else {
+		header->magic = state->magic;
+		header->reserved = 0;
+		header->data_len = size_data;
+		header->data_crc = crc32(0, header + 1, size_data);
+		header->header_crc = crc32(0, header,
+					   sizeof(*header) - sizeof(uint32_t));
+	}
+}
+
 static int backend_format_raw_pack(struct state_backend_format *format,
 				   struct state *state, void ** buf_out,
 				   ssize_t * len_out)
 {
 	struct state_backend_format_raw *backend_raw = get_format_raw(format);
 	void *buf, *data, *hmac;
-	struct backend_raw_header *header;
 	struct state_variable *sv;
+	unsigned int version, size_header;
 	unsigned int size_full;
 	unsigned int size_data;
 	int ret;
@@ -220,48 +387,61 @@ static int backend_format_raw_pack(struct state_backend_format *format,
 
 	sv = list_last_entry(&state->variables, struct state_variable, list);
 	size_data = sv->start + sv->size;
-	size_full = size_data + sizeof(*header) + backend_raw->digest_length;
 
-	buf = xzalloc(size_full);
+	/* Only version 2 can describe more data than 64 KiB */
+	version = backend_raw->version;
+	if (!version)
+		version = size_data > UINT16_MAX ? RAW_HEADER_VERSION_2 : 1;
+	if (version == 1 && size_data > UINT16_MAX) {
+		dev_err(backend_raw->dev, "State data of %u bytes too large for raw format version 1\n",
+			size_data);
+		return -EOVERFLOW;
+	}
 
-	header = buf;
-	data = buf + sizeof(*header);
-	hmac = data + size_data;
+	size_header = version == RAW_HEADER_VERSION_2 ?
+		sizeof(struct backend_raw_header_v2) :
+		sizeof(struct backend_raw_header);
+	size_full = size_data + size_header + backend_raw->digest_length;
+
+	if (backend_format_raw_image_fits(state, *buf_out, *len_out, version,
+					  size_data, size_full))
+		buf = *buf_out;
+	else
+		buf = xzalloc(size_full);
 
-	list_for_each_entry(sv, &state->variables, list)
-		memcpy(data + sv->start, sv->raw, sv->size);
+	data = buf + size_header;
+	hmac = data + size_data;
 
-	header->magic = state->magic;
-	header->data_len = size_data;
-	header->data_crc = crc32(0, data, size_data);
-	header->header_crc = crc32(0, header,
-				   sizeof(*header) - sizeof(uint32_t));
+	/*
+	 * Once the variables live in the image, packing only checksums the
+	 * memory they are already stored in.
+	 */
+	backend_format_raw_attach(state, data);
+	backend_raw_header_encode(state, buf, version, size_data);
 
 	if (backend_raw->algo) {
 		/* hmac over header and data */
-		ret = digest_update(backend_raw->digest, buf, sizeof(*header) + size_data);
+		ret = digest_update(backend_raw->digest, buf, size_header + size_data);
 		if (ret) {
 			dev_err(backend_raw->dev, "Failed to update digest for packing, %d\n",
 				ret);
-			goto out_free;
+			goto out;
 		}
 
 		ret = digest_final(backend_raw->digest, hmac);
 		if (ret < 0) {
 			dev_err(backend_raw->dev, "Failed to finish digest for packing, %d\n",
 				ret);
-			goto out_free;
+			goto out;
 		}
 	}
 
+	ret = 0;
+out:
+	/* The variables live in the buffer, the state keeps it even on errors */
 	*buf_out = buf;
 	*len_out = size_full;
 
-	return 0;
-
-out_free:
-	free(buf);
-
 	return ret;
 }
 
@@ -269,6 +449,10 @@ static void backend_format_raw_free(struct state_backend_format *format)
 {
 	struct state_backend_format_raw *backend_raw = get_format_raw(format);
 
+	/* Wipes the key the digest holds */
+	digest_free(backend_raw->digest);
+	free(backend_raw->secret_name);
+	free(backend_raw->algo);
 	free(backend_raw);
 }
 
@@ -309,6 +493,14 @@ int backend_format_raw_create(struct state_backend_format **format,
 	raw = xzalloc(sizeof(*raw));
 
 	raw->dev = dev;
+	of_property_read_u32(node, "backend-raw-version", &raw->version);
+	if (raw->version > RAW_HEADER_VERSION_2) {
+		dev_err(raw->dev, "Unsupported raw format version %u\n",
+			raw->version);
+		free(raw);
+		return -EINVAL;
+	}
+
 	ret = backend_format_raw_init_digest(raw, node, secret_name);
 	if (ret) {
 		dev_err(raw->dev, "Failed initializing digest for raw format, %d\n",
@@ -335,3 +527,12 @@ struct digest *state_backend_format_raw_get_digest(struct state_backend_format
 
 	return backend_raw->digest;
 }
+
+/* Returns the header version set by the devicetree, 0 if it is not set */
+unsigned int state_backend_format_raw_get_version(struct state_backend_format
+						  *format)
+{
+	struct state_backend_format_raw *backend_raw = get_format_raw(format);
+
+	return backend_raw->version;
+}
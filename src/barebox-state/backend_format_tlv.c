@@ -0,0 +1,359 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#include <common.h>
+#include <linux/kernel.h>
+#include <malloc.h>
+#include <crc.h>
+#include <of.h>
+
+#include "state.h"
+
+/*
+ * The tlv format stores a header followed by one record per variable. A record
+ * holds the id of the variable, the length of its value, a CRC over both and
+ * the value itself. The id is a CRC32 over the name, the type and the size of
+ * the variable, so it stays the same when other variables are added, removed
+ * or moved. A record is only unpacked into the variable it was written for,
+ * the values of variables without a record are kept.
+ *
+ * As each record carries its own CRC, a single record can be validated without
+ * the others. Verifying still checks all records, as a state is always read
+ * as a whole.
+ *
+ * Trailing zeros of a value are not stored, unpacking pads the value with
+ * zeros again. Records with ids unknown to the layout are skipped, which
+ * leaves room for records of other kinds. Like the raw format, all numbers are
+ * stored in the byte order of the CPU.
+ *
+ * barebox does not know this format, it must only be used for states barebox
+ * does not access.
+ */
+struct backend_tlv_var {
+	uint32_t id;
+	struct state_variable *sv;
+};
+
+struct state_backend_format_tlv {
+	struct state_backend_format format;
+
+	struct state *state;
+
+	/* Variables sorted by id, built on first use */
+	struct backend_tlv_var *vars;
+	unsigned int num_vars;
+
+	/* For outputs */
+	struct device_d *dev;
+};
+
+struct __attribute__((__packed__)) backend_tlv_header {
+	uint32_t magic;
+	uint32_t data_len;
+	uint32_t header_crc;
+};
+
+struct __attribute__((__packed__)) backend_tlv_record {
+	uint32_t id;
+	uint16_t len;
+	uint16_t crc;
+	uint8_t value[];
+};
+
+static inline struct state_backend_format_tlv *get_format_tlv(
+		struct state_backend_format *format)
+{
+	return container_of(format, struct state_backend_format_tlv, format);
+}
+
+static uint32_t backend_tlv_var_id(struct state_variable *sv)
+{
+	uint32_t crc, size = sv->size;
+
+	crc = crc32(0, sv->name, strlen(sv->name) + 1);
+	crc = crc32(crc, sv->type->type_name, strlen(sv->type->type_name) + 1);
+
+	return crc32(crc, &size, sizeof(size));
+}
+
+static int backend_tlv_var_cmp(const void *a, const void *b)
+{
+	const struct backend_tlv_var *va = a, *vb = b;
+
+	if (va->id == vb->id)
+		return 0;
+
+	return va->id < vb->id ? -1 : 1;
+}
+
+static int backend_tlv_layout_init(struct state_backend_format_tlv *tlv)
+{
+	struct state *state = tlv->state;
+	struct state_variable *sv;
+	unsigned int i, n = 0;
+
+	if (tlv->vars)
+		return 0;
+
+	/* The length of a record is 16 bits wide */
+	list_for_each_entry(sv, &state->variables, list) {
+		if (sv->size > UINT16_MAX) {
+			dev_err(tlv->dev, "Variable %s is too large for the tlv format, %u bytes, at most %u are supported\n",
+				sv->name, sv->size, UINT16_MAX);
+			return -EINVAL;
+		}
+	}
+
+	tlv->vars = xmalloc(state->num_vars * sizeof(*tlv->vars));
+
+	list_for_each_entry(sv, &state->variables, list) {
+		tlv->vars[n].id = backend_tlv_var_id(sv);
+		tlv->vars[n].sv = sv;
+		n++;
+	}
+
+	qsort(tlv->vars, n, sizeof(*tlv->vars), backend_tlv_var_cmp);
+
+	for (i = 1; i < n; i++) {
+		if (tlv->vars[i].id != tlv->vars[i - 1].id)
+			continue;
+
+		dev_err(tlv->dev, "Variables %s and %s have the same tlv id 0x%08x, rename one\n",
+			tlv->vars[i - 1].sv->name, tlv->vars[i].sv->name,
+			tlv->vars[i].id);
+		free(tlv->vars);
+		tlv->vars = NULL;
+		return -EINVAL;
+	}
+
+	tlv->num_vars = n;
+
+	return 0;
+}
+
+/* Returns the variable a record with @id was written for, NULL if unknown */
+static struct state_variable *backend_tlv_find_var(
+		struct state_backend_format_tlv *tlv, uint32_t id)
+{
+	struct backend_tlv_var key = { .id = id }, *var;
+
+	var = bsearch(&key, tlv->vars, tlv->num_vars, sizeof(*tlv->vars),
+		      backend_tlv_var_cmp);
+
+	return var ? var->sv : NULL;
+}
+
+static uint16_t backend_tlv_record_crc(const struct backend_tlv_record *record)
+{
+	uint32_t crc;
+
+	crc = crc32(0, record, offsetof(struct backend_tlv_record, crc));
+	crc = crc32(crc, record->value, record->len);
+
+	return crc & 0xffff;
+}
+
+/*
+ * Returns the record at @ofs of the @len bytes of records in @data if it lies
+ * within them and its CRC is valid, NULL otherwise.
+ */
+static const struct backend_tlv_record *backend_tlv_record_get(
+		const void *data, uint32_t len, uint32_t ofs)
+{
+	const struct backend_tlv_record *record = data + ofs;
+
+	if (len - ofs < sizeof(*record) ||
+	    record->len > len - ofs - sizeof(*record))
+		return NULL;
+
+	if (backend_tlv_record_crc(record) != record->crc)
+		return NULL;
+
+	return record;
+}
+
+static int backend_format_tlv_verify(struct state_backend_format *format,
+				     uint32_t magic, const void * buf,
+				     ssize_t *lenp, enum state_flags flags)
+{
+	struct state_backend_format_tlv *tlv = get_format_tlv(format);
+	const struct backend_tlv_header *header = buf;
+	const struct backend_tlv_record *record;
+	ssize_t len = *lenp;
+	uint32_t crc, ofs;
+	int ret;
+
+	if (len < sizeof(*header)) {
+		dev_err(tlv->dev, "Error, buffer length (%zd) is shorter than the minimum required header length\n",
+			len);
+		return -EINVAL;
+	}
+
+	crc = crc32(0, header, sizeof(*header) - sizeof(uint32_t));
+	if (crc != header->header_crc) {
+		dev_err(tlv->dev, "Error, invalid header crc in tlv format, calculated 0x%08x, found 0x%08x\n",
+			crc, header->header_crc);
+		return -EINVAL;
+	}
+
+	if (magic && magic != header->magic) {
+		dev_err(tlv->dev, "Error, invalid magic in tlv format 0x%08x, should be 0x%08x\n",
+			header->magic, magic);
+		return -EINVAL;
+	}
+
+	ret = backend_tlv_layout_init(tlv);
+	if (ret)
+		return ret;
+
+	if (header->data_len > len - sizeof(*header)) {
+		dev_err(tlv->dev, "Error, invalid data_len %u in header, have data of len %zu\n",
+			header->data_len, len);
+		return -EINVAL;
+	}
+
+	for (ofs = 0; ofs < header->data_len; ofs += sizeof(*record) + record->len) {
+		record = backend_tlv_record_get(header + 1, header->data_len, ofs);
+		if (!record) {
+			dev_err(tlv->dev, "Error, invalid record at offset 0x%x\n",
+				ofs);
+			return -EINVAL;
+		}
+	}
+
+	*lenp = sizeof(*header) + header->data_len;
+
+	return 0;
+}
+
+static int backend_format_tlv_unpack(struct state_backend_format *format,
+				     struct state *state, const void * buf,
+				     ssize_t len)
+{
+	struct state_backend_format_tlv *tlv = get_format_tlv(format);
+	const struct backend_tlv_header *header = buf;
+	const struct backend_tlv_record *record;
+	struct state_variable *sv;
+	uint32_t ofs;
+	int ret;
+
+	ret = backend_tlv_layout_init(tlv);
+	if (ret)
+		return ret;
+
+	for (ofs = 0; ofs < header->data_len; ofs += sizeof(*record) + record->len) {
+		record = backend_tlv_record_get(header + 1, header->data_len, ofs);
+		if (!record)
+			return -EINVAL;
+
+		/* Not a variable of this layout */
+		sv = backend_tlv_find_var(tlv, record->id);
+		if (!sv)
+			continue;
+
+		if (record->len > sv->size) {
+			dev_err(tlv->dev, "State variable %s too long, %u bytes\n",
+				sv->name, record->len);
+			return -EINVAL;
+		}
+
+		memcpy(sv->raw, record->value, record->len);
+		memset(sv->raw + record->len, 0, sv->size - record->len);
+	}
+
+	return 0;
+}
+
+static int backend_format_tlv_pack(struct state_backend_format *format,
+				   struct state *state, void ** buf_out,
+				   ssize_t * len_out)
+{
+	struct state_backend_format_tlv *tlv = get_format_tlv(format);
+	struct backend_tlv_header *header;
+	struct backend_tlv_record *record;
+	struct state_variable *sv;
+	const uint8_t *value;
+	uint32_t size_data = 0;
+	unsigned int i, len;
+	void *buf, *data;
+	int ret;
+
+	ret = backend_tlv_layout_init(tlv);
+	if (ret)
+		return ret;
+
+	list_for_each_entry(sv, &state->variables, list)
+		size_data += sizeof(*record) + sv->size;
+
+	buf = xzalloc(sizeof(*header) + size_data);
+	header = buf;
+	data = buf + sizeof(*header);
+
+	for (i = 0; i < tlv->num_vars; i++) {
+		sv = tlv->vars[i].sv;
+		value = sv->raw;
+
+		for (len = sv->size; len && !value[len - 1]; len--)
+			;
+
+		record = data;
+		record->id = tlv->vars[i].id;
+		record->len = len;
+		memcpy(record->value, value, len);
+		record->crc = backend_tlv_record_crc(record);
+
+		data += sizeof(*record) + len;
+	}
+
+	header->magic = state->magic;
+	header->data_len = data - (buf + sizeof(*header));
+	header->header_crc = crc32(0, header,
+				   sizeof(*header) - sizeof(uint32_t));
+
+	*buf_out = buf;
+	*len_out = sizeof(*header) + header->data_len;
+
+	return 0;
+}
+
+static void backend_format_tlv_free(struct state_backend_format *format)
+{
+	struct state_backend_format_tlv *tlv = get_format_tlv(format);
+
+	free(tlv->vars);
+	free(tlv);
+}
+
+int backend_format_tlv_create(struct state_backend_format **format,
+			      struct device_node *node, struct state *state)
+{
+	struct state_backend_format_tlv *tlv;
+
+	if (of_find_property(node, "algo", NULL)) {
+		dev_err(&state->dev, "algo is not supported by the tlv format\n");
+		return -EINVAL;
+	}
+
+	tlv = xzalloc(sizeof(*tlv));
+
+	tlv->state = state;
+	tlv->dev = &state->dev;
+	tlv->format.pack = backend_format_tlv_pack;
+	tlv->format.unpack = backend_format_tlv_unpack;
+	tlv->format.verify = backend_format_tlv_verify;
+	tlv->format.free = backend_format_tlv_free;
+	tlv->format.name = "tlv";
+	*format = &tlv->format;
+
+	return 0;
+}
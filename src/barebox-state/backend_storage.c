@@ -14,6 +14,7 @@
  */
 
 #include <asm-generic/ioctl.h>
+#include <crc.h>
 #include <fcntl.h>
 #include <fs.h>
 #include <libfile.h>
@@ -37,19 +38,375 @@
  * device at any time the state framework stores multiple buckets. The strategy
  * is as follows:
  *
- * When loading the state from the storage we iterate over the buckets. We
- * take the first one we find which has valid crcs. The next step is to
- * restore consistency between the different buckets. This means rewriting
- * a bucket when it signalled it needs refresh (i.e. returned -EUCLEAN)
- * or when contains data different from the bucket we use.
+ * Every time the state is stored, the buckets are tagged with a new
+ * generation, a counter incremented with each write. When loading the state
+ * from the storage we iterate over the buckets and take the one with valid
+ * crcs and the newest generation, which is the highest one unless the counter
+ * wrapped around. The next step is to restore consistency
+ * between the different buckets. This means rewriting a bucket when it
+ * signalled it needs refresh (i.e. returned -EUCLEAN) or when contains data
+ * different from the bucket we use.
+ *
+ * Storage written by older versions or by barebox carries no generation. For
+ * these the first valid bucket in list order is the newest one, as the
+ * buckets were always written in order. This rule is kept whenever the first
+ * valid bucket has no generation, so data written by a writer not aware of
+ * generations is never shadowed by an older copy which has one.
  *
  * When the state backend initialized successfully we already restored
- * consistency which means all buckets contain the same data. This means
- * when storing a new state we can just write all buckets in order.
+ * consistency which means all buckets contain the same data. As the reader
+ * does not depend on the order of the buckets anymore, all buckets but the
+ * last one are written together and made durable with a single flush. The
+ * last bucket keeps the previous data until then, so there is a valid copy
+ * on the storage even if writing is interrupted.
+ *
+ * The rotating storage type uses all eraseblocks of a mtd device as buckets,
+ * but only writes desired_buckets copies each time the state is stored.
+ * Buckets which have enough free space to append the data are used first.
+ * Otherwise the buckets with the lowest erase count are erased, sparing those
+ * holding the current data. The reader does not rewrite all buckets, it only
+ * restores the number of copies of the current data. As barebox does not know
+ * about this storage type, the first-wins rule for data without generation is
+ * not applied.
+ *
+ * With the delta log enabled, only the changes to the data written last are
+ * appended to the buckets holding it, as a record of (offset, length, bytes)
+ * chunks. Each record names the generation it is based on, so it is only
+ * replayed on top of the data it was created from. When a bucket has no room
+ * left for a record, the complete data is written to it instead, which also
+ * discards its log.
+ *
+ * barebox does not know the delta log. It ignores the records behind the data
+ * of direct buckets and so uses outdated data. In circular buckets it takes
+ * the last record for data in the old format without metadata and may fall
+ * back to even older data. The delta log is therefore only enabled if the
+ * devicetree states with backend-barebox-incompatible that barebox does not
+ * use the state.
  */
 
 static const unsigned int min_buckets_written = 1;
 
+/*
+ * Generations are compared with serial number arithmetic, a generation which
+ * wrapped around is still newer than the ones before. 0 is skipped, it marks
+ * data without generation.
+ */
+static bool generation_after(uint32_t a, uint32_t b)
+{
+	return (int32_t)(a - b) > 0;
+}
+
+static uint32_t generation_next(uint32_t generation)
+{
+	return ++generation ? generation : 1;
+}
+
+/* Number of buckets that should be used */
+static const int desired_buckets = 3;
+
+static int bucket_flush(struct state_backend_storage *storage,
+			struct state_backend_storage_bucket *bucket)
+{
+	int ret = 0;
+
+	bucket->unflushed = false;
+
+	if (bucket->flush)
+		ret = bucket->flush(bucket);
+	if (ret)
+		dev_warn(storage->dev, "Failed to flush state backend bucket %d, %d\n",
+			 bucket->num, ret);
+
+	return ret;
+}
+
+static const uint32_t delta_magic = 0x746c6544;
+
+struct __attribute__((__packed__)) state_delta_chunk {
+	uint32_t offset;
+	uint32_t len;
+};
+
+static uint32_t state_delta_crc(const struct state_delta_header *header,
+				const void *payload)
+{
+	uint32_t crc;
+
+	crc = crc32(0, header, offsetof(struct state_delta_header, crc));
+
+	return crc32(crc, payload, header->len);
+}
+
+/*
+ * Creates a delta log record with the changes from the data stored in the
+ * buckets to @buf. Changes closer to each other than the size of a chunk
+ * header are merged into a single chunk. Returns NULL if the record would not
+ * be considerably smaller than the data itself.
+ */
+static void *state_delta_create(struct state_backend_storage *storage,
+				const void *buf, ssize_t len,
+				uint32_t generation, ssize_t *record_len)
+{
+	const uint8_t *old = storage->data, *new = buf;
+	struct state_delta_header *header;
+	struct state_delta_chunk *chunk;
+	ssize_t max_len = len / 2;
+	ssize_t pos = 0, start, end, i;
+	void *record, *payload;
+
+	record = xmalloc(sizeof(*header) + max_len);
+	header = record;
+	payload = record + sizeof(*header);
+
+	for (i = 0; i < len; i++) {
+		if (old[i] == new[i])
+			continue;
+
+		start = i;
+		end = i + 1;
+		for (i = end; i < len && i - end < sizeof(*chunk); i++) {
+			if (old[i] != new[i])
+				end = i + 1;
+		}
+
+		if (pos + sizeof(*chunk) + (end - start) > max_len) {
+			free(record);
+			return NULL;
+		}
+
+		chunk = payload + pos;
+		chunk->offset = start;
+		chunk->len = end - start;
+		pos += sizeof(*chunk);
+		memcpy(payload + pos, new + start, end - start);
+		pos += end - start;
+
+		i = end;
+	}
+
+	header->magic = delta_magic;
+	header->generation = generation;
+	header->base_generation = storage->generation;
+	header->len = pos;
+	header->crc = state_delta_crc(header, payload);
+
+	*record_len = sizeof(*header) + pos;
+
+	return record;
+}
+
+/**
+ * state_delta_record_len - Get the length of a delta log record
+ * @param header Header of the record
+ * @return The length of the record including the header, -EINVAL if this is
+ * not a delta log record
+ */
+ssize_t state_delta_record_len(const struct state_delta_header *header)
+{
+	if (header->magic != delta_magic)
+		return -EINVAL;
+
+	return sizeof(*header) + (ssize_t)header->len;
+}
+
+/**
+ * state_delta_apply - Replays a delta log record
+ * @param buf Data the record is applied to
+ * @param len Length of the data
+ * @param record The delta log record
+ * @param record_len Maximum length of the record
+ * @param generation Generation of the data, updated to the generation of the
+ * record on success
+ * @return The length of the record on success, -errno otherwise
+ *
+ * The record is only applied if it is valid and based on @generation. @buf is
+ * left untouched otherwise.
+ */
+ssize_t state_delta_apply(void *buf, ssize_t len, const void *record,
+			  ssize_t record_len, uint32_t *generation)
+{
+	const struct state_delta_header *header = record;
+	const struct state_delta_chunk *chunk;
+	const void *payload = record + sizeof(*header);
+	ssize_t rlen, pos;
+
+	if (record_len < sizeof(*header))
+		return -EINVAL;
+
+	rlen = state_delta_record_len(header);
+	if (rlen < 0 || rlen > record_len)
+		return -EINVAL;
+
+	if (!*generation || header->base_generation != *generation)
+		return -EINVAL;
+
+	if (header->crc != state_delta_crc(header, payload))
+		return -EBADMSG;
+
+	for (pos = 0; pos < header->len; pos += sizeof(*chunk) + chunk->len) {
+		chunk = payload + pos;
+		if (header->len - pos < sizeof(*chunk) ||
+		    header->len - pos - sizeof(*chunk) < chunk->len ||
+		    (uint64_t)chunk->offset + chunk->len > len)
+			return -EINVAL;
+	}
+
+	for (pos = 0; pos < header->len; pos += sizeof(*chunk) + chunk->len) {
+		chunk = payload + pos;
+		memcpy(buf + chunk->offset, payload + pos + sizeof(*chunk),
+		       chunk->len);
+	}
+
+	*generation = header->generation;
+
+	return rlen;
+}
+
+/* Returns the number of buckets successfully flushed */
+static int storage_flush_buckets(struct state_backend_storage *storage,
+				 struct state_backend_storage_bucket **buckets,
+				 int n_buckets)
+{
+	int flushed = 0;
+	int i;
+
+	for (i = 0; i < n_buckets; i++) {
+		if (buckets[i]->unflushed && !bucket_flush(storage, buckets[i]))
+			++flushed;
+	}
+
+	return flushed;
+}
+
+/*
+ * Writes the delta log record to the bucket if it holds the data the record is
+ * based on, the data itself otherwise.
+ */
+static int bucket_write(struct state_backend_storage *storage,
+			struct state_backend_storage_bucket *bucket,
+			const void *buf, ssize_t len, const void *record,
+			ssize_t record_len, uint32_t generation)
+{
+	bool has_base = bucket->generation &&
+			bucket->generation == storage->generation;
+	int ret;
+
+	bucket->generation = generation;
+
+	if (record && has_base && bucket->write_delta) {
+		ret = bucket->write_delta(bucket, record, record_len);
+		if (!ret)
+			return 0;
+
+		dev_dbg(storage->dev, "Writing complete data to bucket %d, %d\n",
+			bucket->num, ret);
+	}
+
+	return bucket->write(bucket, buf, len);
+}
+
+/*
+ * Writes the data to the given buckets. The writes to all but the last bucket
+ * are flushed together, the last bucket is written afterwards. Returns the
+ * number of buckets successfully written.
+ */
+static int storage_write_buckets(struct state_backend_storage *storage,
+				 struct state_backend_storage_bucket **buckets,
+				 int n_buckets, const void *buf, ssize_t len,
+				 const void *record, ssize_t record_len,
+				 uint32_t generation)
+{
+	int buckets_written = 0;
+	int i, ret;
+
+	for (i = 0; i < n_buckets; i++) {
+		/* Make all previous writes durable before writing the last bucket */
+		if (i == n_buckets - 1)
+			buckets_written += storage_flush_buckets(storage, buckets, i);
+
+		ret = bucket_write(storage, buckets[i], buf, len, record,
+				   record_len, generation);
+		if (ret < 0) {
+			dev_warn(storage->dev, "Failed to write state backend bucket, %d\n",
+				 ret);
+			buckets[i]->generation = 0;
+			continue;
+		}
+
+		buckets[i]->unflushed = true;
+	}
+
+	if (n_buckets)
+		buckets_written += storage_flush_buckets(storage,
+							 &buckets[n_buckets - 1], 1);
+
+	return buckets_written;
+}
+
+struct rotating_candidate {
+	struct state_backend_storage_bucket *bucket;
+	int cost;
+};
+
+static int rotating_candidate_cmp(const void *a, const void *b)
+{
+	const struct rotating_candidate *ca = a, *cb = b;
+
+	if (ca->cost != cb->cost)
+		return ca->cost - cb->cost;
+	if (ca->bucket->erase_count != cb->bucket->erase_count)
+		return ca->bucket->erase_count < cb->bucket->erase_count ? -1 : 1;
+
+	return ca->bucket->num - cb->bucket->num;
+}
+
+/*
+ * Selects the buckets for the next copies of the rotating storage. Buckets
+ * which can be appended to come first, then buckets which need an erase,
+ * least worn first. Buckets holding the current data are only erased if there
+ * are not enough other buckets. Buckets which already contain a valid copy of
+ * @generation are not selected at all.
+ */
+static int storage_rotating_select(struct state_backend_storage *storage,
+				   ssize_t len, uint32_t generation, int copies,
+				   struct state_backend_storage_bucket **buckets)
+{
+	struct state_backend_storage_bucket *bucket;
+	struct rotating_candidate *candidates;
+	int n = 0, i;
+
+	list_for_each_entry(bucket, &storage->buckets, bucket_list)
+		n++;
+
+	candidates = xzalloc(n * sizeof(*candidates));
+
+	n = 0;
+	list_for_each_entry(bucket, &storage->buckets, bucket_list) {
+		if (bucket->generation == generation && !bucket->needs_refresh)
+			continue;
+
+		candidates[n].bucket = bucket;
+		if (bucket->needs_erase && bucket->needs_erase(bucket, len)) {
+			if (bucket->generation &&
+			    bucket->generation == storage->generation)
+				candidates[n].cost = 2;
+			else
+				candidates[n].cost = 1;
+		}
+		n++;
+	}
+
+	qsort(candidates, n, sizeof(*candidates), rotating_candidate_cmp);
+
+	n = min(n, copies);
+	for (i = 0; i < n; i++)
+		buckets[i] = candidates[i].bucket;
+
+	free(candidates);
+
+	return n;
+}
+
 /**
  * state_storage_write - Writes the given data to the storage
  * @param storage Storage object
@@ -58,9 +415,11 @@ static const unsigned int min_buckets_written = 1;
  * @return 0 on success, -errno otherwise
  *
  * This function iterates over all registered buckets and executes a write
- * operation on all of them. Writes are always in the same sequence. This
- * ensures, that reading in the same sequence will always return the latest
- * written valid data first.
+ * operation on all of them, tagging the data with a new generation. The writes
+ * to all but the last bucket are issued first and flushed together, the last
+ * bucket is only written afterwards. The rotating storage only writes to
+ * desired_buckets selected buckets. With the delta log enabled, only the
+ * changes are written where possible.
  * We try to at least write min_buckets_written. If this fails we return with an
  * error.
  */
@@ -68,22 +427,56 @@ int state_storage_write(struct state_backend_storage *storage,
 		        const void * buf, ssize_t len)
 {
 	struct state_backend_storage_bucket *bucket;
-	int ret;
-	int buckets_written = 0;
+	struct state_backend_storage_bucket **buckets;
+	uint32_t generation = generation_next(storage->generation);
+	ssize_t record_len = 0;
+	void *record = NULL;
+	int buckets_written;
+	int n_buckets = 0;
 
 	if (storage->readonly)
 		return 0;
 
-	list_for_each_entry(bucket, &storage->buckets, bucket_list) {
-		ret = bucket->write(bucket, buf, len);
-		if (ret < 0) {
-			dev_warn(storage->dev, "Failed to write state backend bucket, %d\n",
-				 ret);
-		} else {
-			++buckets_written;
+	if (storage->delta_log && storage->data && storage->data_len == len &&
+	    storage->generation) {
+		record = state_delta_create(storage, buf, len, generation,
+					    &record_len);
+		if (record && record_len == sizeof(struct state_delta_header)) {
+			dev_dbg(storage->dev, "Data unchanged, nothing to write\n");
+			free(record);
+			return 0;
 		}
 	}
 
+	list_for_each_entry(bucket, &storage->buckets, bucket_list)
+		n_buckets++;
+
+	buckets = xzalloc(n_buckets * sizeof(*buckets));
+
+	if (storage->rotating) {
+		n_buckets = storage_rotating_select(storage, len, generation,
+						    desired_buckets, buckets);
+	} else {
+		n_buckets = 0;
+		list_for_each_entry(bucket, &storage->buckets, bucket_list)
+			buckets[n_buckets++] = bucket;
+	}
+
+	buckets_written = storage_write_buckets(storage, buckets, n_buckets,
+						buf, len, record, record_len,
+						generation);
+	free(buckets);
+	free(record);
+
+	storage->generation = generation;
+	storage->written_len = len;
+
+	if (storage->delta_log) {
+		free(storage->data);
+		storage->data = xmemdup(buf, len);
+		storage->data_len = len;
+	}
+
 	if (buckets_written >= min_buckets_written)
 		return 0;
 
@@ -92,8 +485,156 @@ int state_storage_write(struct state_backend_storage *storage,
 	return -EIO;
 }
 
+/*
+ * Restores the number of copies of the data in @bucket_used on the rotating
+ * storage. Data without generation is rewritten with a new generation.
+ */
+static int storage_rotating_refresh(struct state_backend_storage *storage,
+				    struct state_backend_storage_bucket *bucket_used)
+{
+	struct state_backend_storage_bucket *bucket;
+	struct state_backend_storage_bucket **buckets;
+	uint32_t generation = bucket_used->generation;
+	int copies = 0, n_buckets = 0;
+	int written;
+
+	list_for_each_entry(bucket, &storage->buckets, bucket_list) {
+		n_buckets++;
+		if (generation && bucket->generation == generation &&
+		    !bucket->needs_refresh)
+			copies++;
+	}
+
+	if (copies >= min(n_buckets, desired_buckets))
+		return 0;
+
+	if (!generation)
+		generation = storage->generation =
+			generation_next(storage->generation);
+
+	buckets = xzalloc(desired_buckets * sizeof(*buckets));
+	n_buckets = storage_rotating_select(storage, bucket_used->len, generation,
+					    desired_buckets - copies, buckets);
+	written = storage_write_buckets(storage, buckets, n_buckets,
+					bucket_used->buf, bucket_used->len,
+					NULL, 0, generation);
+	free(buckets);
+
+	dev_info(storage->dev, "restored %d of %d missing copies\n", written,
+		 n_buckets);
+
+	return written == n_buckets ? 0 : -EIO;
+}
+
+/**
+ * state_storage_pre_erase - Erases the buckets used by the next write
+ * @param storage Storage object
+ * @return 0 on success, -errno otherwise
+ *
+ * Erasing is slow on some flashes. If enabled, this erases the buckets the
+ * next write of the rotating storage would otherwise have to erase, assuming
+ * the data has the same size as the last written data. Buckets holding the
+ * current data are never erased.
+ */
+int state_storage_pre_erase(struct state_backend_storage *storage)
+{
+	struct state_backend_storage_bucket **buckets;
+	ssize_t len = storage->written_len;
+	int n_buckets, i;
+	int ret = 0;
+
+	if (!storage->pre_erase || storage->readonly || !len)
+		return 0;
+
+	buckets = xzalloc(desired_buckets * sizeof(*buckets));
+	n_buckets = storage_rotating_select(storage, len,
+					    generation_next(storage->generation),
+					    desired_buckets, buckets);
+
+	for (i = 0; i < n_buckets; i++) {
+		struct state_backend_storage_bucket *bucket = buckets[i];
+		int err;
+
+		if (!bucket->erase || !bucket->needs_erase(bucket, len))
+			continue;
+
+		if (bucket->generation &&
+		    bucket->generation == storage->generation)
+			continue;
+
+		err = bucket->erase(bucket);
+		if (err) {
+			dev_warn(storage->dev, "Failed to pre-erase bucket %d, %d\n",
+				 bucket->num, err);
+			ret = err;
+			continue;
+		}
+
+		bucket->generation = 0;
+		dev_dbg(storage->dev, "Pre-erased bucket %d, erase count %u\n",
+			bucket->num, bucket->erase_count);
+	}
+
+	free(buckets);
+
+	return ret;
+}
+
+/**
+ * state_storage_probe - Checks whether the stored data changed
+ * @param storage Storage object
+ * @return 1 if the data changed since it was last read, 0 if not, -errno
+ * otherwise
+ *
+ * This is meant for long running readers which want to notice writes of other
+ * processes. It only reads the few bytes of each bucket which any write
+ * touches. A following state_storage_read() returns the new data. Buckets
+ * which cannot be probed are always reported as changed.
+ */
+int state_storage_probe(struct state_backend_storage *storage)
+{
+	struct state_backend_storage_bucket *bucket;
+	int changed = 0;
+	int ret;
+
+	/* Probe all buckets so that all of them drop what they cached */
+	list_for_each_entry(bucket, &storage->buckets, bucket_list) {
+		if (!bucket->probe) {
+			changed = 1;
+			continue;
+		}
+
+		ret = bucket->probe(bucket);
+		if (ret < 0) {
+			dev_err(storage->dev, "Failed to probe bucket %d, %d\n",
+				bucket->num, ret);
+			return ret;
+		}
+
+		changed |= ret;
+	}
+
+	return changed;
+}
+
+/*
+ * Other processes may have written the storage since the buckets were last
+ * read. Probing makes the buckets drop what they cached in that case. Errors
+ * are left to the following read.
+ */
+static void storage_probe_buckets(struct state_backend_storage *storage)
+{
+	struct state_backend_storage_bucket *bucket;
+
+	list_for_each_entry(bucket, &storage->buckets, bucket_list) {
+		if (bucket->probe)
+			bucket->probe(bucket);
+	}
+}
+
 static int bucket_refresh(struct state_backend_storage *storage,
-			  struct state_backend_storage_bucket *bucket, void *buf, ssize_t len)
+			  struct state_backend_storage_bucket *bucket, void *buf,
+			  ssize_t len, uint32_t generation)
 {
 	int ret;
 
@@ -109,7 +650,10 @@ static int bucket_refresh(struct state_backend_storage *storage,
 	return 0;
 
 refresh:
+	bucket->generation = generation;
 	ret = bucket->write(bucket, buf, len);
+	if (!ret)
+		ret = bucket_flush(storage, bucket);
 
 	if (ret) {
 		dev_warn(storage->dev, "Failed to restore bucket %d@0x%08llx\n",
@@ -123,6 +667,82 @@ refresh:
 	return ret;
 }
 
+/*
+ * Reads the bucket and verifies its data against the format. Returns 0 if the
+ * bucket holds valid data, -errno otherwise.
+ */
+static int bucket_read_verify(struct state_backend_storage *storage,
+			      struct state_backend_storage_bucket *bucket,
+			      struct state_backend_format *format,
+			      uint32_t magic, enum state_flags flags)
+{
+	int ret;
+
+	ret = bucket->read(bucket, &bucket->buf, &bucket->len);
+	if (ret == -EUCLEAN) {
+		bucket->needs_refresh = 1;
+	} else if (ret) {
+		bucket->generation = 0;
+		return ret;
+	}
+
+	/*
+	 * Verify the buffer crcs. The buffer length is passed in the len argument,
+	 * .verify overwrites it with the length actually used.
+	 */
+	ret = format->verify(format, magic, bucket->buf, &bucket->len, flags);
+	if (ret) {
+		dev_info(storage->dev, "Ignoring broken bucket %d@0x%08llx...\n", bucket->num, (long long) bucket->offset);
+		bucket->generation = 0;
+		return ret;
+	}
+
+	dev_dbg(storage->dev, "Bucket %d@0x%08llx has generation %u\n",
+		bucket->num, (long long) bucket->offset, bucket->generation);
+
+	if (bucket->generation &&
+	    (!storage->generation ||
+	     generation_after(bucket->generation, storage->generation)))
+		storage->generation = bucket->generation;
+
+	return 0;
+}
+
+/*
+ * Returns true if the valid @bucket should be used instead of @bucket_used.
+ * Buckets without a generation are used in list order.
+ */
+static bool bucket_is_newer(struct state_backend_storage *storage,
+			    struct state_backend_storage_bucket *bucket_used,
+			    struct state_backend_storage_bucket *bucket)
+{
+	if (!bucket_used)
+		return true;
+
+	if (!bucket->generation)
+		return false;
+
+	if (!bucket_used->generation)
+		return storage->rotating;
+
+	return generation_after(bucket->generation, bucket_used->generation);
+}
+
+static void storage_free_bucket_bufs(struct state_backend_storage *storage,
+				     struct state_backend_storage_bucket *keep)
+{
+	struct state_backend_storage_bucket *bucket;
+
+	list_for_each_entry(bucket, &storage->buckets, bucket_list) {
+		if (bucket == keep)
+			continue;
+
+		free(bucket->buf);
+		bucket->buf = NULL;
+		bucket->len = 0;
+	}
+}
+
 /**
  * state_storage_read - Reads valid data from the backend storage
  * @param storage Storage object
@@ -135,9 +755,17 @@ refresh:
  * values on success.
  *
  * This function goes through all buckets and tries to read valid data from
- * them. The first bucket which returns data that is successfully verified
- * against the data format is used. To ensure the validity of all bucket copies,
- * we restore the consistency at the end.
+ * them. Of the buckets which return data that is successfully verified against
+ * the data format, the one with the highest generation is used. To ensure the
+ * validity of all bucket copies, we restore the consistency at the end.
+ * Cached data is only used if probing shows that nobody wrote the bucket
+ * since.
+ *
+ * A readonly storage cannot restore anything. It stops at the first valid
+ * bucket if that one carries no generation, as such data is used in list
+ * order anyway. Otherwise all buckets are read, as an interrupted write may
+ * have left the newest generation in any of them. Use
+ * state_storage_check() to find out about broken or outdated buckets.
  */
 int state_storage_read(struct state_backend_storage *storage,
 		       struct state_backend_format *format,
@@ -147,27 +775,25 @@ int state_storage_read(struct state_backend_storage *storage,
 	struct state_backend_storage_bucket *bucket, *bucket_used = NULL;
 	int ret;
 
+	storage_probe_buckets(storage);
+
 	dev_dbg(storage->dev, "Checking redundant buckets...\n");
 	/*
-	 * Iterate over all buckets. The first valid one we find is the
-	 * one we want to use.
+	 * Iterate over all buckets. The valid one with the highest generation
+	 * is the one we want to use.
 	 */
 	list_for_each_entry(bucket, &storage->buckets, bucket_list) {
-		ret = bucket->read(bucket, &bucket->buf, &bucket->len);
-		if (ret == -EUCLEAN)
-			bucket->needs_refresh = 1;
-		else if (ret)
+		ret = bucket_read_verify(storage, bucket, format, magic, flags);
+		if (ret)
 			continue;
 
-		/*
-		 * Verify the buffer crcs. The buffer length is passed in the len argument,
-		 * .verify overwrites it with the length actually used.
-		 */
-		ret = format->verify(format, magic, bucket->buf, &bucket->len, flags);
-		if (!ret && !bucket_used)
+		if (bucket_is_newer(storage, bucket_used, bucket))
 			bucket_used = bucket;
-		if (ret)
-			dev_info(storage->dev, "Ignoring broken bucket %d@0x%08llx...\n", bucket->num, (long long) bucket->offset);
+
+		/* Data without generation is not replaced by later buckets */
+		if (storage->readonly && !bucket_used->generation &&
+		    !storage->rotating)
+			break;
 	}
 
 	dev_dbg(storage->dev, "Checking redundant buckets finished.\n");
@@ -180,6 +806,20 @@ int state_storage_read(struct state_backend_storage *storage,
 
 	dev_info(storage->dev, "Using bucket %d@0x%08llx\n", bucket_used->num, (long long) bucket_used->offset);
 
+	if (storage->delta_log) {
+		free(storage->data);
+		storage->data = xmemdup(bucket_used->buf, bucket_used->len);
+		storage->data_len = bucket_used->len;
+	}
+
+	if (storage->readonly)
+		goto out;
+
+	if (storage->rotating) {
+		ret = storage_rotating_refresh(storage, bucket_used);
+		goto out;
+	}
+
 	/*
 	 * Restore/refresh all buckets except the one we currently use (in case
 	 * it's the only usable bucket at the moment)
@@ -188,18 +828,19 @@ int state_storage_read(struct state_backend_storage *storage,
 		if (bucket == bucket_used)
 			continue;
 
-		ret = bucket_refresh(storage, bucket, bucket_used->buf, bucket_used->len);
-
-		/* Free buffer from the unused buckets */
-		free(bucket->buf);
-		bucket->buf = NULL;
-		bucket->len = 0;
+		ret = bucket_refresh(storage, bucket, bucket_used->buf,
+				     bucket_used->len, bucket_used->generation);
 	}
 
 	/*
 	 * Restore/refresh the bucket we currently use
 	 */
-	ret = bucket_refresh(storage, bucket_used, bucket_used->buf, bucket_used->len);
+	ret = bucket_refresh(storage, bucket_used, bucket_used->buf,
+			     bucket_used->len, bucket_used->generation);
+
+out:
+	/* Free buffer from the unused buckets */
+	storage_free_bucket_bufs(storage, bucket_used);
 
 	*buf = bucket_used->buf;
 	*len = bucket_used->len;
@@ -211,6 +852,91 @@ int state_storage_read(struct state_backend_storage *storage,
 	return 0;
 }
 
+/**
+ * state_storage_check - Checks the redundancy of the backend storage
+ * @param storage Storage object
+ * @param format Format of the data that is stored
+ * @param magic state magic value
+ * @param flags flags controlling how to load state
+ * @return 0 if desired_buckets buckets hold valid copies of the current data,
+ * -EUCLEAN if the redundancy is degraded, -errno otherwise
+ *
+ * Unlike state_storage_read() this always reads and verifies all buckets and
+ * reports the broken and outdated ones. Nothing is restored.
+ */
+int state_storage_check(struct state_backend_storage *storage,
+			struct state_backend_format *format,
+			uint32_t magic, enum state_flags flags)
+{
+	struct state_backend_storage_bucket *bucket, *bucket_used = NULL;
+	int n_good = 0;
+	int ret;
+
+	storage_probe_buckets(storage);
+
+	list_for_each_entry(bucket, &storage->buckets, bucket_list) {
+		bucket->needs_refresh = 0;
+		ret = bucket_read_verify(storage, bucket, format, magic, flags);
+		if (ret) {
+			/* The rotating storage has lots of erased buckets */
+			if (storage->rotating)
+				dev_dbg(storage->dev, "Bucket %d@0x%08llx is empty or broken, %d\n",
+					bucket->num, (long long) bucket->offset, ret);
+			else
+				dev_warn(storage->dev, "Bucket %d@0x%08llx is broken, %d\n",
+					 bucket->num, (long long) bucket->offset, ret);
+			free(bucket->buf);
+			bucket->buf = NULL;
+			continue;
+		}
+
+		if (bucket_is_newer(storage, bucket_used, bucket))
+			bucket_used = bucket;
+	}
+
+	if (!bucket_used) {
+		dev_err(storage->dev, "Failed to find any valid state copy in any bucket\n");
+		ret = -ENOENT;
+		goto out;
+	}
+
+	list_for_each_entry(bucket, &storage->buckets, bucket_list) {
+		if (!bucket->buf)
+			continue;
+
+		if (bucket->generation != bucket_used->generation ||
+		    bucket->len != bucket_used->len ||
+		    memcmp(bucket->buf, bucket_used->buf, bucket->len)) {
+			/* Outdated copies of the rotating storage are expected */
+			if (!storage->rotating)
+				dev_warn(storage->dev, "Bucket %d@0x%08llx is outdated\n",
+					 bucket->num, (long long) bucket->offset);
+			continue;
+		}
+
+		if (bucket->needs_refresh) {
+			dev_warn(storage->dev, "Bucket %d@0x%08llx needs to be refreshed\n",
+				 bucket->num, (long long) bucket->offset);
+			continue;
+		}
+
+		n_good++;
+	}
+
+	if (n_good < desired_buckets) {
+		dev_warn(storage->dev, "Redundancy degraded, only %d of %d copies are valid\n",
+			 n_good, desired_buckets);
+		ret = -EUCLEAN;
+	} else {
+		ret = 0;
+	}
+
+out:
+	storage_free_bucket_bufs(storage, NULL);
+
+	return ret;
+}
+
 static int mtd_get_meminfo(const char *path, struct mtd_info_user *meminfo)
 {
 	int fd, ret;
@@ -228,9 +954,6 @@ static int mtd_get_meminfo(const char *path, struct mtd_info_user *meminfo)
 	return ret;
 }
 
-/* Number of buckets that should be used */
-static const int desired_buckets = 3;
-
 /**
  * state_storage_mtd_buckets_init - Creates storage buckets for mtd devices
  * @param storage Storage object
@@ -240,7 +963,8 @@ static const int desired_buckets = 3;
  *
  * This function iterates over the eraseblocks and creates one bucket on
  * each eraseblock until we have the number of desired buckets. Bad blocks
- * will be skipped and the next block will be used.
+ * will be skipped and the next block will be used. The rotating storage
+ * creates a bucket on every good eraseblock.
  */
 static int state_storage_mtd_buckets_init(struct state_backend_storage *storage,
 					  struct mtd_info_user *meminfo, bool circular)
@@ -273,16 +997,24 @@ static int state_storage_mtd_buckets_init(struct state_backend_storage *storage,
 							   &bucket,
 							   eraseblock,
 							   writesize,
-							   meminfo);
+							   meminfo,
+							   storage->rotating);
 		if (ret)
 			continue;
 
+		ret = state_backend_bucket_cached_create(storage->dev, bucket,
+							 &bucket);
+		if (ret) {
+			bucket->free(bucket);
+			continue;
+		}
+
 		bucket->offset = offset;
 		bucket->num = n_buckets;
 
 		list_add_tail(&bucket->bucket_list, &storage->buckets);
 		++n_buckets;
-		if (n_buckets >= desired_buckets)
+		if (!storage->rotating && n_buckets >= desired_buckets)
 			return 0;
 	}
 
@@ -291,6 +1023,9 @@ static int state_storage_mtd_buckets_init(struct state_backend_storage *storage,
 		return -EIO;
 	}
 
+	if (storage->rotating && n_buckets >= desired_buckets)
+		return 0;
+
 	dev_warn(storage->dev, "Failed to initialize desired amount of buckets, only %d of %d succeeded\n",
 		 n_buckets, desired_buckets);
 	return 0;
@@ -327,13 +1062,21 @@ static int state_storage_file_buckets_init(struct state_backend_storage *storage
 		offset = storage->offset + n * stridesize;
 		ret = state_backend_bucket_direct_create(storage->dev, storage->path,
 							 &bucket, offset,
-							 stridesize, storage->readonly);
+							 stridesize, storage->pagesize,
+							 storage->readonly);
 		if (ret) {
 			dev_warn(storage->dev, "Failed to create direct bucket at '%s' offset %lld\n",
 				 storage->path, (long long) offset);
 			continue;
 		}
 
+		ret = state_backend_bucket_cached_create(storage->dev, bucket,
+							 &bucket);
+		if (ret) {
+			bucket->free(bucket);
+			continue;
+		}
+
 		bucket->offset = offset;
 		bucket->num = n_buckets;
 
@@ -360,16 +1103,19 @@ static int state_storage_file_buckets_init(struct state_backend_storage *storage
  * @param dev_offset Offset in the device to start writing at.
  * @param max_size Maximum size of the data. May be 0 for infinite.
  * @param stridesize Distance between two copies of the data. Not relevant for MTD
+ * @param pagesize Write granularity of the device. May be 0 if unknown.
  * @param storagetype Type of the storage backend. May be NULL for autoselection.
  * @return 0 on success, -errno otherwise
  *
  * If the backend memory needs to be erased prior a write, the @b storagetype
  * defaults to 'circular' storage backend type, for backend memories like RAMs
  * or EEPROMs @b storagetype defaults to the 'direct' storage backend type.
+ * The 'rotating' storage backend type spreads the copies over all eraseblocks
+ * of the backend memory.
  */
 int state_storage_init(struct state *state, const char *path,
 		       off_t offset, size_t max_size, uint32_t stridesize,
-		       const char *storagetype)
+		       uint32_t pagesize, const char *storagetype)
 {
 	struct state_backend_storage *storage = &state->storage;
 	int ret = -ENODEV;
@@ -379,6 +1125,7 @@ int state_storage_init(struct state *state, const char *path,
 	storage->dev = &state->dev;
 	storage->name = storagetype;
 	storage->stridesize = stridesize;
+	storage->pagesize = pagesize;
 	storage->offset = offset;
 	storage->max_size = max_size;
 	storage->path = xstrdup(path);
@@ -391,6 +1138,11 @@ int state_storage_init(struct state *state, const char *path,
 		if (!storagetype || !strcmp(storagetype, "circular")) {
 			storage->name = "circular";
 			circular = true;
+		} else if (!strcmp(storagetype, "rotating")) {
+			/* Uses circular buckets, spread over the whole device */
+			storage->name = "circular";
+			storage->rotating = true;
+			circular = true;
 		} else if (!strcmp(storagetype, "noncircular")) {
 			dev_warn(storage->dev, "using old format circular storage type.\n");
 			circular = false;
@@ -409,6 +1161,26 @@ void state_storage_set_readonly(struct state_backend_storage *storage)
 	storage->readonly = true;
 }
 
+void state_storage_set_pre_erase(struct state_backend_storage *storage)
+{
+	if (!storage->rotating) {
+		dev_warn(storage->dev, "pre-erase is only supported by the rotating storage type\n");
+		return;
+	}
+
+	storage->pre_erase = true;
+}
+
+void state_storage_set_delta_log(struct state_backend_storage *storage)
+{
+	if (storage->rotating) {
+		dev_warn(storage->dev, "delta log is not supported by the rotating storage type\n");
+		return;
+	}
+
+	storage->delta_log = true;
+}
+
 /**
  * state_storage_free - Free backend storage
  * @param storage Storage object
@@ -427,5 +1199,6 @@ void state_storage_free(struct state_backend_storage *storage)
 		bucket->free(bucket);
 	}
 
+	free(storage->data);
 	free(storage->path);
 }
@@ -30,11 +30,45 @@
 #include <state.h>
 #include <libbb.h>
 
+#ifndef __BAREBOX__
+#include <pthread.h>
+#endif
+
 #include "state.h"
 
 /* list of all registered state instances */
 static LIST_HEAD(state_list);
 
+#ifndef __BAREBOX__
+/*
+ * Neither libudev nor the keystore are thread safe, so states created and
+ * loaded in parallel threads use them one after another. Recursive, as the
+ * keystore may create a state itself.
+ */
+static pthread_mutex_t state_setup_mutex = PTHREAD_RECURSIVE_MUTEX_INITIALIZER_NP;
+#endif
+
+void state_setup_lock(void)
+{
+#ifndef __BAREBOX__
+	pthread_mutex_lock(&state_setup_mutex);
+#endif
+}
+
+void state_setup_unlock(void)
+{
+#ifndef __BAREBOX__
+	pthread_mutex_unlock(&state_setup_mutex);
+#endif
+}
+
+static void state_drop_image(struct state *state)
+{
+	free(state->image);
+	state->image = NULL;
+	state->image_len = 0;
+}
+
 /**
  * Save the state
  * @param state
@@ -51,7 +85,15 @@ int state_save(struct state *state)
 	if (!state->dirty)
 		return 0;
 
+	buf = state->image;
+	len = state->image_len;
+
 	ret = state->format->pack(state->format, state, &buf, &len);
+	if (buf != state->image) {
+		state_drop_image(state);
+		state->image = buf;
+		state->image_len = len;
+	}
 	if (ret) {
 		dev_err(&state->dev, "Failed to pack state with backend format %s, %d\n",
 			state->format->name, ret);
@@ -79,10 +121,19 @@ int state_save(struct state *state)
 	state->dirty = 0;
 
 out:
-	free(buf);
 	return ret;
 }
 
+/**
+ * Erase the storage used by the next save in advance
+ * @param state
+ * @return 0 on success or if pre-erasing is not enabled, -errno otherwise
+ */
+int state_pre_erase(struct state *state)
+{
+	return state_storage_pre_erase(&state->storage);
+}
+
 /**
  * state_do_load - Loads a state from the backend
  * @param state The state that should be updated to contain the loaded data
@@ -114,6 +165,12 @@ static int state_do_load(struct state *state, enum state_flags flags)
 		goto out;
 	}
 
+	/* Keep the buffer we read instead of packing the same data again */
+	state_drop_image(state);
+	state->image = buf;
+	state->image_len = len;
+	buf = NULL;
+
 	state->init_from_defaults = 0;
 out:
 	state->dirty = !!ret; /* mark dirty on error */
@@ -131,9 +188,32 @@ int state_load_no_auth(struct state *state)
 	return state_do_load(state, STATE_FLAG_NO_AUTHENTICATION);
 }
 
+static int state_do_check(struct state *state, enum state_flags flags)
+{
+	return state_storage_check(&state->storage, state->format,
+				   state->magic, flags);
+}
+
+/**
+ * state_check - Checks the redundancy of the stored state
+ * @param state The state to check
+ * @return 0 if all copies are valid and up to date, -EUCLEAN if the
+ * redundancy is degraded, -errno on failure
+ */
+int state_check(struct state *state)
+{
+	return state_do_check(state, 0);
+}
+
+int state_check_no_auth(struct state *state)
+{
+	return state_do_check(state, STATE_FLAG_NO_AUTHENTICATION);
+}
+
 static int state_format_init(struct state *state, const char *backend_format,
 			     struct device_node *node, const char *state_name)
 {
+	const char *compression = NULL;
 	int ret;
 
 	if (!backend_format || !strcmp(backend_format, "raw")) {
@@ -141,6 +221,9 @@ static int state_format_init(struct state *state, const char *backend_format,
 						state_name, &state->dev);
 	} else if (!strcmp(backend_format, "dtb")) {
 		ret = backend_format_dtb_create(&state->format, &state->dev);
+	} else if (!strcmp(backend_format, "tlv")) {
+		/* Only for states barebox does not access, it cannot read tlv */
+		ret = backend_format_tlv_create(&state->format, node, state);
 	} else {
 		dev_err(&state->dev, "Invalid backend format %s\n",
 			backend_format);
@@ -150,8 +233,22 @@ static int state_format_init(struct state *state, const char *backend_format,
 	if (ret && ret != -EPROBE_DEFER)
 		dev_err(&state->dev, "Failed to initialize format %s, %d\n",
 			backend_format, ret);
+	if (ret)
+		return ret;
 
-	return ret;
+	/* barebox does not know backend-compression, it cannot read the state */
+	of_property_read_string(node, "backend-compression", &compression);
+	if (!compression)
+		return 0;
+
+	/* The raw format checksums the data itself, it has to stay in front */
+	if (!strcmp(state->format->name, "raw")) {
+		dev_err(&state->dev, "backend-compression is not supported by the raw format\n");
+		return -EINVAL;
+	}
+
+	return backend_format_compressed_create(&state->format, compression,
+						&state->dev);
 }
 
 static void state_format_free(struct state_backend_format *format)
@@ -207,6 +304,33 @@ static struct state *state_new(const char *name)
 	return state;
 }
 
+/*
+ * Constructs the full name of a variable from its parent's name and the node
+ * name without a trailing @<ADDRESS>. Names of newly created variables are
+ * kept along with the state, others have to be freed by the caller.
+ */
+static char *state_var_name(struct state *state, const char *parent_name,
+			    const char *node_name, bool create)
+{
+	size_t parent_len = strlen(parent_name);
+	size_t len = strcspn(node_name, "@");
+	size_t size = parent_len + 1 + len + 1;
+	char *name, *p;
+
+	name = create ? state_alloc(state, size) : xmalloc(size);
+
+	p = name;
+	if (parent_len) {
+		memcpy(p, parent_name, parent_len);
+		p += parent_len;
+		*p++ = '.';
+	}
+	memcpy(p, node_name, len);
+	p[len] = 0;
+
+	return name;
+}
+
 static int state_convert_node_variable(struct state *state,
 				       struct device_node *node,
 				       struct device_node *parent,
@@ -218,20 +342,12 @@ static int state_convert_node_variable(struct state *state,
 	struct device_node *new_node = NULL;
 	struct state_variable *sv;
 	const char *type_name;
-	char *short_name, *name, *indexs;
+	bool create = conv == STATE_CONVERT_FROM_NODE_CREATE;
+	char *name;
 	unsigned int start_size[2];
 	int ret;
 
-	/* strip trailing @<ADDRESS> */
-	short_name = xstrdup(node->name);
-	indexs = strchr(short_name, '@');
-	if (indexs)
-		*indexs = 0;
-
-	/* construct full name */
-	name = basprintf("%s%s%s", parent_name, parent_name[0] ? "." : "",
-			 short_name);
-	free(short_name);
+	name = state_var_name(state, parent_name, node->name, create);
 
 	if ((conv == STATE_CONVERT_TO_NODE) || (conv == STATE_CONVERT_FIXUP))
 		new_node = of_new_node(parent, node->name);
@@ -262,14 +378,14 @@ static int state_convert_node_variable(struct state *state,
 		goto out_free;
 	}
 
-	vtype = state_find_type_by_name(type_name);
-	if (!vtype) {
-		dev_dbg(&state->dev, "Error: invalid variable type '%s'\n", type_name);
-		ret = -ENOENT;
-		goto out_free;
-	}
+	if (create) {
+		vtype = state_find_type_by_name(type_name);
+		if (!vtype) {
+			dev_dbg(&state->dev, "Error: invalid variable type '%s'\n", type_name);
+			ret = -ENOENT;
+			goto out_free;
+		}
 
-	if (conv == STATE_CONVERT_FROM_NODE_CREATE) {
 		sv = vtype->create(state, name, node, vtype);
 		if (IS_ERR(sv)) {
 			ret = PTR_ERR(sv);
@@ -306,6 +422,16 @@ static int state_convert_node_variable(struct state *state,
 			ret = 0;
 			goto out_free;
 		}
+
+		/* The variable usually knows its type already */
+		vtype = sv->type;
+		if (strcmp(type_name, vtype->type_name))
+			vtype = state_find_type_by_name(type_name);
+		if (!vtype) {
+			dev_dbg(&state->dev, "Error: invalid variable type '%s'\n", type_name);
+			ret = -ENOENT;
+			goto out_free;
+		}
 		free(name);
 
 		if ((conv == STATE_CONVERT_TO_NODE)
@@ -335,7 +461,8 @@ static int state_convert_node_variable(struct state *state,
 		goto out;
 
 	return 0;
- out_free:free(name);
+ out_free:if (!create)
+		free(name);
  out:	return ret;
 }
 
@@ -398,31 +525,10 @@ int state_from_node(struct state *state, struct device_node *node, bool create)
 			return ret;
 	}
 
-	/* check for overlapping variables */
 	if (create) {
-		const struct state_variable *sv;
-
-		/* start with second entry */
-		sv = list_first_entry(&state->variables, struct state_variable,
-				      list);
-
-		list_for_each_entry_continue(sv, &state->variables, list) {
-			const struct state_variable *last_sv;
-
-			last_sv = list_last_entry(&sv->list,
-						  struct state_variable, list);
-			if ((last_sv->start + last_sv->size - 1) < sv->start)
-				continue;
-
-			dev_err(&state->dev,
-				"ERROR: Conflicting variable position between: "
-				"%s (0x%02x..0x%02x) and %s (0x%02x..0x%02x)\n",
-				last_sv->name, last_sv->start,
-				last_sv->start + last_sv->size - 1,
-				sv->name, sv->start, sv->start + sv->size - 1);
-
-			ret |= -EINVAL;
-		}
+		/* sort and check for overlapping variables */
+		ret = state_sort_vars(state);
+		state_index_vars(state);
 	}
 
 	return ret;
@@ -506,9 +612,34 @@ static int of_state_fixup(struct device_node *root, void *ctx)
 	if (ret)
 		goto out;
 
+	/*
+	 * Passed on for other readers of the devicetree, barebox ignores it
+	 * and cannot read a compressed state
+	 */
+	if (state->format->compression) {
+		p = of_new_property(new_node, "backend-compression",
+				    state->format->compression,
+				    strlen(state->format->compression) + 1);
+		if (!p) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
 	if (!strcmp("raw", state->format->name)) {
 		struct digest *digest =
 		    state_backend_format_raw_get_digest(state->format);
+		unsigned int version =
+		    state_backend_format_raw_get_version(state->format);
+
+		if (version) {
+			ret = of_property_write_u32(new_node,
+						    "backend-raw-version",
+						    version);
+			if (ret)
+				goto out;
+		}
+
 		if (digest) {
 			p = of_new_property(new_node, "algo",
 					    digest_name(digest),
@@ -521,9 +652,11 @@ static int of_state_fixup(struct device_node *root, void *ctx)
 	}
 
 	if (state->storage.name) {
+		const char *storagetype = state->storage.rotating ?
+					  "rotating" : state->storage.name;
+
 		p = of_new_property(new_node, "backend-storage-type",
-				    state->storage.name,
-				    strlen(state->storage.name) + 1);
+				    storagetype, strlen(storagetype) + 1);
 		if (!p) {
 			ret = -ENOMEM;
 			goto out;
@@ -537,6 +670,23 @@ static int of_state_fixup(struct device_node *root, void *ctx)
 			goto out;
 	}
 
+	if (state->storage.pre_erase) {
+		ret = of_property_write_bool(new_node, "backend-pre-erase", true);
+		if (ret)
+			goto out;
+	}
+
+	if (state->storage.delta_log) {
+		ret = of_property_write_bool(new_node, "backend-delta-log", true);
+		if (ret)
+			goto out;
+
+		ret = of_property_write_bool(new_node,
+					     "backend-barebox-incompatible", true);
+		if (ret)
+			goto out;
+	}
+
 	/* address-cells + size-cells */
 	ret = of_property_write_u32(new_node, "#address-cells", 1);
 	if (ret)
@@ -570,13 +720,18 @@ static int of_state_fixup(struct device_node *root, void *ctx)
 void state_release(struct state *state)
 {
 	of_unregister_fixup(of_state_fixup, state);
+	state_setup_lock();
 	list_del(&state->list);
+	state_setup_unlock();
 	unregister_device(&state->dev);
 	state_storage_free(&state->storage);
 	state_format_free(state->format);
+	state_drop_image(state);
 	free(state->backend_path);
 	free(state->backend_reproducible_name);
 	free(state->of_path);
+	free(state->var_hash);
+	state_arena_free(state);
 	free(state);
 }
 
@@ -596,14 +751,63 @@ static char *cdev_to_devpath(struct cdev *cdev, off_t *offset, size_t *size)
 
 static guid_t barebox_state_partition_guid = BAREBOX_STATE_PARTITION_GUID;
 
+/*
+ * state_backend_of_node - resolve the backend of a state
+ *
+ * @node	The device_node describing the state
+ * @offset	Returns the offset of the state on the backend
+ * @size	Returns the size of the state on the backend
+ *
+ * Returns the path of the backend device or an ERR_PTR().
+ */
+char *state_backend_of_node(struct device_node *node, off_t *offset,
+			    size_t *size)
+{
+	struct device_node *partition_node;
+	struct cdev *cdev;
+	int ret;
+
+	partition_node = of_parse_phandle(node, "backend", 0);
+	if (!partition_node) {
+		pr_err("%s: Cannot resolve \"backend\" phandle\n",
+		       node->full_name);
+		return ERR_PTR(-EINVAL);
+	}
+
+	cdev = of_cdev_find(partition_node);
+	ret = PTR_ERR_OR_ZERO(cdev);
+	if (ret) {
+		if (ret != -EPROBE_DEFER)
+			pr_err("%s: state failed to parse path to backend: %s\n",
+			       node->full_name, strerror(-ret));
+		return ERR_PTR(ret);
+	}
+
+	/* Is the backend referencing an on-disk partitionable block device? */
+	if (cdev_is_block_disk(cdev)) {
+		cdev = cdev_find_child_by_gpt_typeuuid(cdev, &barebox_state_partition_guid);
+		if (IS_ERR(cdev))
+			return ERR_PTR(-EINVAL);
+
+		pr_debug("%s: backend GPT partition looked up via PartitionTypeGUID\n",
+			 node->full_name);
+	}
+
+	return cdev_to_devpath(cdev, offset, size);
+}
+
 /*
  * state_new_from_node - create a new state instance from a device_node
  *
  * @node	The device_node describing the new state instance
  * @readonly	This is a read-only state. Note that with this option set,
  *		there are no repairs done.
+ * @lock	If not NULL, the backend is locked for reading, or for writing
+ *		unless @readonly, before the storage is accessed. The lock is
+ *		returned here and released by the caller.
  */
-struct state *state_new_from_node(struct device_node *node, bool readonly)
+struct state *state_new_from_node(struct device_node *node, bool readonly,
+				  struct state_lock **lock)
 {
 	struct state *state;
 	int ret = 0;
@@ -611,50 +815,36 @@ struct state *state_new_from_node(struct device_node *node, bool readonly)
 	const char *storage_type = NULL;
 	const char *alias;
 	uint32_t stridesize;
-	struct device_node *partition_node;
-	struct cdev *cdev;
+	uint32_t pagesize = 0;
+	struct device_node *partition_node, *np;
 	off_t offset;
 	size_t size;
 
+	if (lock)
+		*lock = NULL;
+
 	alias = of_alias_get(node);
 	if (!alias) {
 		pr_err("State node %s does not have an alias in the /aliases/ node\n", node->full_name);
 		return ERR_PTR(-EINVAL);
 	}
 
+	state_setup_lock();
+
 	state = state_new(alias);
-	if (IS_ERR(state))
+	if (IS_ERR(state)) {
+		state_setup_unlock();
 		return state;
-
-	partition_node = of_parse_phandle(node, "backend", 0);
-	if (!partition_node) {
-		dev_err(&state->dev, "Cannot resolve \"backend\" phandle\n");
-		ret = -EINVAL;
-		goto out_release_state;
 	}
 
-	cdev = of_cdev_find(partition_node);
-	ret = PTR_ERR_OR_ZERO(cdev);
-	if (ret) {
-		if (ret != -EPROBE_DEFER)
-			dev_err(&state->dev, "state failed to parse path to backend: %s\n",
-			       strerror(-ret));
-		goto out_release_state;
+	state->backend_path = state_backend_of_node(node, &offset, &size);
+	if (IS_ERR(state->backend_path)) {
+		ret = PTR_ERR(state->backend_path);
+		state->backend_path = NULL;
+		goto out_unlock;
 	}
 
-	/* Is the backend referencing an on-disk partitionable block device? */
-	if (cdev_is_block_disk(cdev)) {
-		cdev = cdev_find_child_by_gpt_typeuuid(cdev, &barebox_state_partition_guid);
-		if (IS_ERR(cdev)) {
-			ret = -EINVAL;
-			goto out_release_state;
-		}
-
-		pr_debug("%s: backend GPT partition looked up via PartitionTypeGUID\n",
-			 node->full_name);
-	}
-
-	state->backend_path = cdev_to_devpath(cdev, &offset, &size);
+	partition_node = of_parse_phandle(node, "backend", 0);
 
 	pr_debug("%s: backend resolved to %s %lld %zu\n", node->full_name,
 		 state->backend_path, (long long)offset, size);
@@ -668,7 +858,7 @@ struct state *state_new_from_node(struct device_node *node, bool readonly)
 	ret = of_property_read_string(node, "backend-type", &backend_type);
 	if (ret) {
 		dev_dbg(&state->dev, "Missing 'backend-type' property\n");
-		goto out_release_state;
+		goto out_unlock;
 	}
 
 	ret = of_property_read_u32(node, "backend-stridesize", &stridesize);
@@ -679,21 +869,47 @@ struct state *state_new_from_node(struct device_node *node, bool readonly)
 
 	of_property_read_string(node, "backend-storage-type", &storage_type);
 
+	/* EEPROMs describe their page size in the device node */
+	for (np = partition_node; np; np = np->parent) {
+		if (!of_property_read_u32(np, "pagesize", &pagesize))
+			break;
+	}
+
 	state->keep_prev_content = of_property_read_bool(node,
 							"keep-previous-content");
 
 	ret = state_format_init(state, backend_type, node, alias);
+	state_setup_unlock();
 	if (ret)
 		goto out_release_state;
 
+	/* Finding the data written last already reads the storage */
+	if (lock) {
+		ret = state_lock_backend(state->backend_path, offset, !readonly,
+					 lock);
+		if (ret)
+			goto out_release_state;
+	}
+
 	if (readonly)
 		state_backend_set_readonly(state);
 
 	ret = state_storage_init(state, state->backend_path, offset,
-				 size, stridesize, storage_type);
+				 size, stridesize, pagesize, storage_type);
 	if (ret)
 		goto out_release_state;
 
+	if (of_property_read_bool(node, "backend-pre-erase"))
+		state_storage_set_pre_erase(&state->storage);
+
+	/* barebox cannot read the delta log, the devicetree has to waive it */
+	if (of_property_read_bool(node, "backend-delta-log")) {
+		if (of_property_read_bool(node, "backend-barebox-incompatible"))
+			state_storage_set_delta_log(&state->storage);
+		else
+			dev_warn(&state->dev, "Ignoring backend-delta-log, barebox cannot read it. Add backend-barebox-incompatible if barebox does not use this state\n");
+	}
+
 	ret = state_from_node(state, node, 1);
 	if (ret) {
 		goto out_release_state;
@@ -710,8 +926,14 @@ struct state *state_new_from_node(struct device_node *node, bool readonly)
 
 	return state;
 
+out_unlock:
+	state_setup_unlock();
 out_release_state:
 	state_release(state);
+	if (lock) {
+		state_unlock(*lock);
+		*lock = NULL;
+	}
 	return ERR_PTR(ret);
 }
 
@@ -752,7 +974,6 @@ struct state *state_by_node(const struct device_node *node)
 int state_read_mac(struct state *state, const char *name, u8 *buf)
 {
 	struct state_variable *svar;
-	struct state_mac *mac;
 
 	if (!state || !name || !buf)
 		return -EINVAL;
@@ -764,8 +985,7 @@ int state_read_mac(struct state *state, const char *name, u8 *buf)
 	if (svar->type->type != STATE_VARIABLE_TYPE_MAC)
 		return -EINVAL;
 
-	mac = to_state_mac(svar);
-	memcpy(buf, mac->value, 6);
+	memcpy(buf, svar->raw, 6);
 
 	return 0;
 }
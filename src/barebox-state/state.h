@@ -1,6 +1,9 @@
 // SPDX-License-Identifier: GPL-2.0-only
 // Copyright 2013-2023 The DT-Utils Authors <oss-tools@pengutronix.de>
 
+#ifndef __BAREBOX_STATE_STATE_H
+#define __BAREBOX_STATE_STATE_H
+
 #include <linux/types.h>
 #include <linux/list.h>
 #include <driver.h>
@@ -8,6 +11,8 @@
 
 struct state;
 struct mtd_info_user;
+struct state_arena_chunk;
+struct state_lock;
 
 enum state_flags {
 	STATE_FLAG_NO_AUTHENTICATION = (1 << 0),
@@ -32,14 +37,37 @@ enum state_variable_type {
  * storage. Returns 0 on success and allocates a matching memory area to buf.
  * len_hint can be a hint of the storage format how large the data to be read
  * is. After the operation len_hint contains the size of the allocated buffer.
+ * @write_delta Optional, appends a delta log record as created by the storage
+ * to the data written last. Returns -ENOSPC if there is no room left for it.
+ * @flush Optional, makes the data of preceding writes durable. Buckets without
+ * a flush operation are expected to write synchronously.
+ * @needs_erase Optional, returns true if writing len bytes requires erasing
+ * the bucket and thereby destroys the data currently stored in it
+ * @erase Optional, erases the bucket so that following writes do not need to
+ * erase it
+ * @probe Optional, cheaply checks whether the data on the storage changed since
+ * it was last read, without reading all of it. Returns 1 if it changed or
+ * cannot be told apart, and lets the next @read return the new data, 0 if it
+ * is unchanged or -errno on failure.
  * @free Required, Frees all internally used memory
  * @bucket_list A list element struct to attach this bucket to a list
+ * @generation Generation of the data. Set by the storage before @write and
+ * updated by @read. 0 if the data on the storage carries no generation.
+ * @erase_count Number of times the bucket was erased, if the bucket keeps
+ * track of it
  */
 struct state_backend_storage_bucket {
 	int (*write) (struct state_backend_storage_bucket * bucket,
 		      const void * buf, ssize_t len);
 	int (*read) (struct state_backend_storage_bucket * bucket,
 		     void ** buf, ssize_t * len_hint);
+	int (*write_delta) (struct state_backend_storage_bucket * bucket,
+			    const void * record, ssize_t len);
+	int (*flush) (struct state_backend_storage_bucket * bucket);
+	bool (*needs_erase) (struct state_backend_storage_bucket * bucket,
+			     ssize_t len);
+	int (*erase) (struct state_backend_storage_bucket * bucket);
+	int (*probe) (struct state_backend_storage_bucket * bucket);
 	void (*free) (struct state_backend_storage_bucket * bucket);
 
 	int num;
@@ -49,8 +77,11 @@ struct state_backend_storage_bucket {
 
 	void *buf;
 	ssize_t len;
+	uint32_t generation;
+	uint32_t erase_count;
 	bool needs_refresh;
 	bool wrong_magic;
+	bool unflushed;
 };
 
 /**
@@ -60,13 +91,19 @@ struct state_backend_storage_bucket {
  * passed into this function may be larger than the actual data in the buffer.
  * The magic is supplied by the state to verify that this is an expected state
  * entity. The function should return 0 on success or a negative errno otherwise.
- * @pack Required, Packs data from the given state into a newly created buffer.
- * The buffer and its length are stored in the given argument pointers. Returns
- * 0 on success, -errno otherwise.
+ * @pack Required, Packs data from the given state into a buffer. On entry the
+ * argument pointers hold the image of the state, the data last read or written,
+ * or NULL. The format may pack into the image in place, otherwise it stores a
+ * newly created buffer and its length in the given argument pointers. The state
+ * keeps the buffer as its new image, also if packing fails. Returns 0 on
+ * success, -errno otherwise.
  * @unpack Required, Unpacks the data from the given buffer into the state. Do
- * not free the buffer.
+ * not free the buffer, the state keeps it as its image if unpacking succeeds.
+ * The format may move the values of the variables into the image.
  * @free Optional, Frees all allocated memory and structures.
  * @name Name of this backend.
+ * @compression Name of the compression applied to the packed data, NULL if
+ * the data is not compressed.
  */
 struct state_backend_format {
 	int (*verify) (struct state_backend_format * format, uint32_t magic,
@@ -77,6 +114,7 @@ struct state_backend_format {
 		       struct state * state, const void * buf, ssize_t len);
 	void (*free) (struct state_backend_format * format);
 	const char *name;
+	const char *compression;
 };
 
 /**
@@ -84,8 +122,18 @@ struct state_backend_format {
  *
  * @buckets List of storage buckets that are available
  * @stridesize The distance between copies
+ * @pagesize The write granularity of the device, 0 if unknown
  * @offset Offset in the backend device where the data starts
  * @max_size The maximum size of the data we can use
+ * @generation The newest generation found on or written to the storage
+ * @rotating Copies are spread over all buckets instead of being written to
+ * every bucket
+ * @pre_erase Erase the buckets used by the next write in advance
+ * @delta_log Append the changes to the data written last instead of the data
+ * itself, if possible
+ * @written_len Length of the data written last
+ * @data Copy of the data currently stored in the buckets, for the delta log
+ * @data_len Length of @data
  */
 struct state_backend_storage {
 	struct list_head buckets;
@@ -96,11 +144,34 @@ struct state_backend_storage {
 	const char *name;
 
 	uint32_t stridesize;
+	uint32_t pagesize;
 	off_t offset;
 	size_t max_size;
 	char *path;
 
+	uint32_t generation;
+
+	ssize_t written_len;
+
+	void *data;
+	ssize_t data_len;
+
 	bool readonly;
+	bool rotating;
+	bool pre_erase;
+	bool delta_log;
+};
+
+/*
+ * A record of the delta log. The header is followed by @len bytes of changes
+ * which turn the data of @base_generation into the data of @generation.
+ */
+struct __attribute__((__packed__)) state_delta_header {
+	uint32_t magic;
+	uint32_t generation;
+	uint32_t base_generation;
+	uint32_t len;
+	uint32_t crc;
 };
 
 struct state {
@@ -113,6 +184,10 @@ struct state {
 	bool keep_prev_content;
 
 	struct list_head variables; /* Sorted list of variables */
+	unsigned int num_vars;
+	struct state_variable **var_hash; /* Variables by name, may be NULL */
+	unsigned int var_hash_mask;
+	struct state_arena_chunk *arena; /* Variables and their names */
 
 	unsigned int dirty;
 	unsigned int init_from_defaults;
@@ -120,6 +195,8 @@ struct state {
 
 	struct state_backend_format *format;
 	struct state_backend_storage storage;
+	void *image; /* Data last read or written, packed by the format */
+	ssize_t image_len;
 	char *backend_path;
 	char *backend_reproducible_name;
 };
@@ -141,18 +218,26 @@ struct variable_type {
 	int (*export) (struct state_variable *, struct device_node *,
 		       enum state_convert);
 	int (*import) (struct state_variable *, struct device_node *);
+	/* Imports a "value" property, NULL if missing, without its node */
+	int (*import_value) (struct state_variable *, const void *, int);
 	struct state_variable *(*create) (struct state *,
 					  const char *,
 					  struct device_node *,
 					  const struct variable_type *);
 };
 
-/* instance of a single variable */
+/*
+ * instance of a single variable
+ *
+ * The value is always accessed through @raw. It points into the variable
+ * itself, unless the raw format moved the value into the image of the state.
+ */
 struct state_variable {
 	struct state *state;
 	struct list_head list;
 	const struct variable_type *type;
 	const char *name;
+	struct state_variable *hash_next; /* Next variable in state->var_hash */
 	unsigned int start;
 	unsigned int size;
 	void *raw;
@@ -206,35 +291,60 @@ int backend_format_raw_create(struct state_backend_format **format,
 			      struct device_d *dev);
 int backend_format_dtb_create(struct state_backend_format **format,
 			      struct device_d *dev);
+int backend_format_tlv_create(struct state_backend_format **format,
+			      struct device_node *node, struct state *state);
+int backend_format_compressed_create(struct state_backend_format **format,
+				     const char *compression,
+				     struct device_d *dev);
 int state_storage_init(struct state *state, const char *path,
 		       off_t offset, size_t max_size, uint32_t stridesize,
-		       const char *storagetype);
+		       uint32_t pagesize, const char *storagetype);
 void state_storage_set_readonly(struct state_backend_storage *storage);
+void state_storage_set_pre_erase(struct state_backend_storage *storage);
+void state_storage_set_delta_log(struct state_backend_storage *storage);
+ssize_t state_delta_record_len(const struct state_delta_header *header);
+ssize_t state_delta_apply(void *buf, ssize_t len, const void *record,
+			  ssize_t record_len, uint32_t *generation);
 void state_add_var(struct state *state, struct state_variable *var);
+int state_sort_vars(struct state *state);
+void state_index_vars(struct state *state);
+void *state_alloc(struct state *state, size_t size);
+char *state_strdup(struct state *state, const char *s);
+void state_arena_free(struct state *state);
+void state_setup_lock(void);
+void state_setup_unlock(void);
 struct variable_type *state_find_type_by_name(const char *name);
 int state_backend_bucket_circular_create(struct device_d *dev, const char *path,
 					 struct state_backend_storage_bucket **bucket,
 					 unsigned int eraseblock,
 					 ssize_t writesize,
-					 struct mtd_info_user *mtd_uinfo);
+					 struct mtd_info_user *mtd_uinfo,
+					 bool rotating);
 int state_backend_bucket_cached_create(struct device_d *dev,
 				       struct state_backend_storage_bucket *raw,
 				       struct state_backend_storage_bucket **out);
 struct state_variable *state_find_var(struct state *state, const char *name);
 struct digest *state_backend_format_raw_get_digest(struct state_backend_format
 						   *format);
+unsigned int state_backend_format_raw_get_version(struct state_backend_format
+						  *format);
 void state_backend_set_readonly(struct state *state);
 void state_storage_free(struct state_backend_storage *storage);
 int state_backend_bucket_direct_create(struct device_d *dev, const char *path,
 				       struct state_backend_storage_bucket **bucket,
 				       off_t offset, ssize_t max_size,
-				       bool readonly);
+				       uint32_t pagesize, bool readonly);
 int state_storage_write(struct state_backend_storage *storage,
 			const void * buf, ssize_t len);
 int state_storage_read(struct state_backend_storage *storage,
 		       struct state_backend_format *format,
 		       uint32_t magic, void **buf, ssize_t *len,
 		       enum state_flags flags);
+int state_storage_pre_erase(struct state_backend_storage *storage);
+int state_storage_probe(struct state_backend_storage *storage);
+int state_storage_check(struct state_backend_storage *storage,
+			struct state_backend_format *format,
+			uint32_t magic, enum state_flags flags);
 
 static inline struct state_uint32 *to_state_uint32(struct state_variable *s)
 {
@@ -266,12 +376,39 @@ static inline int state_string_copy_to_raw(struct state_string *string,
 		return -EILSEQ;
 
 	/* copy string and clear remaining contents of buffer */
-	memcpy(string->raw, src, len);
-	memset(string->raw + len, 0x0, string->var.size - len);
+	memcpy(string->var.raw, src, len);
+	memset(string->var.raw + len, 0x0, string->var.size - len);
 
 	return 0;
 }
 
+/* Returns the value of a uint8, uint32 or enum32 variable */
+static inline uint32_t state_var_get_u32(struct state_variable *sv)
+{
+	uint32_t val;
+
+	if (sv->size == sizeof(uint8_t))
+		return *(uint8_t *)sv->raw;
+
+	memcpy(&val, sv->raw, sizeof(val));
+
+	return val;
+}
+
+/* Sets the value of a uint8, uint32 or enum32 variable */
+static inline void state_var_set_u32(struct state_variable *sv, uint32_t val)
+{
+	if (sv->size == sizeof(uint8_t))
+		*(uint8_t *)sv->raw = val;
+	else
+		memcpy(sv->raw, &val, sizeof(val));
+}
+
+/* Lock files shared with other processes, see libbarebox-state.c */
+int state_lock_backend(const char *backend, off_t offset, bool exclusive,
+		       struct state_lock **lock);
+void state_unlock(struct state_lock *lock);
+
 static inline int open_exclusive(const char *path, int flags)
 {
 	int fd;
@@ -280,8 +417,10 @@ static inline int open_exclusive(const char *path, int flags)
 	if (fd < 0)
 		return fd;
 
+	/* Readers share the lock, writers need it exclusively */
 	if (IS_ENABLED(CONFIG_LOCK_DEVICE_NODE)) {
-		int ret = flock(fd, LOCK_EX);
+		int ret = flock(fd, (flags & O_ACCMODE) == O_RDONLY ?
+				LOCK_SH : LOCK_EX);
 		if (ret < 0) {
 			pr_err("Failed to lock %s: %d\n", path, -errno);
 			close(fd);
@@ -291,3 +430,5 @@ static inline int open_exclusive(const char *path, int flags)
 
 	return fd;
 }
+
+#endif /* __BAREBOX_STATE_STATE_H */
@@ -44,17 +44,191 @@ static int state_set_dirty(struct param_d *p, void *priv)
 	return 0;
 }
 
-static int state_var_compare(struct list_head *a, struct list_head *b)
+/*
+ * Variables and their names live as long as the state, so they are carved
+ * out of larger chunks instead of being allocated one by one.
+ */
+#define STATE_ARENA_CHUNK_SIZE	4096
+#define STATE_ARENA_ALIGN	16
+
+struct state_arena_chunk {
+	struct state_arena_chunk *next;
+	size_t size;
+	size_t used;
+	unsigned char data[] __attribute__((aligned(STATE_ARENA_ALIGN)));
+};
+
+/**
+ * state_alloc - Allocates zeroed memory freed along with the state
+ * @param state The state the memory belongs to
+ * @param size Number of bytes to allocate
+ * @return Pointer to the memory
+ */
+void *state_alloc(struct state *state, size_t size)
+{
+	struct state_arena_chunk *chunk = state->arena;
+	void *p;
+
+	size = ALIGN(size, STATE_ARENA_ALIGN);
+
+	if (!chunk || chunk->size - chunk->used < size) {
+		size_t chunk_size = STATE_ARENA_CHUNK_SIZE;
+
+		if (size > chunk_size)
+			chunk_size = size;
+
+		chunk = xzalloc(sizeof(*chunk) + chunk_size);
+		chunk->size = chunk_size;
+
+		/* Keep filling the current chunk after an oversized one */
+		if (state->arena && size == chunk_size) {
+			chunk->next = state->arena->next;
+			state->arena->next = chunk;
+		} else {
+			chunk->next = state->arena;
+			state->arena = chunk;
+		}
+	}
+
+	p = chunk->data + chunk->used;
+	chunk->used += size;
+
+	return p;
+}
+
+char *state_strdup(struct state *state, const char *s)
 {
-	struct state_variable *va = list_entry(a, struct state_variable, list);
-	struct state_variable *vb = list_entry(b, struct state_variable, list);
+	size_t len = strlen(s) + 1;
 
-	return va->start < vb->start ? -1 : 1;
+	return memcpy(state_alloc(state, len), s, len);
 }
 
+void state_arena_free(struct state *state)
+{
+	struct state_arena_chunk *chunk, *next;
+
+	for (chunk = state->arena; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+
+	state->arena = NULL;
+}
+
+/**
+ * state_add_var - Adds a variable to a state
+ * @param state The state to add the variable to
+ * @param var The variable
+ *
+ * The variable is appended to the list of variables. Once all variables are
+ * added, state_sort_vars() brings the list into order.
+ */
 void state_add_var(struct state *state, struct state_variable *var)
 {
-	list_add_sort(&var->list, &state->variables, state_var_compare);
+	list_add_tail(&var->list, &state->variables);
+	state->num_vars++;
+
+	/* The index is rebuilt once all variables are added */
+	free(state->var_hash);
+	state->var_hash = NULL;
+}
+
+static int state_var_compare(const void *a, const void *b)
+{
+	const struct state_variable *va = *(const struct state_variable **)a;
+	const struct state_variable *vb = *(const struct state_variable **)b;
+
+	if (va->start != vb->start)
+		return va->start < vb->start ? -1 : 1;
+
+	return 0;
+}
+
+/**
+ * state_sort_vars - Sorts the variables of a state by their position
+ * @param state The state to sort
+ * @return 0 on success, -EINVAL if variables overlap
+ */
+int state_sort_vars(struct state *state)
+{
+	struct state_variable **vars, *sv;
+	unsigned int n = 0, i;
+	int ret = 0;
+
+	if (!state->num_vars)
+		return 0;
+
+	vars = xmalloc(state->num_vars * sizeof(*vars));
+	list_for_each_entry(sv, &state->variables, list)
+		vars[n++] = sv;
+
+	qsort(vars, n, sizeof(*vars), state_var_compare);
+
+	INIT_LIST_HEAD(&state->variables);
+	for (i = 0; i < n; i++)
+		list_add_tail(&vars[i]->list, &state->variables);
+
+	/* sorted, so only neighbours can overlap */
+	for (i = 1; i < n; i++) {
+		const struct state_variable *last_sv = vars[i - 1];
+
+		sv = vars[i];
+		if ((last_sv->start + last_sv->size - 1) < sv->start)
+			continue;
+
+		dev_err(&state->dev,
+			"ERROR: Conflicting variable position between: "
+			"%s (0x%02x..0x%02x) and %s (0x%02x..0x%02x)\n",
+			last_sv->name, last_sv->start,
+			last_sv->start + last_sv->size - 1,
+			sv->name, sv->start, sv->start + sv->size - 1);
+
+		ret = -EINVAL;
+	}
+
+	free(vars);
+
+	return ret;
+}
+
+/* FNV-1a hash of a variable name */
+static uint32_t state_var_hash(const char *name)
+{
+	uint32_t hash = 2166136261U;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
+
+/**
+ * state_index_vars - Builds the index used by state_find_var()
+ * @param state The state to index
+ *
+ * The index is a hash table of all variables by their full name. Without
+ * the index, state_find_var() falls back to walking the list of variables.
+ */
+void state_index_vars(struct state *state)
+{
+	struct state_variable *sv;
+	unsigned int size = 1, i;
+
+	/* Keep the chains short */
+	while (size < 2 * state->num_vars)
+		size <<= 1;
+
+	free(state->var_hash);
+	state->var_hash = xzalloc(size * sizeof(*state->var_hash));
+	state->var_hash_mask = size - 1;
+
+	list_for_each_entry(sv, &state->variables, list) {
+		i = state_var_hash(sv->name) & state->var_hash_mask;
+		sv->hash_next = state->var_hash[i];
+		state->var_hash[i] = sv;
+	}
 }
 
 static int state_uint32_export(struct state_variable *var,
@@ -74,19 +248,33 @@ static int state_uint32_export(struct state_variable *var,
 	if (conv == STATE_CONVERT_FIXUP)
 		return 0;
 
-	return of_property_write_u32(node, "value", su32->value);
+	return of_property_write_u32(node, "value", state_var_get_u32(var));
+}
+
+static int state_uint32_import_value(struct state_variable *sv,
+				     const void *value, int len)
+{
+	struct state_uint32 *su32 = to_state_uint32(sv);
+
+	if (value && len >= sizeof(uint32_t))
+		state_var_set_u32(sv, be32_to_cpu(*(const __be32 *)value));
+	else
+		state_var_set_u32(sv, su32->value_default);
+
+	return 0;
 }
 
 static int state_uint32_import(struct state_variable *sv,
 			       struct device_node *node)
 {
 	struct state_uint32 *su32 = to_state_uint32(sv);
+	const void *value;
+	int len;
 
 	of_property_read_u32(node, "default", &su32->value_default);
-	if (of_property_read_u32(node, "value", &su32->value))
-		su32->value = su32->value_default;
+	value = of_get_property(node, "value", &len);
 
-	return 0;
+	return state_uint32_import_value(sv, value, len);
 }
 
 static int state_uint8_set(struct param_d *p, void *priv)
@@ -108,22 +296,16 @@ static struct state_variable *state_uint8_create(struct state *state,
 	struct state_uint32 *su32;
 	struct param_d *param;
 
-	su32 = xzalloc(sizeof(*su32));
+	su32 = state_alloc(state, sizeof(*su32));
 
 	param = dev_add_param_uint32(&state->dev, name, state_uint8_set,
 				  NULL, &su32->value, "%u", &su32->var);
-	if (IS_ERR(param)) {
-		free(su32);
+	if (IS_ERR(param))
 		return ERR_CAST(param);
-	}
 
 	su32->var.type = vtype;
 	su32->var.size = sizeof(uint8_t);
-#ifdef __LITTLE_ENDIAN
 	su32->var.raw = &su32->value;
-#else
-	su32->var.raw = &su32->value + 3;
-#endif
 	su32->var.state = state;
 
 	return &su32->var;
@@ -137,14 +319,12 @@ static struct state_variable *state_uint32_create(struct state *state,
 	struct state_uint32 *su32;
 	struct param_d *param;
 
-	su32 = xzalloc(sizeof(*su32));
+	su32 = state_alloc(state, sizeof(*su32));
 
 	param = dev_add_param_uint32(&state->dev, name, state_set_dirty,
 				  NULL, &su32->value, "%u", &su32->var);
-	if (IS_ERR(param)) {
-		free(su32);
+	if (IS_ERR(param))
 		return ERR_CAST(param);
-	}
 
 	su32->var.type = vtype;
 	su32->var.size = sizeof(uint32_t);
@@ -189,13 +369,29 @@ static int state_enum32_export(struct state_variable *var,
 	if (conv == STATE_CONVERT_FIXUP)
 		return 0;
 
-	ret = of_property_write_u32(node, "value", enum32->value);
+	ret = of_property_write_u32(node, "value", state_var_get_u32(var));
 	if (ret)
 		return ret;
 
 	return ret;
 }
 
+static int state_enum32_import_value(struct state_variable *sv,
+				     const void *value, int len)
+{
+	struct state_enum32 *enum32 = to_state_enum32(sv);
+
+	if (value && len != sizeof(uint32_t))
+		return -EINVAL;
+
+	if (value)
+		state_var_set_u32(sv, be32_to_cpu(*(const __be32 *)value));
+	else
+		state_var_set_u32(sv, enum32->value_default);
+
+	return 0;
+}
+
 static int state_enum32_import(struct state_variable *sv,
 			       struct device_node *node)
 {
@@ -213,12 +409,8 @@ static int state_enum32_import(struct state_variable *sv,
 
 	if (value_default)
 		enum32->value_default = be32_to_cpu(*value_default);
-	if (value)
-		enum32->value = be32_to_cpu(*value);
-	else
-		enum32->value = enum32->value_default;
 
-	return 0;
+	return state_enum32_import_value(sv, value, sizeof(uint32_t));
 }
 
 static struct state_variable *state_enum32_create(struct state *state,
@@ -230,8 +422,6 @@ static struct state_variable *state_enum32_create(struct state *state,
 	struct param_d *param;
 	int ret, i, num_names;
 
-	enum32 = xzalloc(sizeof(*enum32));
-
 	num_names = of_property_count_strings(node, "names");
 	if (num_names < 0) {
 		dev_err(&state->dev,
@@ -239,7 +429,8 @@ static struct state_variable *state_enum32_create(struct state *state,
 		return ERR_PTR(-EINVAL);
 	}
 
-	enum32->names = xzalloc(sizeof(char *) * num_names);
+	enum32 = state_alloc(state, sizeof(*enum32));
+	enum32->names = state_alloc(state, sizeof(char *) * num_names);
 	enum32->num_names = num_names;
 	enum32->var.type = vtype;
 	enum32->var.size = sizeof(uint32_t);
@@ -251,24 +442,17 @@ static struct state_variable *state_enum32_create(struct state *state,
 
 		ret = of_property_read_string_index(node, "names", i, &name);
 		if (ret)
-			goto out;
-		enum32->names[i] = xstrdup(name);
+			return ERR_PTR(ret);
+		enum32->names[i] = state_strdup(state, name);
 	}
 
 	param = dev_add_param_enum(&state->dev, name, state_set_dirty,
 					   NULL, &enum32->value, enum32->names,
 					   num_names, &enum32->var);
-	if (IS_ERR(param)) {
-		ret = PTR_ERR(param);
-		goto out;
-	}
+	if (IS_ERR(param))
+		return ERR_CAST(param);
 
 	return &enum32->var;
- out:	for (i--; i >= 0; i--)
-		free((char *)enum32->names[i]);
-	free(enum32->names);
-	free(enum32);
-	return ERR_PTR(ret);
 }
 
 static int state_mac_export(struct state_variable *var,
@@ -289,21 +473,34 @@ static int state_mac_export(struct state_variable *var,
 	if (conv == STATE_CONVERT_FIXUP)
 		return 0;
 
-	return of_property_write_u8_array(node, "value", mac->value,
+	return of_property_write_u8_array(node, "value", var->raw,
 					  ARRAY_SIZE(mac->value));
 }
 
+static int state_mac_import_value(struct state_variable *sv,
+				  const void *value, int len)
+{
+	struct state_mac *mac = to_state_mac(sv);
+
+	if (value && len >= ARRAY_SIZE(mac->value))
+		memcpy(sv->raw, value, ARRAY_SIZE(mac->value));
+	else
+		memcpy(sv->raw, mac->value_default, ARRAY_SIZE(mac->value));
+
+	return 0;
+}
+
 static int state_mac_import(struct state_variable *sv, struct device_node *node)
 {
 	struct state_mac *mac = to_state_mac(sv);
+	const void *value;
+	int len;
 
 	of_property_read_u8_array(node, "default", mac->value_default,
 				  ARRAY_SIZE(mac->value_default));
-	if (of_property_read_u8_array(node, "value", mac->value,
-				      ARRAY_SIZE(mac->value)))
-		memcpy(mac->value, mac->value_default, ARRAY_SIZE(mac->value));
+	value = of_get_property(node, "value", &len);
 
-	return 0;
+	return state_mac_import_value(sv, value, len);
 }
 
 static struct state_variable *state_mac_create(struct state *state,
@@ -313,9 +510,8 @@ static struct state_variable *state_mac_create(struct state *state,
 {
 	struct state_mac *mac;
 	struct param_d *param;
-	int ret;
 
-	mac = xzalloc(sizeof(*mac));
+	mac = state_alloc(state, sizeof(*mac));
 
 	mac->var.type = vtype;
 	mac->var.size = ARRAY_SIZE(mac->value);
@@ -324,14 +520,10 @@ static struct state_variable *state_mac_create(struct state *state,
 
 	param = dev_add_param_mac(&state->dev, name, state_set_dirty,
 				       NULL, mac->value, &mac->var);
-	if (IS_ERR(param)) {
-		ret = PTR_ERR(param);
-		goto out;
-	}
+	if (IS_ERR(param))
+		return ERR_CAST(param);
 
 	return &mac->var;
- out:	free(mac);
-	return ERR_PTR(ret);
 }
 
 static int state_string_export(struct state_variable *var,
@@ -357,13 +549,28 @@ static int state_string_export(struct state_variable *var,
 	return ret;
 }
 
+static int state_string_import_value(struct state_variable *sv,
+				     const void *value, int len)
+{
+	struct state_string *string = to_state_string(sv);
+
+	/* Only take over properly terminated strings */
+	if (!value || strnlen(value, len) >= len)
+		value = string->value_default;
+
+	if (value)
+		return state_string_copy_to_raw(string, value);
+
+	return 0;
+}
+
 static int state_string_import(struct state_variable *sv,
 			       struct device_node *node)
 {
 	struct state_string *string = to_state_string(sv);
-	const char *value = NULL;
+	const void *value;
 	size_t len;
-	int ret;
+	int value_len;
 
 	of_property_read_string(node, "default", &string->value_default);
 	if (string->value_default) {
@@ -372,14 +579,9 @@ static int state_string_import(struct state_variable *sv,
 			return -EILSEQ;
 	}
 
-	ret = of_property_read_string(node, "value", &value);
-	if (ret)
-		value = string->value_default;
-
-	if (value)
-		return state_string_copy_to_raw(string, value);
+	value = of_get_property(node, "value", &value_len);
 
-	return 0;
+	return state_string_import_value(sv, value, value_len);
 }
 
 static int state_string_set(struct param_d *p, void *priv)
@@ -401,8 +603,8 @@ static int state_string_get(struct param_d *p, void *priv)
 	struct state_string *string = to_state_string(sv);
 
 	free(string->value);
-	if (string->raw[0])
-		string->value = xstrndup(string->raw, string->var.size);
+	if (*(char *)sv->raw)
+		string->value = xstrndup(sv->raw, sv->size);
 	else
 		string->value = xstrdup("");
 
@@ -430,7 +632,7 @@ static struct state_variable *state_string_create(struct state *state,
 	if (start_size[1] > 4096)
 		return ERR_PTR(-EILSEQ);
 
-	string = xzalloc(sizeof(*string) + start_size[1]);
+	string = state_alloc(state, sizeof(*string) + start_size[1]);
 	string->var.type = vtype;
 	string->var.size = start_size[1];
 	string->var.raw = &string->raw;
@@ -439,14 +641,10 @@ static struct state_variable *state_string_create(struct state *state,
 	param = dev_add_param_string(&state->dev, name,
 					     state_string_set, state_string_get,
 					     &string->value, &string->var);
-	if (IS_ERR(param)) {
-		ret = PTR_ERR(param);
-		goto out;
-	}
+	if (IS_ERR(param))
+		return ERR_CAST(param);
 
 	return &string->var;
- out:	free(string);
-	return ERR_PTR(ret);
 }
 
 static struct variable_type types[] = {
@@ -455,30 +653,35 @@ static struct variable_type types[] = {
 		.type = STATE_VARIABLE_TYPE_UINT8,
 		.export = state_uint32_export,
 		.import = state_uint32_import,
+		.import_value = state_uint32_import_value,
 		.create = state_uint8_create,
 	}, {
 		.type_name = "uint32",
 		.type = STATE_VARIABLE_TYPE_UINT32,
 		.export = state_uint32_export,
 		.import = state_uint32_import,
+		.import_value = state_uint32_import_value,
 		.create = state_uint32_create,
 	}, {
 		.type_name = "enum32",
 		.type = STATE_VARIABLE_TYPE_ENUM32,
 		.export = state_enum32_export,
 		.import = state_enum32_import,
+		.import_value = state_enum32_import_value,
 		.create = state_enum32_create,
 	}, {
 		.type_name = "mac",
 		.type = STATE_VARIABLE_TYPE_MAC,
 		.export = state_mac_export,
 		.import = state_mac_import,
+		.import_value = state_mac_import_value,
 		.create = state_mac_create,
 	}, {
 		.type_name = "string",
 		.type = STATE_VARIABLE_TYPE_STRING,
 		.export = state_string_export,
 		.import = state_string_import,
+		.import_value = state_string_import_value,
 		.create = state_string_create,
 	}
 };
@@ -500,7 +703,17 @@ struct state_variable *state_find_var(struct state *state, const char *name)
 {
 	struct state_variable *sv;
 
-	list_for_each_entry(sv, &state->variables, list) {
+	if (!state->var_hash) {
+		list_for_each_entry(sv, &state->variables, list) {
+			if (!strcmp(sv->name, name))
+				return sv;
+		}
+
+		return ERR_PTR(-ENOENT);
+	}
+
+	sv = state->var_hash[state_var_hash(name) & state->var_hash_mask];
+	for (; sv; sv = sv->hash_next) {
 		if (!strcmp(sv->name, name))
 			return sv;
 	}
@@ -2,6 +2,10 @@
 /*
  * This file is derived from crc32.c from the zlib-1.1.3 distribution
  * by Jean-loup Gailly and Mark Adler.
+ *
+ * The checksum is computed by folding with PCLMULQDQ on x86-64 and with the
+ * crc32 instructions of the CRC extension on ARMv8 if the CPU has them.
+ * Otherwise slice-by-16 tables process sixteen bytes per step.
  */
 
 /* crc32.c -- compute the CRC-32 of a data stream
@@ -9,7 +13,23 @@
  */
 
 #include <dt/common.h>
+#include <pthread.h>
 #include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+
+/* GCC and clang spell the CRC extension differently */
+#ifdef __clang__
+#define TARGET_CRC	__attribute__((target("crc")))
+#else
+#define TARGET_CRC	__attribute__((target("+crc")))
+#endif
+#endif
 
 /* ========================================================================
  * Table of CRC-32's of all single-byte values (made by make_crc_table)
@@ -69,28 +89,287 @@ static const uint32_t crc_table[256] = {
 	0x2d02ef8dL
 };
 
-/* ========================================================================= */
-#define DO1(buf) crc = crc_table[((int)crc ^ (*buf++)) & 0xff] ^ (crc >> 8);
-#define DO2(buf)  DO1(buf); DO1(buf);
-#define DO4(buf)  DO2(buf); DO2(buf);
-#define DO8(buf)  DO4(buf); DO4(buf);
+/*
+ * crc_table extended for slice-by-16, built at startup: crc_slice[k][n] is the
+ * CRC of byte n followed by k zero bytes. Sixteen bytes are processed with one
+ * lookup each per step instead of one after the other.
+ */
+static uint32_t crc_slice[16][256];
 
-/* ========================================================================= */
-uint32_t crc32(uint32_t crc, const void *_buf, unsigned int len)
+static uint32_t crc32_bytes(uint32_t crc, const unsigned char *buf, size_t len)
 {
-	const unsigned char *buf = _buf;
+	for (; len; len--)
+		crc = crc_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
 
-	crc = crc ^ 0xffffffffL;
-	while (len >= 8) {
-		DO8(buf);
+	return crc;
+}
+
+static uint32_t crc32_sw(uint32_t crc, const unsigned char *buf, size_t len)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	uint32_t v[4];
+
+	for (; len && ((uintptr_t)buf & 3); len--)
+		crc = crc_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+
+	for (; len >= 16; len -= 16, buf += 16) {
+		memcpy(v, buf, sizeof(v));
+		v[0] ^= crc;
+		crc = crc_slice[15][v[0] & 0xff] ^
+		      crc_slice[14][(v[0] >> 8) & 0xff] ^
+		      crc_slice[13][(v[0] >> 16) & 0xff] ^
+		      crc_slice[12][v[0] >> 24] ^
+		      crc_slice[11][v[1] & 0xff] ^
+		      crc_slice[10][(v[1] >> 8) & 0xff] ^
+		      crc_slice[9][(v[1] >> 16) & 0xff] ^
+		      crc_slice[8][v[1] >> 24] ^
+		      crc_slice[7][v[2] & 0xff] ^
+		      crc_slice[6][(v[2] >> 8) & 0xff] ^
+		      crc_slice[5][(v[2] >> 16) & 0xff] ^
+		      crc_slice[4][v[2] >> 24] ^
+		      crc_slice[3][v[3] & 0xff] ^
+		      crc_slice[2][(v[3] >> 8) & 0xff] ^
+		      crc_slice[1][(v[3] >> 16) & 0xff] ^
+		      crc_slice[0][v[3] >> 24];
+	}
+
+	if (len >= 8) {
+		memcpy(v, buf, 8);
+		v[0] ^= crc;
+		crc = crc_slice[7][v[0] & 0xff] ^
+		      crc_slice[6][(v[0] >> 8) & 0xff] ^
+		      crc_slice[5][(v[0] >> 16) & 0xff] ^
+		      crc_slice[4][v[0] >> 24] ^
+		      crc_slice[3][v[1] & 0xff] ^
+		      crc_slice[2][(v[1] >> 8) & 0xff] ^
+		      crc_slice[1][(v[1] >> 16) & 0xff] ^
+		      crc_slice[0][v[1] >> 24];
+		buf += 8;
 		len -= 8;
 	}
+#endif
+
+	return crc32_bytes(crc, buf, len);
+}
 
-	if (len) do {
-		DO1(buf);
-	} while (--len);
+#if defined(__x86_64__)
+#include <immintrin.h>
 
-	return crc ^ 0xffffffffL;
+/*
+ * Folds 64 bytes at a time with carry-less multiplications and reduces the
+ * result with Barrett reduction, as described in "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction" by Intel. The constants
+ * are those of the bit-reflected CRC-32 polynomial given in the paper.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_hw(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	static const uint64_t __attribute__((aligned(16))) k1k2[] = {
+		0x0154442bd4, 0x01c6e41596 };
+	static const uint64_t __attribute__((aligned(16))) k3k4[] = {
+		0x01751997d0, 0x00ccaa009e };
+	static const uint64_t __attribute__((aligned(16))) k5k0[] = {
+		0x0163cd6124, 0x0000000000 };
+	static const uint64_t __attribute__((aligned(16))) poly[] = {
+		0x01db710641, 0x01f7011641 };
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+	size_t tail;
+
+	if (len < 64)
+		return crc32_sw(crc, buf, len);
+
+	tail = len & 15;
+	len -= tail;
+
+	x1 = _mm_loadu_si128((const __m128i *)(buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_load_si128((const __m128i *)k1k2);
+	buf += 64;
+	len -= 64;
+
+	/* Fold four blocks of 16 bytes in parallel */
+	for (; len >= 64; len -= 64, buf += 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+			_mm_loadu_si128((const __m128i *)(buf + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+			_mm_loadu_si128((const __m128i *)(buf + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+			_mm_loadu_si128((const __m128i *)(buf + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+			_mm_loadu_si128((const __m128i *)(buf + 0x30)));
+	}
+
+	/* Fold the four blocks into one */
+	x0 = _mm_load_si128((const __m128i *)k3k4);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	/* Fold the remaining blocks of 16 bytes */
+	for (; len >= 16; len -= 16, buf += 16) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+			_mm_loadu_si128((const __m128i *)buf));
+	}
+
+	/* Fold 128 to 64 bits */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+
+	x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduction to 32 bits */
+	x0 = _mm_load_si128((const __m128i *)poly);
+
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	crc = _mm_extract_epi32(x1, 1);
+
+	return crc32_sw(crc, buf, tail);
+}
+
+static int crc32_hw_available(void)
+{
+	__builtin_cpu_init();
+
+	return __builtin_cpu_supports("pclmul") &&
+	       __builtin_cpu_supports("sse4.1");
+}
+#elif defined(__aarch64__) && defined(HWCAP_CRC32)
+TARGET_CRC
+static uint32_t crc32_hw(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	for (; len && ((uintptr_t)buf & 7); len--)
+		crc = __crc32b(crc, *buf++);
+
+	for (; len >= 8; len -= 8, buf += 8) {
+		uint64_t v;
+
+		memcpy(&v, buf, sizeof(v));
+		crc = __crc32d(crc, v);
+	}
+
+	for (; len; len--)
+		crc = __crc32b(crc, *buf++);
+
+	return crc;
+}
+
+static int crc32_hw_available(void)
+{
+	return !!(getauxval(AT_HWCAP) & HWCAP_CRC32);
+}
+#else
+#define crc32_hw		crc32_sw
+
+static int crc32_hw_available(void)
+{
+	return 0;
+}
+#endif
+
+/* Byte by byte until the slice tables are built */
+static uint32_t (*crc32_impl)(uint32_t crc, const unsigned char *buf,
+			      size_t len) = crc32_bytes;
+
+/* Reversed polynomial 0x04c11db7 */
+#define CRC32_POLY	0xedb88320
+
+/* x^(2^n) modulo the polynomial, for skipping over 2^n bits of zeros */
+static uint32_t crc_x2n[32];
+
+/*
+ * Returns a * b modulo the polynomial. Like the CRC itself, the polynomials
+ * are bit reversed, the highest bit holds x^0. a must not be zero.
+ */
+static uint32_t crc32_multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = 1U << 31, p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if (!(a & (m - 1)))
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ CRC32_POLY : b >> 1;
+	}
+
+	return p;
+}
+
+/* Returns x^(n * 2^k) modulo the polynomial */
+static uint32_t crc32_x2nmodp(size_t n, unsigned int k)
+{
+	uint32_t p = 1U << 31;
+
+	for (; n; n >>= 1, k++)
+		if (n & 1)
+			p = crc32_multmodp(crc_x2n[k & 31], p);
+
+	return p;
+}
+
+static void crc32_init(void)
+{
+	unsigned int i, k;
+	uint32_t p;
+
+	for (i = 0, p = 1U << 30; i < 32; i++) {
+		crc_x2n[i] = p;
+		p = crc32_multmodp(p, p);
+	}
+
+	for (i = 0; i < 256; i++) {
+		crc_slice[0][i] = crc_table[i];
+		for (k = 1; k < 16; k++)
+			crc_slice[k][i] = crc_table[crc_slice[k - 1][i] & 0xff] ^
+					  (crc_slice[k - 1][i] >> 8);
+	}
+
+	crc32_impl = crc32_hw_available() ? crc32_hw : crc32_sw;
+}
+core_initcall(crc32_init);
+
+/* ========================================================================= */
+uint32_t crc32(uint32_t crc, const void *_buf, unsigned int len)
+{
+	return crc32_impl(crc ^ 0xffffffffL, _buf, len) ^ 0xffffffffL;
 }
 
 /* No ones complement version. JFFS2 (and other things ?)
@@ -98,16 +377,87 @@ uint32_t crc32(uint32_t crc, const void *_buf, unsigned int len)
  */
 uint32_t crc32_no_comp(uint32_t crc, const void *_buf, unsigned int len)
 {
+	return crc32_impl(crc, _buf, len);
+}
+
+/*
+ * Returns the CRC of two concatenated buffers from the CRC of the first, @crc1,
+ * the CRC of the second, @crc2, and the length of the second, @len2. As the
+ * ones complements of the start and end value cancel out, this is the same
+ * for crc32() and crc32_no_comp(), with @crc2 computed starting from 0.
+ */
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2)
+{
+	return crc32_multmodp(crc32_x2nmodp(len2, 3), crc1) ^ crc2;
+}
+
+uint32_t crc32_combine_no_comp(uint32_t crc1, uint32_t crc2, size_t len2)
+{
+	return crc32_combine(crc1, crc2, len2);
+}
+
+/* Smallest part worth a thread of its own, and the most threads used */
+#define CRC32_PARALLEL_MIN	(1024 * 1024)
+#define CRC32_PARALLEL_MAX	16
+
+struct crc32_part {
+	pthread_t thread;
+	const unsigned char *buf;
+	size_t len;
+	uint32_t crc;
+	bool threaded;
+};
+
+static void *crc32_part_run(void *data)
+{
+	struct crc32_part *part = data;
+
+	part->crc = crc32_impl(part->crc, part->buf, part->len);
+
+	return NULL;
+}
+
+/*
+ * Same as crc32(), but splits large buffers into parts that are checksummed
+ * by one thread each and combined afterwards. Parts for which no thread could
+ * be started are checksummed by the calling thread.
+ */
+uint32_t crc32_parallel(uint32_t crc, const void *_buf, size_t len)
+{
+	struct crc32_part part[CRC32_PARALLEL_MAX];
 	const unsigned char *buf = _buf;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t n, i, size;
 
-	while (len >= 8) {
-		DO8(buf);
-		len -= 8;
+	n = len / CRC32_PARALLEL_MIN;
+	if (cpus > 0 && n > cpus)
+		n = cpus;
+	if (n > CRC32_PARALLEL_MAX)
+		n = CRC32_PARALLEL_MAX;
+	if (n < 2)
+		return crc32_impl(crc ^ 0xffffffffL, buf, len) ^ 0xffffffffL;
+
+	size = len / n;
+	for (i = 0; i < n; i++) {
+		part[i].buf = buf + i * size;
+		part[i].len = i == n - 1 ? len - i * size : size;
+		part[i].crc = 0;
+		part[i].threaded = i &&
+			!pthread_create(&part[i].thread, NULL, crc32_part_run,
+					&part[i]);
 	}
 
-	if (len) do {
-		DO1(buf);
-	} while (--len);
+	part[0].crc = crc ^ 0xffffffffL;
+	for (i = 0; i < n; i++) {
+		if (part[i].threaded)
+			pthread_join(part[i].thread, NULL);
+		else
+			crc32_part_run(&part[i]);
+	}
 
-	return crc;
+	crc = part[0].crc;
+	for (i = 1; i < n; i++)
+		crc = crc32_combine(crc, part[i].crc, part[i].len);
+
+	return crc ^ 0xffffffffL;
 }
@@ -0,0 +1,173 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * CRC-32C (Castagnoli), as used by iSCSI, ext4 and btrfs.
+ *
+ * The checksum is computed with the crc32 instructions of SSE4.2 on x86 and
+ * of the CRC extension on ARMv8 if the CPU has them. Otherwise a slice-by-8
+ * table implementation processes eight bytes per step.
+ */
+
+#include <dt/common.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+
+/* GCC and clang spell the CRC extension differently */
+#ifdef __clang__
+#define TARGET_CRC	__attribute__((target("crc")))
+#else
+#define TARGET_CRC	__attribute__((target("+crc")))
+#endif
+#endif
+
+/* Reversed polynomial 0x1edc6f41 */
+#define CRC32C_POLY	0x82f63b78
+
+static uint32_t crc32c_table[8][256];
+
+/* Bit by bit, needs no table */
+static uint32_t crc32c_bits(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	unsigned int i;
+
+	for (; len; len--) {
+		crc ^= *buf++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+	}
+
+	return crc;
+}
+
+/* Bit by bit until the tables are built */
+static uint32_t (*crc32c_impl)(uint32_t crc, const unsigned char *buf,
+			       size_t len) = crc32c_bits;
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *buf, size_t len)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	uint64_t v;
+
+	for (; len && ((uintptr_t)buf & 7); len--)
+		crc = crc32c_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+
+	for (; len >= 8; len -= 8, buf += 8) {
+		memcpy(&v, buf, sizeof(v));
+		v ^= crc;
+		crc = crc32c_table[7][v & 0xff] ^
+		      crc32c_table[6][(v >> 8) & 0xff] ^
+		      crc32c_table[5][(v >> 16) & 0xff] ^
+		      crc32c_table[4][(v >> 24) & 0xff] ^
+		      crc32c_table[3][(v >> 32) & 0xff] ^
+		      crc32c_table[2][(v >> 40) & 0xff] ^
+		      crc32c_table[1][(v >> 48) & 0xff] ^
+		      crc32c_table[0][v >> 56];
+	}
+#endif
+
+	for (; len; len--)
+		crc = crc32c_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	for (; len && ((uintptr_t)buf & 7); len--)
+		crc = __builtin_ia32_crc32qi(crc, *buf++);
+
+#if defined(__x86_64__)
+	for (; len >= 8; len -= 8, buf += 8) {
+		uint64_t v;
+
+		memcpy(&v, buf, sizeof(v));
+		crc = __builtin_ia32_crc32di(crc, v);
+	}
+#endif
+
+	for (; len >= 4; len -= 4, buf += 4) {
+		uint32_t v;
+
+		memcpy(&v, buf, sizeof(v));
+		crc = __builtin_ia32_crc32si(crc, v);
+	}
+
+	for (; len; len--)
+		crc = __builtin_ia32_crc32qi(crc, *buf++);
+
+	return crc;
+}
+
+static int crc32c_hw_available(void)
+{
+	__builtin_cpu_init();
+
+	return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__) && defined(HWCAP_CRC32)
+TARGET_CRC
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	for (; len && ((uintptr_t)buf & 7); len--)
+		crc = __crc32cb(crc, *buf++);
+
+	for (; len >= 8; len -= 8, buf += 8) {
+		uint64_t v;
+
+		memcpy(&v, buf, sizeof(v));
+		crc = __crc32cd(crc, v);
+	}
+
+	for (; len; len--)
+		crc = __crc32cb(crc, *buf++);
+
+	return crc;
+}
+
+static int crc32c_hw_available(void)
+{
+	return !!(getauxval(AT_HWCAP) & HWCAP_CRC32);
+}
+#else
+#define crc32c_hw		crc32c_sw
+
+static int crc32c_hw_available(void)
+{
+	return 0;
+}
+#endif
+
+static void crc32c_init(void)
+{
+	uint32_t crc;
+	unsigned int i, j;
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		crc32c_table[0][i] = crc;
+	}
+
+	for (i = 0; i < 256; i++) {
+		crc = crc32c_table[0][i];
+		for (j = 1; j < 8; j++) {
+			crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+			crc32c_table[j][i] = crc;
+		}
+	}
+
+	crc32c_impl = crc32c_hw_available() ? crc32c_hw : crc32c_sw;
+}
+core_initcall(crc32c_init);
+
+uint32_t crc32c(uint32_t crc, const void *buf, unsigned int len)
+{
+	return ~crc32c_impl(~crc, buf, len);
+}
@@ -46,15 +46,24 @@ static int digest_hmac_alloc(struct digest *d)
 	dh->ipad = xmalloc(hmac->pad_length);
 	dh->opad = xmalloc(hmac->pad_length);
 
+	/* The pads of an empty key, until a key is set */
+	memset(dh->ipad, 0x36, hmac->pad_length);
+	memset(dh->opad, 0x5C, hmac->pad_length);
+
 	return 0;
 }
 
 static void digest_hmac_free(struct digest *d)
 {
 	struct digest_hmac_ctx *dh = d->ctx;
+	struct digest_hmac *hmac = to_digest_hmac(d->algo);
 
+	explicit_bzero(dh->ipad, hmac->pad_length);
+	explicit_bzero(dh->opad, hmac->pad_length);
 	free(dh->ipad);
 	free(dh->opad);
+	if (dh->key)
+		explicit_bzero(dh->key, dh->keylen);
 	free(dh->key);
 
 	digest_free(dh->d);
@@ -66,44 +75,48 @@ static int digest_hmac_set_key(struct digest *d, const unsigned char *key,
 	struct digest_hmac_ctx *dh = d->ctx;
 	struct digest_hmac *hmac = to_digest_hmac(d->algo);
 	unsigned char *sum = NULL;
-	int ret;
+	int i, ret;
 
-	free(dh->key);
 	if (len > hmac->pad_length) {
 		sum = xmalloc(digest_length(dh->d));
-		ret = digest_digest(dh->d, dh->key, dh->keylen, sum);
-		if (ret)
-			goto err;
-		dh->keylen = digest_length(dh->d);
-		dh->key = sum;
-	} else {
-		dh->key = xmalloc(len);
-		memcpy(dh->key, key, len);
-		dh->keylen = len;
+		ret = digest_digest(dh->d, key, len, sum);
+		if (ret) {
+			free(sum);
+			return ret;
+		}
+		key = sum;
+		len = digest_length(dh->d);
 	}
 
-	ret = 0;
-err:
-	free(sum);
-	return ret;
-}
+	if (dh->key)
+		explicit_bzero(dh->key, dh->keylen);
+	free(dh->key);
+	dh->key = xmemdup(key, len);
+	dh->keylen = len;
 
-static int digest_hmac_init(struct digest *d)
-{
-	struct digest_hmac_ctx *dh = d->ctx;
-	struct digest_hmac *hmac = to_digest_hmac(d->algo);
-	int i, ret;
-	unsigned char *key = dh->key;
-	unsigned int keylen = dh->keylen;
+	if (sum) {
+		explicit_bzero(sum, len);
+		free(sum);
+	}
 
+	/* The pads only depend on the key, every init reuses them */
 	memset(dh->ipad, 0x36, hmac->pad_length);
 	memset(dh->opad, 0x5C, hmac->pad_length);
 
-	for (i = 0; i < keylen; i++) {
-		dh->ipad[i] = (unsigned char)(dh->ipad[i] ^ key[i]);
-		dh->opad[i] = (unsigned char)(dh->opad[i] ^ key[i]);
+	for (i = 0; i < dh->keylen; i++) {
+		dh->ipad[i] = (unsigned char)(dh->ipad[i] ^ dh->key[i]);
+		dh->opad[i] = (unsigned char)(dh->opad[i] ^ dh->key[i]);
 	}
 
+	return 0;
+}
+
+static int digest_hmac_init(struct digest *d)
+{
+	struct digest_hmac_ctx *dh = d->ctx;
+	struct digest_hmac *hmac = to_digest_hmac(d->algo);
+	int ret;
+
 	ret = digest_init(dh->d);
 	if (ret)
 		return ret;
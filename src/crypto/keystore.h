@@ -17,6 +17,10 @@
 #ifndef __KEYSTORE_H
 #define __KEYSTORE_H
 
+/*
+ * The key stays owned by the keystore. It is fetched once per process and
+ * wiped from memory when the process exits.
+ */
 int keystore_get_secret(const char *name, const unsigned char **key, int *key_len);
 
 #endif
@@ -636,6 +636,10 @@ static inline __u32 ror32(__u32 word, unsigned int shift)
 
 uint32_t crc32(uint32_t crc, const void *_buf, unsigned int len);
 uint32_t crc32_no_comp(uint32_t crc, const void *_buf, unsigned int len);
+uint32_t crc32c(uint32_t crc, const void *buf, unsigned int len);
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, size_t len2);
+uint32_t crc32_combine_no_comp(uint32_t crc1, uint32_t crc2, size_t len2);
+uint32_t crc32_parallel(uint32_t crc, const void *_buf, size_t len);
 
 static inline int flush(int fd)
 {
@@ -0,0 +1,88 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/* Copyright 2013-2023 The DT-Utils Authors <oss-tools@pengutronix.de> */
+
+#ifndef __DT_LIBBAREBOX_STATE_H
+#define __DT_LIBBAREBOX_STATE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * libbarebox-state - access barebox state variables from applications
+ *
+ * A state is opened once and kept in memory. The variables are read and
+ * modified in memory, barebox_state_save() writes all changes at once. The
+ * per-state lock shared with the barebox-state tool is only held while the
+ * storage is accessed, i.e. during barebox_state_open(), barebox_state_load()
+ * and barebox_state_save(). Read-only states share it with other readers.
+ *
+ * All functions return 0 or a pointer on success and a negative errno value
+ * or NULL on failure. The functions are not thread safe.
+ */
+
+struct barebox_state;
+
+enum barebox_state_flags {
+	/* Do not allow saving, the storage is opened read-only */
+	BAREBOX_STATE_READONLY		= (1 << 0),
+	/* Do not check the HMAC of the stored data */
+	BAREBOX_STATE_NO_AUTHENTICATION	= (1 << 1),
+};
+
+/*
+ * Opens the state @name ("state" if NULL) described in the devicetree file
+ * @dtb, or in the system devicetree if NULL, and loads it from its storage.
+ * If no valid data is found, the state holds the default values.
+ */
+int barebox_state_open(struct barebox_state **bs, const char *name,
+		       const char *dtb, unsigned int flags);
+void barebox_state_close(struct barebox_state *bs);
+
+/*
+ * Loads the state again, discarding unsaved changes. The storage is only read
+ * again if it was written since, unchanged data is kept in memory.
+ */
+int barebox_state_load(struct barebox_state *bs);
+/*
+ * Writes the state to its storage if any variable was changed. Fails with
+ * -ESTALE if someone else wrote the storage since the state was last loaded
+ * or saved. Load it and apply the changes again then.
+ */
+int barebox_state_save(struct barebox_state *bs);
+/* Erases the storage used by the next save, if enabled in the devicetree */
+int barebox_state_pre_erase(struct barebox_state *bs);
+
+/*
+ * Typed access to a variable. uint8, uint32 and enum32 variables are accessed
+ * as integers, enum32 variables by the index of their value.
+ * -ENOENT is returned for unknown variables, -EINVAL for a wrong type.
+ */
+int barebox_state_get_u32(struct barebox_state *bs, const char *var,
+			  uint32_t *val);
+int barebox_state_set_u32(struct barebox_state *bs, const char *var,
+			  uint32_t val);
+int barebox_state_get_mac(struct barebox_state *bs, const char *var,
+			  uint8_t mac[6]);
+int barebox_state_set_mac(struct barebox_state *bs, const char *var,
+			  const uint8_t mac[6]);
+/* The returned string has to be freed by the caller */
+char *barebox_state_get_string(struct barebox_state *bs, const char *var);
+int barebox_state_set_string(struct barebox_state *bs, const char *var,
+			     const char *val);
+
+/*
+ * Access to any variable in the text format of the barebox-state tool. The
+ * returned string has to be freed by the caller.
+ */
+char *barebox_state_get(struct barebox_state *bs, const char *var);
+int barebox_state_set(struct barebox_state *bs, const char *var,
+		      const char *val);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DT_LIBBAREBOX_STATE_H */
@@ -254,6 +254,13 @@ static inline int dt_add_string(struct fdt *fdt, const char *str)
 	uint32_t ret;
 	int len;
 
+	/* Property names repeat a lot, store each one only once */
+	for (ret = 0; ret < fdt->str_nextofs;
+	     ret += strlen(fdt->strings + ret) + 1) {
+		if (!strcmp(fdt->strings + ret, str))
+			return ret;
+	}
+
 	if (fdt_ensure_space(fdt, 0) < 0)
 		return -ENOMEM;
 
@@ -8,93 +8,253 @@
  */
 
 #include <common.h>
+#include <linux/keyctl.h>
+#include <sys/syscall.h>
 #include <crypto/keystore.h>
 #include <base64.h>
 #include <barebox-state.h>
 #include <state.h>
 
 static const char keystore_state_name[] = "/blobs";
-static const char blob_gen_payload[] = "/sys/bus/platform/devices/blob_gen/payload";
-static const char blob_gen_modifier[] = "/sys/bus/platform/devices/blob_gen/modifier";
-static const char blob_gen_blob[] = "/sys/bus/platform/devices/blob_gen/blob";
+static const char blob_gen_dir[] = "/sys/bus/platform/devices/blob_gen";
 
 static struct state *state;
 
-int keystore_get_secret(const char *name, const unsigned char **key, int *key_len)
+/*
+ * Secrets unwrapped so far. Unwrapping goes through the hardware, so each
+ * secret is only unwrapped once per process and kept until it exits.
+ */
+struct keystore_secret {
+	struct list_head list;
+	char *name;
+	unsigned char *key;
+	int key_len;
+};
+
+static LIST_HEAD(keystore_secrets);
+
+static void keystore_forget_secrets(void)
 {
-	FILE *fp;
-	char *blob, *payload;
-	u8 *blob_bin, *payload_bin;
-	ssize_t len;
-	int fd, ret;
+	struct keystore_secret *secret, *tmp;
 
-	if (!state) {
-		struct state *tmp;
+	list_for_each_entry_safe(secret, tmp, &keystore_secrets, list) {
+		list_del(&secret->list);
+		explicit_bzero(secret->key, secret->key_len);
+		free(secret->key);
+		free(secret->name);
+		free(secret);
+	}
+}
 
-		tmp = state_get(keystore_state_name, NULL, true, false);
-		if (IS_ERR(tmp))
-			return  PTR_ERR(tmp);
-		state = tmp;
+/*
+ * With CONFIG_KEYSTORE_KEYRING_TIMEOUT set, unwrapped secrets are also kept in
+ * the session keyring for that many seconds, so that later processes skip the
+ * hardware. Only possessors of the key may view, read and search for it. The
+ * description contains a checksum of the blob, a changed blob is unwrapped
+ * again instead of using the key of the old one.
+ */
+#define KEY_POS_VIEW	0x01000000
+#define KEY_POS_READ	0x02000000
+#define KEY_POS_SEARCH	0x08000000
+
+static char *keystore_keyring_desc(const char *name, const char *blob)
+{
+	return basprintf("dt-utils:keystore:%s:%08x", name,
+			 crc32c(0, blob, strlen(blob)));
+}
+
+static int keystore_keyring_read(const char *desc, unsigned char **key,
+				 int *key_len)
+{
+	unsigned char *buf = NULL;
+	long id, len, size = 0;
+
+	id = syscall(SYS_keyctl, KEYCTL_SEARCH, KEY_SPEC_SESSION_KEYRING,
+		     "user", desc, 0);
+	if (id < 0)
+		return -errno;
+
+	/* The key may be updated in between, read until it fits */
+	do {
+		if (buf) {
+			explicit_bzero(buf, size);
+			free(buf);
+		}
+		size = size ? len : 64;
+		buf = xmalloc(size);
+		len = syscall(SYS_keyctl, KEYCTL_READ, id, buf, size);
+	} while (len > size);
+
+	if (len < 0) {
+		len = -errno;
+		explicit_bzero(buf, size);
+		free(buf);
+		return len;
 	}
 
-	/* modifier */
-	fp = fopen(blob_gen_modifier, "w");
-	if (!fp)
+	*key = buf;
+	*key_len = len;
+
+	return 0;
+}
+
+static void keystore_keyring_add(const char *desc, const unsigned char *key,
+				 int key_len)
+{
+	long keyring, id;
+
+	/*
+	 * Without a session keyring, resolving the session keyring for adding
+	 * a key would create one for this process only. Resolve it without
+	 * creating one, which joins the user session keyring in that case.
+	 */
+	keyring = syscall(SYS_keyctl, KEYCTL_GET_KEYRING_ID,
+			  KEY_SPEC_SESSION_KEYRING, 0);
+	if (keyring < 0) {
+		pr_debug("No keyring to add key '%s' to: %s\n", desc,
+			 strerror(errno));
+		return;
+	}
+
+	id = syscall(SYS_add_key, "user", desc, key, key_len, keyring);
+	if (id < 0) {
+		pr_debug("Could not add key '%s' to the keyring: %s\n", desc,
+			 strerror(errno));
+		return;
+	}
+
+	/* Possessors may only view, read and search for the key afterwards */
+	if (syscall(SYS_keyctl, KEYCTL_SET_TIMEOUT, id,
+		    CONFIG_KEYSTORE_KEYRING_TIMEOUT) ||
+	    syscall(SYS_keyctl, KEYCTL_SETPERM, id,
+		    KEY_POS_VIEW | KEY_POS_READ | KEY_POS_SEARCH)) {
+		pr_debug("Could not restrict key '%s': %s\n", desc,
+			 strerror(errno));
+		syscall(SYS_keyctl, KEYCTL_INVALIDATE, id);
+	}
+}
+
+/* The sysfs directory of the blob generator, overridable in test builds */
+static const char *keystore_blob_gen_dir(void)
+{
+	const char *dir;
+
+	if (IS_ENABLED(CONFIG_TEST_BLOB_GEN)) {
+		dir = getenv("DT_UTILS_BLOB_GEN");
+		if (dir)
+			return dir;
+	}
+
+	return blob_gen_dir;
+}
+
+static int keystore_write_file(const char *file, const void *buf, size_t len)
+{
+	char *path;
+	ssize_t ret;
+	int fd;
+
+	path = basprintf("%s/%s", keystore_blob_gen_dir(), file);
+	fd = open(path, O_WRONLY);
+	free(path);
+	if (fd < 0)
 		return -errno;
 
-	ret = fprintf(fp, "user:%s", name);
-	if (ret < 0) {
-		fclose(fp);
+	ret = write(fd, buf, len);
+	if (ret != len) {
+		ret = ret < 0 ? -errno : -EIO;
+		close(fd);
 		return ret;
 	}
 
-	ret = fclose(fp);
-	if (ret == EOF)
+	if (close(fd))
 		return -errno;
 
+	return 0;
+}
 
-	/* blob */
-	blob = state_get_var(state, name);
-	if (!blob)
+static int keystore_get_blob(const char *name, char **blob)
+{
+	struct device_node *root, *node;
+
+	if (!state) {
+		struct state *tmp;
+
+		/*
+		 * Look in the devicetree of the states if one was read. The
+		 * state is kept, so is its reference to the devicetree.
+		 */
+		root = state_get_devicetree();
+		if (root) {
+			node = state_find_node(root, keystore_state_name);
+			tmp = IS_ERR(node) ? ERR_CAST(node) :
+			      state_get_node(node, true, false, NULL);
+			if (IS_ERR(tmp))
+				state_put_devicetree();
+		} else {
+			tmp = state_get(keystore_state_name, NULL, true, false,
+					NULL);
+		}
+		if (IS_ERR(tmp))
+			return  PTR_ERR(tmp);
+		state = tmp;
+	}
+
+	*blob = state_get_var(state, name);
+	if (!*blob)
 		return -ENOENT;
 
+	return 0;
+}
+
+static int keystore_unwrap_secret(const char *name, const char *blob,
+				  unsigned char **key, int *key_len)
+{
+	char *modifier, *payload, *path;
+	u8 *blob_bin, *payload_bin;
+	ssize_t len, payload_len;
+	int fd, ret;
+
+	/* modifier */
+	modifier = basprintf("user:%s", name);
+	ret = keystore_write_file("modifier", modifier, strlen(modifier));
+	free(modifier);
+	if (ret)
+		return ret;
+
+	/* blob */
 	len = strlen(blob) + 1;
 	blob_bin = xzalloc(len);
 	len = decode_base64(blob_bin, len, blob);
-	free(blob);
-
-	fd = open(blob_gen_blob, O_WRONLY);
-	if (fd < 0) {
-		free(blob_bin);
-		return -errno;
-	}
 
-	ret = write(fd, blob_bin, len);
+	ret = keystore_write_file("blob", blob_bin, len);
 	free(blob_bin);
-	if (ret != len) {
-		return -errno;
-	}
-
-	ret = close(fd);
 	if (ret)
-		return -errno;
-
+		return ret;
 
 	/* payload */
-	fd = open(blob_gen_payload, O_RDONLY);
+	path = basprintf("%s/payload", keystore_blob_gen_dir());
+	fd = open(path, O_RDONLY);
+	free(path);
 	if (fd < 0)
 		return -errno;
-
-	payload = xzalloc(len);
-	len = read(fd, payload, len);
+	/*
+	 * The payload is shorter than its blob, its base64 encoding fits into
+	 * 4/3 of the blob plus padding and the terminating zero.
+	 */
+	len = len * 4 / 3 + 4;
+	payload = xzalloc(len + 1);
+	payload_len = read(fd, payload, len);
 	close(fd);
-	if (len <= 0) {
+	if (payload_len <= 0) {
+		ret = payload_len ? -errno : -ENODATA;
 		free(payload);
-		return -errno;
+		return ret;
 	}
 
-	payload_bin = xzalloc(len);
-	len = decode_base64(payload_bin, len, payload);
+	payload_bin = xzalloc(payload_len);
+	len = decode_base64(payload_bin, payload_len, payload);
+	explicit_bzero(payload, payload_len);
 	free(payload);
 
 	*key = payload_bin;
@@ -102,3 +262,52 @@ int keystore_get_secret(const char *name, const unsigned char **key, int *key_le
 
 	return 0;
 }
+
+int keystore_get_secret(const char *name, const unsigned char **key, int *key_len)
+{
+	struct keystore_secret *secret;
+	unsigned char *payload = NULL;
+	char *blob = NULL, *desc = NULL;
+	int len = 0, ret;
+
+	list_for_each_entry(secret, &keystore_secrets, list) {
+		if (!strcmp(secret->name, name))
+			goto out;
+	}
+
+	ret = keystore_get_blob(name, &blob);
+	if (ret)
+		return ret;
+
+	if (CONFIG_KEYSTORE_KEYRING_TIMEOUT) {
+		desc = keystore_keyring_desc(name, blob);
+		ret = keystore_keyring_read(desc, &payload, &len);
+	}
+
+	if (!CONFIG_KEYSTORE_KEYRING_TIMEOUT || ret) {
+		ret = keystore_unwrap_secret(name, blob, &payload, &len);
+		if (!ret && desc)
+			keystore_keyring_add(desc, payload, len);
+	}
+
+	free(desc);
+	free(blob);
+	if (ret)
+		return ret;
+
+	/* Wipe the secrets from memory when the process exits */
+	if (list_empty(&keystore_secrets))
+		atexit(keystore_forget_secrets);
+
+	secret = xzalloc(sizeof(*secret));
+	secret->name = xstrdup(name);
+	secret->key = payload;
+	secret->key_len = len;
+	list_add_tail(&secret->list, &keystore_secrets);
+
+out:
+	*key = secret->key;
+	*key_len = secret->key_len;
+
+	return 0;
+}
@@ -0,0 +1,1080 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * libbarebox-state.c - state access shared by the tool and the library
+ *
+ * Copyright (c) 2014 Sascha Hauer <s.hauer@pengutronix.de>, Pengutronix
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2
+ * as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/file.h>
+
+#include <barebox-state/state.h>
+#include <barebox-state.h>
+#include <dt/dt.h>
+#include <dt/libbarebox-state.h>
+#include <state.h>
+
+static int __state_uint8_set(struct state_variable *var, const char *val);
+static int __state_uint32_set(struct state_variable *var, const char *val);
+static char *__state_uint32_get(struct state_variable *var);
+static void __state_uint32_put(struct state_variable *var, FILE *out, bool json);
+static int __state_enum32_set(struct state_variable *sv, const char *val);
+static char *__state_enum32_get(struct state_variable *var);
+static void __state_enum32_put(struct state_variable *var, FILE *out, bool json);
+static void __state_enum32_info(struct state_variable *var, FILE *out);
+static int __state_mac_set(struct state_variable *var, const char *val);
+static char *__state_mac_get(struct state_variable *var);
+static void __state_mac_put(struct state_variable *var, FILE *out, bool json);
+static int __state_string_set(struct state_variable *var, const char *val);
+static char *__state_string_get(struct state_variable *var);
+static void __state_string_put(struct state_variable *var, FILE *out, bool json);
+
+/* Indexed by the variable type */
+static struct variable_str_type types[] =  {
+	[STATE_VARIABLE_TYPE_UINT8] = {
+		.type = STATE_VARIABLE_TYPE_UINT8,
+		.type_name = "uint8",
+		.set = __state_uint8_set,
+		.get = __state_uint32_get,
+		.put = __state_uint32_put,
+	},
+	[STATE_VARIABLE_TYPE_UINT32] = {
+		.type = STATE_VARIABLE_TYPE_UINT32,
+		.type_name = "uint32",
+		.set = __state_uint32_set,
+		.get = __state_uint32_get,
+		.put = __state_uint32_put,
+	},
+	[STATE_VARIABLE_TYPE_ENUM32] = {
+		.type = STATE_VARIABLE_TYPE_ENUM32,
+		.type_name = "enum32",
+		.set = __state_enum32_set,
+		.get = __state_enum32_get,
+		.put = __state_enum32_put,
+		.info = __state_enum32_info,
+	},
+	[STATE_VARIABLE_TYPE_MAC] = {
+		.type = STATE_VARIABLE_TYPE_MAC,
+		.type_name = "mac",
+		.set = __state_mac_set,
+		.get = __state_mac_get,
+		.put = __state_mac_put,
+	},
+	[STATE_VARIABLE_TYPE_STRING] = {
+		.type = STATE_VARIABLE_TYPE_STRING,
+		.type_name = "string",
+		.set = __state_string_set,
+		.get = __state_string_get,
+		.put = __state_string_put,
+	},
+};
+
+struct variable_str_type *state_find_type(enum state_variable_type type)
+{
+	if (type >= ARRAY_SIZE(types) || !types[type].type_name)
+		return NULL;
+
+	return &types[type];
+}
+
+/* Writes a string as JSON string literal */
+static void state_put_json_string(FILE *out, const char *str, size_t len)
+{
+	size_t i;
+
+	fputc('"', out);
+
+	for (i = 0; i < len; i++) {
+		unsigned char c = str[i];
+
+		if (c == '"' || c == '\\')
+			fprintf(out, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(out, "\\u%04x", c);
+		else
+			fputc(c, out);
+	}
+
+	fputc('"', out);
+}
+
+static void state_put_string(FILE *out, const char *str, size_t len, bool json)
+{
+	if (json)
+		state_put_json_string(out, str, len);
+	else
+		fwrite(str, 1, len, out);
+}
+
+static int __state_uint32_set(struct state_variable *var, const char *val)
+{
+	state_var_set_u32(var, strtoul(val, NULL, 0));
+
+	return 0;
+}
+
+static int __state_uint8_set(struct state_variable *var, const char *val)
+{
+	unsigned long num;
+
+	num = strtoul(val, NULL, 0);
+	if (num > UINT8_MAX)
+		return -ERANGE;
+
+	state_var_set_u32(var, num);
+
+	return 0;
+}
+
+static char *__state_uint32_get(struct state_variable *var)
+{
+	char *str;
+	int ret;
+
+	ret = asprintf(&str, "%u", state_var_get_u32(var));
+	if (ret < 0)
+		return ERR_PTR(-ENOMEM);
+
+	return str;
+}
+
+static void __state_uint32_put(struct state_variable *var, FILE *out, bool json)
+{
+	fprintf(out, "%u", state_var_get_u32(var));
+}
+
+static int __state_enum32_set(struct state_variable *sv, const char *val)
+{
+	struct state_enum32 *enum32 = to_state_enum32(sv);
+	int i;
+
+	for (i = 0; i < enum32->num_names; i++) {
+		if (!strcmp(enum32->names[i], val)) {
+			state_var_set_u32(sv, i);
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+static char *__state_enum32_get(struct state_variable *var)
+{
+	struct state_enum32 *enum32 = to_state_enum32(var);
+	char *str;
+	int ret;
+
+	ret = asprintf(&str, "%s", enum32->names[state_var_get_u32(var)]);
+	if (ret < 0)
+		return ERR_PTR(-ENOMEM);
+
+	return str;
+}
+
+static void __state_enum32_put(struct state_variable *var, FILE *out, bool json)
+{
+	struct state_enum32 *enum32 = to_state_enum32(var);
+	const char *name = enum32->names[state_var_get_u32(var)];
+
+	state_put_string(out, name, strlen(name), json);
+}
+
+static void __state_enum32_info(struct state_variable *var, FILE *out)
+{
+	struct state_enum32 *enum32 = to_state_enum32(var);
+	int i;
+
+	fprintf(out, ", values=[");
+
+	for (i = 0; i < enum32->num_names; i++)
+		fprintf(out, "%s%s", enum32->names[i],
+				i == enum32->num_names - 1 ? "" : ",");
+	fprintf(out, "]");
+}
+
+static int string_to_ethaddr(const char *str, uint8_t enetaddr[6])
+{
+	int reg;
+	char *e;
+
+	if (!str || strlen(str) != 17) {
+		memset(enetaddr, 0, 6);
+		return -EINVAL;
+	}
+
+	if (str[2] != ':' || str[5] != ':' || str[8] != ':' ||
+			str[11] != ':' || str[14] != ':')
+		return -EINVAL;
+
+	for (reg = 0; reg < 6; ++reg) {
+		enetaddr[reg] = strtoul(str, &e, 16);
+		str = e + 1;
+	}
+
+	return 0;
+}
+
+static int __state_mac_set(struct state_variable *var, const char *val)
+{
+	uint8_t mac_save[6];
+	int ret;
+
+	ret = string_to_ethaddr(val, mac_save);
+	if (ret)
+		return ret;
+
+	memcpy(var->raw, mac_save, ARRAY_SIZE(mac_save));
+
+	return 0;
+}
+
+static char *__state_mac_get(struct state_variable *var)
+{
+	const uint8_t *mac = var->raw;
+	char *str;
+	int ret;
+
+	ret = asprintf(&str, "%02x:%02x:%02x:%02x:%02x:%02x",
+			mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+	if (ret < 0)
+		return ERR_PTR(-ENOMEM);
+
+	return str;
+}
+
+static void __state_mac_put(struct state_variable *var, FILE *out, bool json)
+{
+	const uint8_t *mac = var->raw;
+
+	fprintf(out, json ? "\"%02x:%02x:%02x:%02x:%02x:%02x\"" :
+		"%02x:%02x:%02x:%02x:%02x:%02x",
+		mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
+
+static int __state_string_set(struct state_variable *sv, const char *val)
+{
+	struct state_string *string = to_state_string(sv);
+	int ret;
+
+	ret = state_string_copy_to_raw(string, val);
+	if (ret)
+		return ret;
+	free(string->value);
+	string->value = xstrdup(val);
+
+	return 0;
+}
+
+static char *__state_string_get(struct state_variable *var)
+{
+	char *str;
+
+	if (*(char *)var->raw)
+		str = strndup(var->raw, var->size);
+	else
+		str = strdup("");
+
+	if (!str)
+		return ERR_PTR(-ENOMEM);
+
+	return str;
+}
+
+static void __state_string_put(struct state_variable *var, FILE *out, bool json)
+{
+	state_put_string(out, var->raw, strnlen(var->raw, var->size), json);
+}
+
+char *state_get_var(struct state *state, const char *var)
+{
+	struct state_variable *sv;
+	struct variable_str_type *vtype;
+
+	sv = state_find_var(state, var);
+	if (IS_ERR(sv))
+		return NULL;
+
+	vtype = state_find_type(sv->type->type);
+	if (!vtype)
+		return NULL;
+
+	return vtype->get(sv);
+}
+
+int state_set_var(struct state *state, const char *var, const char *val)
+{
+	struct state_variable *sv;
+	struct variable_str_type *vtype;
+	char *oldval;
+	int ret;
+
+	sv = state_find_var(state, var);
+	if (IS_ERR(sv))
+		return PTR_ERR(sv);
+
+	vtype = state_find_type(sv->type->type);
+	if (!vtype)
+		return -ENODEV;
+
+	if (!vtype->set)
+		return -EPERM;
+
+	oldval = vtype->get(sv);
+	if (!IS_ERR(oldval)) {
+		bool equal = strcmp(oldval, val) == 0;
+		free(oldval);
+		if (equal)
+			return 0;
+	}
+
+	ret = vtype->set(sv, val);
+	if (ret)
+		return ret;
+
+	state->dirty = 1;
+
+	return 0;
+}
+
+
+/*
+ * Each state is locked by a lock file named after its backend, so states on
+ * different devices or partitions never contend. Readers share the lock,
+ * writers take it exclusively.
+ *
+ * flock() locks belong to the open file description. A process opening the
+ * same lock file twice, like for "-n state -n /state" or for the keystore
+ * reading /blobs while it is locked for writing, would wait for itself. So
+ * each lock file is opened once per process and shared by all its users. It
+ * is locked exclusively as long as any of them needs it exclusively.
+ */
+struct state_lock_file {
+	char *path;
+	int fd;
+	/* Users of the entry, protected by state_lock_mutex */
+	int users;
+	/* Holders of the lock, protected by mutex */
+	int shared;
+	int exclusive;
+	pthread_mutex_t mutex;
+	struct list_head list;
+};
+
+struct state_lock {
+	struct state_lock_file *file;
+	bool exclusive;
+};
+
+static LIST_HEAD(state_lock_files);
+static pthread_mutex_t state_lock_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct state_lock_file *state_lock_file_get(const char *path)
+{
+	struct state_lock_file *file;
+	int fd;
+
+	pthread_mutex_lock(&state_lock_mutex);
+
+	list_for_each_entry(file, &state_lock_files, list) {
+		if (!strcmp(file->path, path)) {
+			file->users++;
+			goto out;
+		}
+	}
+
+	fd = open(path, O_CREAT | O_RDWR | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		file = ERR_PTR(-errno);
+		pr_err("Failed to open lock-file %s\n", path);
+		goto out;
+	}
+
+	file = xzalloc(sizeof(*file));
+	file->path = xstrdup(path);
+	file->fd = fd;
+	file->users = 1;
+	pthread_mutex_init(&file->mutex, NULL);
+	list_add_tail(&file->list, &state_lock_files);
+out:
+	pthread_mutex_unlock(&state_lock_mutex);
+
+	return file;
+}
+
+static void state_lock_file_put(struct state_lock_file *file)
+{
+	pthread_mutex_lock(&state_lock_mutex);
+
+	if (!--file->users) {
+		list_del(&file->list);
+		close(file->fd);
+		pthread_mutex_destroy(&file->mutex);
+		free(file->path);
+		free(file);
+	}
+
+	pthread_mutex_unlock(&state_lock_mutex);
+}
+
+/*
+ * Locks the state stored at @offset of the backend @path for reading or, if
+ * @exclusive, for writing. The lock is released with state_unlock(). With
+ * CONFIG_LOCK_DEVICE_NODE the backend device node is locked as long as the
+ * state exists instead and *lock is set to NULL.
+ */
+int state_lock_backend(const char *backend, off_t offset, bool exclusive,
+		       struct state_lock **lock)
+{
+	struct state_lock_file *file;
+	char *path, *p;
+	int ret = 0;
+
+	*lock = NULL;
+
+	if (IS_ENABLED(CONFIG_LOCK_DEVICE_NODE))
+		return 0;
+
+	path = basprintf(BAREBOX_STATE_LOCKFILE_PREFIX "%s@%lld.lock",
+			 backend, (long long)offset);
+	for (p = path + strlen(BAREBOX_STATE_LOCKFILE_PREFIX); *p; p++)
+		if (*p == '/')
+			*p = '-';
+
+	file = state_lock_file_get(path);
+	free(path);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+
+	pthread_mutex_lock(&file->mutex);
+
+	/* A shared lock held by other users is converted */
+	if (exclusive && !file->exclusive)
+		ret = flock(file->fd, LOCK_EX);
+	else if (!exclusive && !file->exclusive && !file->shared)
+		ret = flock(file->fd, LOCK_SH);
+
+	if (ret < 0) {
+		ret = -errno;
+		pr_err("Failed to lock %s: %m\n", file->path);
+	} else if (exclusive) {
+		file->exclusive++;
+	} else {
+		file->shared++;
+	}
+
+	pthread_mutex_unlock(&file->mutex);
+
+	if (ret) {
+		state_lock_file_put(file);
+		return ret;
+	}
+
+	*lock = xzalloc(sizeof(**lock));
+	(*lock)->file = file;
+	(*lock)->exclusive = exclusive;
+
+	return 0;
+}
+
+int state_lock(struct state *state, bool exclusive, struct state_lock **lock)
+{
+	return state_lock_backend(state->storage.path, state->storage.offset,
+				  exclusive, lock);
+}
+
+void state_unlock(struct state_lock *lock)
+{
+	struct state_lock_file *file;
+
+	if (!lock)
+		return;
+
+	file = lock->file;
+
+	pthread_mutex_lock(&file->mutex);
+
+	if (lock->exclusive)
+		file->exclusive--;
+	else
+		file->shared--;
+
+	if (!file->exclusive && !file->shared)
+		flock(file->fd, LOCK_UN);
+	else if (lock->exclusive && !file->exclusive)
+		/* Let other readers in if only readers are left */
+		flock(file->fd, LOCK_SH);
+
+	pthread_mutex_unlock(&file->mutex);
+
+	state_lock_file_put(file);
+	free(lock);
+}
+
+/*
+ * Turns the exclusive @lock into a shared one, which lets readers in while
+ * writers still have to wait. Converting cannot conflict with other holders,
+ * so Linux does not release the lock in between.
+ */
+void state_lock_downgrade(struct state_lock *lock)
+{
+	struct state_lock_file *file;
+
+	if (!lock || !lock->exclusive)
+		return;
+
+	file = lock->file;
+
+	pthread_mutex_lock(&file->mutex);
+
+	file->exclusive--;
+	file->shared++;
+	lock->exclusive = false;
+
+	if (!file->exclusive)
+		flock(file->fd, LOCK_SH);
+
+	pthread_mutex_unlock(&file->mutex);
+}
+
+/*
+ * The devicetree the states are created from. The states point into it, so it
+ * is kept as long as any of them exists. It is the root node of libdt, which
+ * only knows one, so states of different devicetrees cannot exist at the same
+ * time.
+ */
+static struct device_node *state_root;
+static char *state_root_filename;
+static int state_root_users;
+static pthread_mutex_t state_root_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct device_node *state_read_devicetree_file(const char *filename)
+{
+	struct device_node *root;
+
+	if (filename) {
+		void *fdt;
+
+		fdt = read_file(filename, NULL);
+		if (!fdt) {
+			pr_err("Unable to read devicetree file '%s'\n",
+			       filename);
+			return ERR_PTR(-ENOENT);
+		}
+
+		root = of_unflatten_dtb(fdt);
+		free(fdt);
+		if (IS_ERR(root)) {
+			pr_err("Unable to read devicetree. %s\n",
+			       strerror(-PTR_ERR(root)));
+			return ERR_CAST(root);
+		}
+	} else {
+		root = of_read_proc_devicetree();
+
+		/* No device-tree in procfs / sysfs, try dtb file in the ESP */
+		if (-PTR_ERR(root) == ENOENT) {
+			const char *paths[] = {
+				/* default mount paths used by systemd */
+				"/boot/EFI/BAREBOX/state.dtb",
+				"/boot/efi/EFI/BAREBOX/state.dtb",
+				"/efi/EFI/BAREBOX/state.dtb",
+				NULL
+			};
+			void *fdt;
+			int i;
+
+			for (i = 0; paths[i]; ++i) {
+				fdt = read_file(paths[i], NULL);
+				if (fdt)
+					break;
+			}
+			if (fdt) {
+				root = of_unflatten_dtb(fdt);
+				free(fdt);
+			}
+			else
+				root = ERR_PTR(-ENOENT);
+		}
+		if (IS_ERR(root)) {
+			pr_err("Unable to read devicetree. %s\n",
+			       strerror(-PTR_ERR(root)));
+			return ERR_CAST(root);
+		}
+	}
+
+	return root;
+}
+
+static bool state_root_matches(const char *filename)
+{
+	if (!filename || !state_root_filename)
+		return filename == state_root_filename;
+
+	return !strcmp(filename, state_root_filename);
+}
+
+/*
+ * Reads the devicetree from @filename, or the system devicetree if NULL, and
+ * makes it the root node. The devicetree read before is returned if it came
+ * from the same file. Each call takes a reference, which is dropped with
+ * state_put_devicetree().
+ */
+struct device_node *state_read_devicetree(const char *filename)
+{
+	struct device_node *root;
+	int ret;
+
+	pthread_mutex_lock(&state_root_mutex);
+
+	if (state_root) {
+		if (!state_root_matches(filename)) {
+			pr_err("Cannot read devicetree %s, states of %s are in use\n",
+			       filename ?: "of the system",
+			       state_root_filename ?: "the system devicetree");
+			root = ERR_PTR(-EBUSY);
+			goto out;
+		}
+
+		root = state_root;
+		state_root_users++;
+		goto out;
+	}
+
+	root = state_read_devicetree_file(filename);
+	if (IS_ERR(root))
+		goto out;
+
+	ret = of_set_root_node(root);
+	if (ret) {
+		pr_err("Cannot make the devicetree the root node: %s\n",
+		       strerror(-ret));
+		of_delete_node(root);
+		root = ERR_PTR(ret);
+		goto out;
+	}
+
+	state_root = root;
+	state_root_filename = filename ? xstrdup(filename) : NULL;
+	state_root_users = 1;
+out:
+	pthread_mutex_unlock(&state_root_mutex);
+
+	return root;
+}
+
+/*
+ * Takes another reference to the devicetree read last, returns NULL if there
+ * is none.
+ */
+struct device_node *state_get_devicetree(void)
+{
+	struct device_node *root;
+
+	pthread_mutex_lock(&state_root_mutex);
+	root = state_root;
+	if (root)
+		state_root_users++;
+	pthread_mutex_unlock(&state_root_mutex);
+
+	return root;
+}
+
+/* Drops a reference to the devicetree, which is freed with the last one */
+void state_put_devicetree(void)
+{
+	pthread_mutex_lock(&state_root_mutex);
+
+	if (!--state_root_users) {
+		/* Also resets the root node */
+		of_delete_node(state_root);
+		state_root = NULL;
+		free(state_root_filename);
+		state_root_filename = NULL;
+	}
+
+	pthread_mutex_unlock(&state_root_mutex);
+}
+
+/* Finds the node of the state @name, the default state if NULL */
+struct device_node *state_find_node(struct device_node *root, const char *name)
+{
+	struct device_node *node;
+
+	if (name) {
+		node = of_find_node_by_path_or_alias(root, name);
+		if (!node) {
+			pr_err("no such node: %s\n", name);
+			return ERR_PTR(-ENOENT);
+		}
+	} else {
+		node = of_find_node_by_path_or_alias(root, "state");
+		if (!node)
+			node = of_find_node_by_path_or_alias(root, "/state");
+		if (!node) {
+			pr_err("Neither /aliases/state nor /state found\n");
+			return ERR_PTR(-ENOENT);
+		}
+	}
+
+	return node;
+}
+
+/*
+ * Creates the state of @node and loads it with the state locked for reading,
+ * or for writing unless @readonly. If @lock is given the lock is kept and
+ * returned there, otherwise it is released once the state is loaded. States
+ * of different nodes may be created in parallel threads.
+ */
+struct state *state_get_node(struct device_node *node, bool readonly,
+			     bool auth, struct state_lock **lock)
+{
+	struct state *state;
+	struct state_lock *held;
+	int ret;
+
+	pr_debug("found state node %s:\n", node->full_name);
+	if (pr_level_get() > 6)
+		of_print_nodes(node, 0);
+
+	state = state_new_from_node(node, readonly, &held);
+	if (IS_ERR(state)) {
+		pr_err("unable to initialize state: %s\n",
+				strerror(-PTR_ERR(state)));
+		return ERR_CAST(state);
+	}
+
+	if (auth)
+		ret = state_load(state);
+	else
+		ret = state_load_no_auth(state);
+
+	if (ret)
+		pr_err("Failed to load persistent state, continuing with defaults, %d\n", ret);
+
+	if (lock)
+		*lock = held;
+	else
+		state_unlock(held);
+
+	return state;
+}
+
+/*
+ * Gets the state @name from the devicetree in @filename, or the system
+ * devicetree if NULL, and loads it as described for state_get_node(). The
+ * state keeps a reference to the devicetree, see state_read_devicetree().
+ */
+struct state *state_get(const char *name, const char *filename, bool readonly,
+			bool auth, struct state_lock **lock)
+{
+	struct device_node *root, *node;
+	struct state *state;
+
+	root = state_read_devicetree(filename);
+	if (IS_ERR(root))
+		return ERR_CAST(root);
+
+	node = state_find_node(root, name);
+	if (IS_ERR(node)) {
+		state_put_devicetree();
+		return ERR_CAST(node);
+	}
+
+	state = state_get_node(node, readonly, auth, lock);
+	if (IS_ERR(state))
+		state_put_devicetree();
+
+	return state;
+}
+
+struct barebox_state {
+	struct state *state;
+	unsigned int flags;
+	/* Generation of the storage when last loaded or saved */
+	uint32_t generation;
+};
+
+int barebox_state_open(struct barebox_state **bs, const char *name,
+		       const char *dtb, unsigned int flags)
+{
+	struct state *state;
+
+	state = state_get(name, dtb, flags & BAREBOX_STATE_READONLY,
+			  !(flags & BAREBOX_STATE_NO_AUTHENTICATION), NULL);
+	if (IS_ERR(state))
+		return PTR_ERR(state);
+
+	*bs = xzalloc(sizeof(**bs));
+	(*bs)->state = state;
+	(*bs)->flags = flags;
+	(*bs)->generation = state->storage.generation;
+
+	return 0;
+}
+
+void barebox_state_close(struct barebox_state *bs)
+{
+	if (!bs)
+		return;
+
+	state_release(bs->state);
+	state_put_devicetree();
+	free(bs);
+}
+
+int barebox_state_load(struct barebox_state *bs)
+{
+	struct state_lock *lock;
+	int ret;
+
+	ret = state_lock(bs->state, !(bs->flags & BAREBOX_STATE_READONLY),
+			 &lock);
+	if (ret)
+		return ret;
+
+	if (bs->flags & BAREBOX_STATE_NO_AUTHENTICATION)
+		ret = state_load_no_auth(bs->state);
+	else
+		ret = state_load(bs->state);
+
+	bs->generation = bs->state->storage.generation;
+
+	state_unlock(lock);
+
+	return ret;
+}
+
+/*
+ * Returns -ESTALE if the storage was written by someone else since @bs was
+ * last loaded or saved. Data without generation cannot tell, it is never
+ * reported as stale. Must be called with the state locked.
+ */
+static int barebox_state_check_stale(struct barebox_state *bs)
+{
+	struct state *state = bs->state;
+	enum state_flags flags = 0;
+	ssize_t len;
+	void *buf;
+
+	if (bs->flags & BAREBOX_STATE_NO_AUTHENTICATION)
+		flags |= STATE_FLAG_NO_AUTHENTICATION;
+
+	/* Without valid data on the storage there is nothing to overwrite */
+	if (state_storage_read(&state->storage, state->format, state->magic,
+			       &buf, &len, flags))
+		return 0;
+
+	free(buf);
+
+	if (state->storage.generation != bs->generation)
+		return -ESTALE;
+
+	return 0;
+}
+
+int barebox_state_save(struct barebox_state *bs)
+{
+	struct state_lock *lock;
+	int ret;
+
+	if (bs->flags & BAREBOX_STATE_READONLY)
+		return -EROFS;
+
+	if (!bs->state->dirty)
+		return 0;
+
+	ret = state_lock(bs->state, true, &lock);
+	if (ret)
+		return ret;
+
+	ret = barebox_state_check_stale(bs);
+	if (!ret)
+		ret = state_save(bs->state);
+	if (!ret)
+		bs->generation = bs->state->storage.generation;
+
+	state_unlock(lock);
+
+	return ret;
+}
+
+int barebox_state_pre_erase(struct barebox_state *bs)
+{
+	struct state_lock *lock;
+	int ret;
+
+	if (bs->flags & BAREBOX_STATE_READONLY)
+		return -EROFS;
+
+	ret = state_lock(bs->state, true, &lock);
+	if (ret)
+		return ret;
+
+	ret = state_pre_erase(bs->state);
+
+	state_unlock(lock);
+
+	return ret;
+}
+
+static struct state_variable *barebox_state_find_var(struct barebox_state *bs,
+						     const char *var)
+{
+	struct state_variable *sv;
+
+	sv = state_find_var(bs->state, var);
+	if (IS_ERR(sv))
+		return ERR_PTR(-ENOENT);
+
+	return sv;
+}
+
+int barebox_state_get_u32(struct barebox_state *bs, const char *var,
+			  uint32_t *val)
+{
+	struct state_variable *sv;
+
+	sv = barebox_state_find_var(bs, var);
+	if (IS_ERR(sv))
+		return PTR_ERR(sv);
+
+	switch (sv->type->type) {
+	case STATE_VARIABLE_TYPE_UINT8:
+	case STATE_VARIABLE_TYPE_UINT32:
+	case STATE_VARIABLE_TYPE_ENUM32:
+		*val = state_var_get_u32(sv);
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+int barebox_state_set_u32(struct barebox_state *bs, const char *var,
+			  uint32_t val)
+{
+	struct state_variable *sv;
+
+	sv = barebox_state_find_var(bs, var);
+	if (IS_ERR(sv))
+		return PTR_ERR(sv);
+
+	switch (sv->type->type) {
+	case STATE_VARIABLE_TYPE_UINT8:
+		if (val > UINT8_MAX)
+			return -ERANGE;
+		/* fall through */
+	case STATE_VARIABLE_TYPE_UINT32:
+		break;
+	case STATE_VARIABLE_TYPE_ENUM32:
+		if (val >= to_state_enum32(sv)->num_names)
+			return -ERANGE;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	if (state_var_get_u32(sv) != val) {
+		state_var_set_u32(sv, val);
+		bs->state->dirty = 1;
+	}
+
+	return 0;
+}
+
+int barebox_state_get_mac(struct barebox_state *bs, const char *var,
+			  uint8_t mac[6])
+{
+	struct state_variable *sv;
+
+	sv = barebox_state_find_var(bs, var);
+	if (IS_ERR(sv))
+		return PTR_ERR(sv);
+
+	if (sv->type->type != STATE_VARIABLE_TYPE_MAC)
+		return -EINVAL;
+
+	memcpy(mac, sv->raw, 6);
+
+	return 0;
+}
+
+int barebox_state_set_mac(struct barebox_state *bs, const char *var,
+			  const uint8_t mac[6])
+{
+	struct state_variable *sv;
+
+	sv = barebox_state_find_var(bs, var);
+	if (IS_ERR(sv))
+		return PTR_ERR(sv);
+
+	if (sv->type->type != STATE_VARIABLE_TYPE_MAC)
+		return -EINVAL;
+
+	if (memcmp(sv->raw, mac, 6)) {
+		memcpy(sv->raw, mac, 6);
+		bs->state->dirty = 1;
+	}
+
+	return 0;
+}
+
+char *barebox_state_get_string(struct barebox_state *bs, const char *var)
+{
+	struct state_variable *sv;
+	char *str;
+
+	sv = barebox_state_find_var(bs, var);
+	if (IS_ERR(sv) || sv->type->type != STATE_VARIABLE_TYPE_STRING)
+		return NULL;
+
+	str = __state_string_get(sv);
+
+	return IS_ERR(str) ? NULL : str;
+}
+
+int barebox_state_set_string(struct barebox_state *bs, const char *var,
+			     const char *val)
+{
+	struct state_variable *sv;
+
+	sv = barebox_state_find_var(bs, var);
+	if (IS_ERR(sv))
+		return PTR_ERR(sv);
+
+	if (sv->type->type != STATE_VARIABLE_TYPE_STRING)
+		return -EINVAL;
+
+	return state_set_var(bs->state, var, val);
+}
+
+char *barebox_state_get(struct barebox_state *bs, const char *var)
+{
+	char *str;
+
+	str = state_get_var(bs->state, var);
+
+	return IS_ERR(str) ? NULL : str;
+}
+
+int barebox_state_set(struct barebox_state *bs, const char *var,
+		      const char *val)
+{
+	return state_set_var(bs->state, var, val);
+}
@@ -0,0 +1,169 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * LZF compression, compatible with the format of liblzf by Marc Lehmann.
+ *
+ * The compressed data is a sequence of literal runs and back references:
+ *
+ *   000LLLLL <L + 1 literal bytes>
+ *   LLLooooo oooooooo             copy L + 2 bytes from o + 1 bytes back
+ *   111ooooo LLLLLLLL oooooooo    copy L + 9 bytes from o + 1 bytes back
+ */
+
+#include <common.h>
+#include <malloc.h>
+#include <lzf.h>
+
+#define LZF_HLOG	13
+#define LZF_MAX_LIT	(1 << 5)
+#define LZF_MAX_OFF	(1 << 13)
+#define LZF_MAX_REF	((1 << 8) + (1 << 3))
+
+static inline unsigned int lzf_hash(const uint8_t *p)
+{
+	uint32_t v = p[0] << 16 | p[1] << 8 | p[2];
+
+	return ((v * 2654435761U) >> (32 - LZF_HLOG)) & ((1 << LZF_HLOG) - 1);
+}
+
+/* Emits the literal run of @len bytes at @lit, returns NULL if out of space */
+static uint8_t *lzf_literals(uint8_t *op, const uint8_t *out_end,
+			     const uint8_t *lit, size_t len)
+{
+	size_t n;
+
+	while (len) {
+		n = min(len, (size_t)LZF_MAX_LIT);
+		if (out_end - op < n + 1)
+			return NULL;
+
+		*op++ = n - 1;
+		memcpy(op, lit, n);
+		op += n;
+		lit += n;
+		len -= n;
+	}
+
+	return op;
+}
+
+/**
+ * lzf_compress - Compresses a buffer
+ * @param in The data to compress
+ * @param in_len Length of the data
+ * @param out Buffer for the compressed data
+ * @param out_len Size of the buffer
+ * @return The length of the compressed data, -ENOSPC if it does not fit
+ */
+ssize_t lzf_compress(const void *in, size_t in_len, void *out, size_t out_len)
+{
+	const uint8_t *ip = in, *in_end = ip + in_len, *lit = ip, *ref;
+	uint8_t *op = out, *out_end = op + out_len;
+	uint32_t *htab;
+	size_t off, len, max;
+	unsigned int h;
+
+	htab = xzalloc(sizeof(*htab) << LZF_HLOG);
+
+	while (in_end - ip > 2) {
+		h = lzf_hash(ip);
+		ref = (const uint8_t *)in + htab[h];
+		htab[h] = ip - (const uint8_t *)in;
+
+		off = ip - ref - 1;
+		if (ref >= ip || off >= LZF_MAX_OFF || memcmp(ref, ip, 3)) {
+			ip++;
+			continue;
+		}
+
+		max = min((size_t)(in_end - ip), (size_t)LZF_MAX_REF);
+		for (len = 3; len < max && ref[len] == ip[len]; len++)
+			;
+
+		op = lzf_literals(op, out_end, lit, ip - lit);
+		if (!op || out_end - op < 3)
+			goto out_nospc;
+
+		len -= 2;
+		if (len < 7) {
+			*op++ = (len << 5) | (off >> 8);
+		} else {
+			*op++ = (7 << 5) | (off >> 8);
+			*op++ = len - 7;
+		}
+		*op++ = off;
+
+		ip += len + 2;
+		lit = ip;
+	}
+
+	op = lzf_literals(op, out_end, lit, in_end - lit);
+	if (!op)
+		goto out_nospc;
+
+	free(htab);
+
+	return op - (uint8_t *)out;
+
+out_nospc:
+	free(htab);
+
+	return -ENOSPC;
+}
+
+/**
+ * lzf_decompress - Decompresses a buffer
+ * @param in The compressed data
+ * @param in_len Length of the compressed data
+ * @param out Buffer for the decompressed data
+ * @param out_len Size of the buffer
+ * @return The length of the decompressed data, -ENOSPC if it does not fit
+ * into the buffer or -EINVAL if the compressed data is corrupt
+ */
+ssize_t lzf_decompress(const void *in, size_t in_len, void *out, size_t out_len)
+{
+	const uint8_t *ip = in, *in_end = ip + in_len;
+	uint8_t *op = out, *out_end = op + out_len;
+	const uint8_t *ref;
+	unsigned int ctrl;
+	size_t len, off;
+
+	while (ip < in_end) {
+		ctrl = *ip++;
+
+		if (ctrl < LZF_MAX_LIT) {
+			len = ctrl + 1;
+			if (in_end - ip < len)
+				return -EINVAL;
+			if (out_end - op < len)
+				return -ENOSPC;
+
+			memcpy(op, ip, len);
+			op += len;
+			ip += len;
+			continue;
+		}
+
+		len = ctrl >> 5;
+		if (len == 7) {
+			if (ip == in_end)
+				return -EINVAL;
+			len += *ip++;
+		}
+		len += 2;
+
+		if (ip == in_end)
+			return -EINVAL;
+		off = ((ctrl & 0x1f) << 8 | *ip++) + 1;
+
+		if (off > op - (uint8_t *)out)
+			return -EINVAL;
+		if (out_end - op < len)
+			return -ENOSPC;
+
+		/* The reference may overlap the output */
+		for (ref = op - off; len; len--)
+			*op++ = *ref++;
+	}
+
+	return op - (uint8_t *)out;
+}
@@ -0,0 +1,12 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/* Copyright 2013-2023 The DT-Utils Authors <oss-tools@pengutronix.de> */
+
+#ifndef __LZF_H
+#define __LZF_H
+
+#include <sys/types.h>
+
+ssize_t lzf_compress(const void *in, size_t in_len, void *out, size_t out_len);
+ssize_t lzf_decompress(const void *in, size_t in_len, void *out, size_t out_len);
+
+#endif /* __LZF_H */
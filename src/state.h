@@ -7,10 +7,14 @@
 #include <linux/uuid.h>
 
 struct state;
+struct state_lock;
 
 #if IS_ENABLED(CONFIG_STATE)
 
-struct state *state_new_from_node(struct device_node *node, bool readonly);
+struct state *state_new_from_node(struct device_node *node, bool readonly,
+				  struct state_lock **lock);
+char *state_backend_of_node(struct device_node *node, off_t *offset,
+			    size_t *size);
 void state_release(struct state *state);
 
 struct state *state_by_name(const char *name);
@@ -19,6 +23,9 @@ struct state *state_by_node(const struct device_node *node);
 int state_load_no_auth(struct state *state);
 int state_load(struct state *state);
 int state_save(struct state *state);
+int state_pre_erase(struct state *state);
+int state_check_no_auth(struct state *state);
+int state_check(struct state *state);
 void state_info(void);
 
 int state_read_mac(struct state *state, const char *name, u8 *buf);
@@ -26,7 +33,14 @@ int state_read_mac(struct state *state, const char *name, u8 *buf);
 #else /* #if IS_ENABLED(CONFIG_STATE) */
 
 static inline struct state *state_new_from_node(struct device_node *node,
-						bool readonly)
+						bool readonly,
+						struct state_lock **lock)
+{
+	return ERR_PTR(-ENOSYS);
+}
+
+static inline char *state_backend_of_node(struct device_node *node,
+					  off_t *offset, size_t *size)
 {
 	return ERR_PTR(-ENOSYS);
 }
@@ -51,6 +65,21 @@ static inline int state_save(struct state *state)
 	return -ENOSYS;
 }
 
+static inline int state_pre_erase(struct state *state)
+{
+	return -ENOSYS;
+}
+
+static inline int state_check_no_auth(struct state *state)
+{
+	return -ENOSYS;
+}
+
+static inline int state_check(struct state *state)
+{
+	return -ENOSYS;
+}
+
 static inline int state_read_mac(struct state *state, const char *name, u8 *buf)
 {
 	return -ENOSYS;
@@ -36,6 +36,10 @@ whoami | grep -q root &&
 losetup --version  &&
   test_set_prereq LOSETUP
 
+# Prerequisite: socat available [SOCAT]
+socat -V &&
+  test_set_prereq SOCAT
+
 # Prerequisite: udisksctl available [UDISKSCTL]
 udisksctl help &&
   test_set_prereq UDISKSCTL
@@ -67,6 +71,12 @@ test_expect_success "barebox-state missing arg" "
   test_expect_code 1 barebox-state info
 "
 
+test_expect_success "barebox-state invalid watch interval" "
+  test_expect_code 1 barebox-state --watch --watch-interval 0 &&
+  test_expect_code 1 barebox-state --watch --watch-interval -5 &&
+  test_expect_code 1 barebox-state --watch --watch-interval foo
+"
+
 test_expect_success "barebox-state version" "
   barebox-state --version
 "
@@ -218,8 +228,99 @@ for dts in ${SHARNESS_TEST_DIRECTORY}/*.dts; do
     [ $state_bootstate_system1_priority = 20 ] || return 2
     [ $state_bootstate_last_chosen = 1337 ] || return 2
   "
+
+  test_expect_success LOOP "barebox-state -i ${dtb} --dump-json" "
+    barebox-state --input ${TEST_TMPDIR}/$dtb --dump-json > ${TEST_TMPDIR}/dump.json &&
+    grep -q '\"bootstate.last_chosen\": 1337' ${TEST_TMPDIR}/dump.json
+  "
+
+  test_expect_success LOOP "barebox-state -i ${dtb} --export-dtb" "
+    barebox-state --input ${TEST_TMPDIR}/$dtb --export-dtb ${TEST_TMPDIR}/export.dtb &&
+    barebox-state --input ${TEST_TMPDIR}/export.dtb --get bootstate.last_chosen > ${TEST_TMPDIR}/export.out &&
+    grep -qx 1337 ${TEST_TMPDIR}/export.out
+  "
+
+  test_expect_success LOOP "barebox-state -i ${dtb} with a state given twice" "
+    timeout 10 barebox-state --input ${TEST_TMPDIR}/$dtb -n state -n /state --set bootstate.last_chosen=1337
+  "
+
+  test_expect_success LOOP "barebox-state -i ${dtb} --check" "
+    barebox-state --input ${TEST_TMPDIR}/$dtb --check
+  "
+
+  test_expect_success LOOP "barebox-state -i ${dtb} --watch" "
+    barebox-state --input ${TEST_TMPDIR}/$dtb --watch --watch-interval 50 > ${TEST_TMPDIR}/watch.out &
+    watch_pid=\$! &&
+    sleep 1 &&
+    barebox-state --input ${TEST_TMPDIR}/$dtb --set bootstate.last_chosen=42 &&
+    sleep 1 &&
+    kill \$watch_pid &&
+    wait \$watch_pid &&
+    grep -qx bootstate.last_chosen=42 ${TEST_TMPDIR}/watch.out
+  "
+
+  test_expect_success LOOP,SOCAT "barebox-state -i ${dtb} --daemon" "
+    barebox-state --input ${TEST_TMPDIR}/$dtb --daemon --socket ${TEST_TMPDIR}/state.sock &
+    daemon_pid=\$! &&
+    test_when_finished \"kill \$daemon_pid; wait \$daemon_pid\" &&
+    sleep 1 &&
+    test \$(stat -c %a ${TEST_TMPDIR}/state.sock) = 700 &&
+    printf 'get bootstate.last_chosen\\nset bootstate.last_chosen=43\\nget bootstate.last_chosen\\nfoo\\nsync\\n' |
+      socat -t 2 - UNIX-CONNECT:${TEST_TMPDIR}/state.sock > ${TEST_TMPDIR}/daemon.out &&
+    printf '+42\\nOK\\nOK\\n+43\\nOK\\nERR 22\\nOK\\n' > ${TEST_TMPDIR}/daemon.expect &&
+    test_cmp ${TEST_TMPDIR}/daemon.expect ${TEST_TMPDIR}/daemon.out &&
+    timeout 10 barebox-state --input ${TEST_TMPDIR}/$dtb --socket ${TEST_TMPDIR}/state.sock --get bootstate.last_chosen > ${TEST_TMPDIR}/daemon.out &&
+    grep -qx 43 ${TEST_TMPDIR}/daemon.out &&
+    test_expect_code 1 timeout 10 barebox-state --input ${TEST_TMPDIR}/$dtb --socket ${TEST_TMPDIR}/state.sock --dump-shell
+  "
+
+  test_expect_success LOOP "verify set by the daemon for ${dtb}" "
+    barebox-state --input ${TEST_TMPDIR}/$dtb --get bootstate.last_chosen > ${TEST_TMPDIR}/daemon.out &&
+    grep -qx 43 ${TEST_TMPDIR}/daemon.out
+  "
 done
 
+# Prerequisite: the blob generator can be replaced for testing [BLOB_GEN]
+grep -qx '#define CONFIG_TEST_BLOB_GEN 1' "$SHARNESS_BUILD_DIRECTORY/config.h" 2>/dev/null &&
+  test_set_prereq BLOB_GEN
+
+# The keystore unwraps the secret of an authenticated state through a mock of
+# the CAAM blob generator, which hands out the same payload for every blob. The
+# blob is new for every run, so that no secret is in the keyring yet.
+blob_gen=${TEST_TMPDIR}/blob_gen
+mkdir -p $blob_gen
+printf 'dt-utils test key' | base64 > $blob_gen/payload
+: > $blob_gen/modifier
+: > $blob_gen/blob
+blob=$(head -c 65 /dev/urandom | base64 -w 0)
+
+cpp -nostdinc -undef -D__DTS__ -x assembler-with-cpp \
+  -D__RAW_LOOPDEV__='"'$rawloop'"' -D__KEYSTORE_BLOB__='"'$blob'"' \
+  ${SHARNESS_TEST_DIRECTORY}/keystore/hmac.dts | \
+  dtc -O dtb -o "${TEST_TMPDIR}/hmac.dtb" -b 0
+
+test_expect_success LOOP,BLOB_GEN "barebox-state -i hmac.dtb --set bootstate.last_chosen=7" "
+  DT_UTILS_BLOB_GEN=$blob_gen barebox-state --input ${TEST_TMPDIR}/hmac.dtb --set bootstate.last_chosen=7 &&
+  grep -qx user:state $blob_gen/modifier &&
+  test -s $blob_gen/blob
+"
+
+test_expect_success LOOP,BLOB_GEN "barebox-state -i hmac.dtb --get bootstate.last_chosen" "
+  DT_UTILS_BLOB_GEN=$blob_gen barebox-state --input ${TEST_TMPDIR}/hmac.dtb --get bootstate.last_chosen > ${TEST_TMPDIR}/hmac.out &&
+  grep -qx 7 ${TEST_TMPDIR}/hmac.out
+"
+
+# Prerequisite: secrets are kept in the keyring [KEYRING]
+grep -q 'dt-utils:keystore:state:' /proc/keys 2>/dev/null &&
+  test_set_prereq KEYRING
+
+test_expect_success LOOP,BLOB_GEN,KEYRING "barebox-state -i hmac.dtb takes the secret from the keyring" "
+  : > $blob_gen/blob &&
+  DT_UTILS_BLOB_GEN=$blob_gen barebox-state --input ${TEST_TMPDIR}/hmac.dtb --get bootstate.last_chosen > ${TEST_TMPDIR}/hmac.out &&
+  grep -qx 7 ${TEST_TMPDIR}/hmac.out &&
+  test ! -s $blob_gen/blob
+"
+
 loopdetach $rawloop
 loopdetach $gptnouuidloop
 loopdetach $gptloop
@@ -1,14 +1,95 @@
 /* SPDX-License-Identifier: GPL-2.0-only */
 /* Copyright 2023 The DT-Utils Authors <oss-tools@pengutronix.de> */
+/*
+ * Checks the table and instruction based CRC implementations against bitwise
+ * ones for all alignments and many lengths, checks combining CRCs and the
+ * parallel CRC against them, and reports their throughput.
+ */
 #include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
+#include <time.h>
 
 #include <dt/common.h>
 
+#define BENCH_SIZE	(16 * 1024 * 1024)
+#define BENCH_ROUNDS	4
+
+/* Bitwise CRC without the ones complement, reversed polynomial @poly */
+static uint32_t crc_ref(uint32_t poly, uint32_t crc, const uint8_t *buf,
+			size_t len)
+{
+	int i;
+
+	while (len--) {
+		crc ^= *buf++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (crc & 1 ? poly : 0);
+	}
+
+	return crc;
+}
+
+static uint32_t crc32_ref(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	return ~crc_ref(0xedb88320, ~crc, buf, len);
+}
+
+static uint32_t crc32_no_comp_ref(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	return crc_ref(0xedb88320, crc, buf, len);
+}
+
+static uint32_t crc32c_ref(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	return ~crc_ref(0x82f63b78, ~crc, buf, len);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t crc32_parallel_uint(uint32_t crc, const void *buf,
+				    unsigned int len)
+{
+	return crc32_parallel(crc, buf, len);
+}
+
+static void bench(const char *name,
+		  uint32_t (*fn)(uint32_t, const void *, unsigned int))
+{
+	uint8_t *buf = malloc(BENCH_SIZE);
+	volatile uint32_t checksum = 0;
+	double t;
+	int i;
+
+	assert(buf);
+	for (i = 0; i < BENCH_SIZE; i++)
+		buf[i] = i * 13 + 5;
+
+	t = now();
+	for (i = 0; i < BENCH_ROUNDS; i++)
+		checksum = fn(checksum, buf, BENCH_SIZE);
+	t = now() - t;
+
+	printf("%s: %.0f MiB/s\n", name,
+	       (double)BENCH_ROUNDS * BENCH_SIZE / (1024 * 1024) / t);
+
+	free(buf);
+}
+
 int main(void)
 {
 	const char *str = "Hello, World!";
+	uint8_t buf[1024 + 15];
 	uint32_t checksum;
+	size_t ofs, len;
 
 	checksum = crc32(0, str, strlen(str));
 	assert(checksum == 0xec4ac3d0);
@@ -16,5 +97,63 @@ int main(void)
 	checksum = crc32_no_comp(0, str, strlen(str));
 	assert(checksum == 0xe33e8552);
 
+	checksum = crc32(0, "123456789", 9);
+	assert(checksum == 0xcbf43926);
+
+	checksum = crc32c(0, "123456789", 9);
+	assert(checksum == 0xe3069283);
+
+	for (ofs = 0; ofs < sizeof(buf); ofs++)
+		buf[ofs] = ofs * 7 + 3;
+
+	/* All alignments and lengths around the block sizes, and continuation */
+	for (ofs = 0; ofs < 16; ofs++) {
+		for (len = 0; len < sizeof(buf) - ofs; len += len < 160 ? 1 : 61) {
+			checksum = crc32(0, buf + ofs, len);
+			assert(checksum == crc32_ref(0, buf + ofs, len));
+			checksum = crc32(crc32(0, buf, ofs), buf + ofs, len);
+			assert(checksum == crc32_ref(0, buf, ofs + len));
+
+			checksum = crc32_no_comp(0x12345678, buf + ofs, len);
+			assert(checksum == crc32_no_comp_ref(0x12345678, buf + ofs, len));
+			checksum = crc32_no_comp(crc32_no_comp(0, buf, ofs), buf + ofs, len);
+			assert(checksum == crc32_no_comp_ref(0, buf, ofs + len));
+
+			checksum = crc32c(0, buf + ofs, len);
+			assert(checksum == crc32c_ref(0, buf + ofs, len));
+			checksum = crc32c(crc32c(0, buf, ofs), buf + ofs, len);
+			assert(checksum == crc32c_ref(0, buf, ofs + len));
+		}
+	}
+
+	/* Combining any split of a buffer gives the CRC of the whole buffer */
+	for (ofs = 0; ofs < sizeof(buf); ofs += ofs < 64 ? 1 : 37) {
+		len = sizeof(buf) - ofs;
+		checksum = crc32_combine(crc32(0, buf, ofs), crc32(0, buf + ofs, len), len);
+		assert(checksum == crc32_ref(0, buf, sizeof(buf)));
+		checksum = crc32_combine_no_comp(crc32_no_comp(0x12345678, buf, ofs),
+						 crc32_no_comp(0, buf + ofs, len), len);
+		assert(checksum == crc32_no_comp_ref(0x12345678, buf, sizeof(buf)));
+	}
+
+	/* Large buffers are split, smaller ones are not */
+	for (len = 0; len < 3 * 8 * 1024 * 1024; len = len * 3 + 1021) {
+		uint8_t *big = malloc(len + 1);
+
+		assert(big);
+		for (ofs = 0; ofs <= len; ofs++)
+			big[ofs] = ofs * 11 + ofs / 4093;
+
+		checksum = crc32_parallel(0x87654321, big + 1, len);
+		assert(checksum == crc32_ref(0x87654321, big + 1, len));
+
+		free(big);
+	}
+
+	bench("crc32", crc32);
+	bench("crc32_no_comp", crc32_no_comp);
+	bench("crc32c", crc32c);
+	bench("crc32_parallel", crc32_parallel_uint);
+
 	return 0;
 }
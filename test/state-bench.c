@@ -0,0 +1,158 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/* Copyright 2023 The DT-Utils Authors <oss-tools@pengutronix.de> */
+/*
+ * Measures constructing a state with many variables from its device tree
+ * node and looking up all of its variables by name.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <common.h>
+#include <malloc.h>
+#include <of.h>
+
+#include "barebox-state/state.h"
+
+#define NUM_GROUPS	50
+#define VARS_PER_GROUP	100
+#define NUM_VARS	(NUM_GROUPS * VARS_PER_GROUP)
+#define ROUNDS		20
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Creates a state node with NUM_VARS variables of all types, listed in order
+ * of their position.
+ */
+static struct device_node *bench_create_node(void)
+{
+	static const char *names[] = { "a", "b", "c" };
+	struct device_node *root, *state, *group, *var;
+	uint32_t start_size[2];
+	unsigned int g, v, n = 0;
+	char name[32];
+
+	root = of_new_node(NULL, NULL);
+	state = of_new_node(root, "state");
+	of_property_write_u32(state, "magic", 0x12345678);
+
+	for (g = 0; g < NUM_GROUPS; g++) {
+		snprintf(name, sizeof(name), "group%02u", g);
+		group = of_new_node(state, name);
+
+		for (v = 0; v < VARS_PER_GROUP; v++) {
+			start_size[0] = n++ * 8;
+
+			snprintf(name, sizeof(name), "var%02u@%x", v, start_size[0]);
+			var = of_new_node(group, name);
+
+			switch (v % 4) {
+			case 0:
+				of_property_write_string(var, "type", "uint32");
+				start_size[1] = 4;
+				break;
+			case 1:
+				of_property_write_string(var, "type", "enum32");
+				of_property_write_strings(var, "names", names[0],
+							  names[1], names[2], NULL);
+				start_size[1] = 4;
+				break;
+			case 2:
+				of_property_write_string(var, "type", "mac");
+				start_size[1] = 6;
+				break;
+			case 3:
+				of_property_write_string(var, "type", "string");
+				start_size[1] = 8;
+				break;
+			}
+
+			of_property_write_u32_array(var, "reg", start_size, 2);
+		}
+	}
+
+	return state;
+}
+
+static struct state *bench_state_new(void)
+{
+	struct state *state;
+
+	state = xzalloc(sizeof(*state));
+	dev_set_name(&state->dev, "bench");
+	INIT_LIST_HEAD(&state->variables);
+
+	return state;
+}
+
+static void bench_state_free(struct state *state)
+{
+	free(state->var_hash);
+	state_arena_free(state);
+	free(state);
+}
+
+int main(void)
+{
+	struct device_node *node;
+	struct state *state;
+	struct state_variable *sv;
+	double t, t_create = 0, t_find = 0;
+	char name[64];
+	int i, g, v, ret;
+
+	node = bench_create_node();
+
+	for (i = 0; i < ROUNDS; i++) {
+		state = bench_state_new();
+
+		t = now();
+		ret = state_from_node(state, node, true);
+		t_create += now() - t;
+		if (ret) {
+			fprintf(stderr, "creating state failed: %s\n", strerror(-ret));
+			return 1;
+		}
+
+		if (state->num_vars != NUM_VARS) {
+			fprintf(stderr, "expected %u variables, got %u\n",
+				NUM_VARS, state->num_vars);
+			return 1;
+		}
+
+		t = now();
+		for (g = 0; g < NUM_GROUPS; g++) {
+			for (v = 0; v < VARS_PER_GROUP; v++) {
+				snprintf(name, sizeof(name), "group%02u.var%02u", g, v);
+				sv = state_find_var(state, name);
+				if (IS_ERR(sv)) {
+					fprintf(stderr, "no such variable: %s\n", name);
+					return 1;
+				}
+			}
+		}
+		t_find += now() - t;
+
+		/* The list has to be sorted by position */
+		sv = list_first_entry(&state->variables, struct state_variable, list);
+		if (sv->start != 0) {
+			fprintf(stderr, "variables not sorted\n");
+			return 1;
+		}
+
+		bench_state_free(state);
+	}
+
+	printf("%u variables: create %.3f ms, find all %.3f ms\n", NUM_VARS,
+	       t_create * 1000 / ROUNDS, t_find * 1000 / ROUNDS);
+
+	return 0;
+}
@@ -0,0 +1,229 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/* Copyright 2023 The DT-Utils Authors <oss-tools@pengutronix.de> */
+/*
+ * Saves and loads a dtb format state with many string variables to a file
+ * standing in for an EEPROM, once uncompressed and once compressed, and
+ * reports the bytes written and the time taken.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <common.h>
+#include <lzf.h>
+#include <malloc.h>
+#include <of.h>
+#include <state.h>
+
+#include "barebox-state/state.h"
+
+#define NUM_STRINGS	64
+#define STRING_SIZE	32
+#define EEPROM_SIZE	0x10000
+#define EEPROM_STRIDE	0x4000
+#define EEPROM_PAGE	32
+
+/* Transfer rate of a 400 kHz I2C bus, 9 clocks per byte */
+#define I2C_BYTES_PER_SEC	(400000 / 9)
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct device_node *test_create_node(void)
+{
+	struct device_node *root, *state, *var;
+	uint32_t start_size[2];
+	char name[32];
+	unsigned int i;
+
+	root = of_new_node(NULL, NULL);
+	state = of_new_node(root, "state");
+	of_property_write_u32(state, "magic", 0x12345678);
+
+	for (i = 0; i < NUM_STRINGS; i++) {
+		start_size[0] = i * STRING_SIZE;
+		start_size[1] = STRING_SIZE;
+
+		snprintf(name, sizeof(name), "string%02u@%x", i, start_size[0]);
+		var = of_new_node(state, name);
+		of_property_write_string(var, "type", "string");
+		of_property_write_u32_array(var, "reg", start_size, 2);
+	}
+
+	of_set_root_node(root);
+
+	return state;
+}
+
+static struct state *test_state_new(struct device_node *node,
+				    const char *path, const char *compression)
+{
+	struct state *state;
+	int ret;
+
+	state = xzalloc(sizeof(*state));
+	dev_set_name(&state->dev, "test");
+	INIT_LIST_HEAD(&state->variables);
+
+	ret = backend_format_dtb_create(&state->format, &state->dev);
+	if (!ret && compression)
+		ret = backend_format_compressed_create(&state->format,
+						       compression, &state->dev);
+	if (!ret)
+		ret = state_storage_init(state, path, 0, EEPROM_SIZE,
+					 EEPROM_STRIDE, EEPROM_PAGE, "direct");
+	if (!ret)
+		ret = state_from_node(state, node, true);
+	if (ret) {
+		fprintf(stderr, "creating state failed: %s\n", strerror(-ret));
+		exit(1);
+	}
+
+	return state;
+}
+
+static void test_state_free(struct state *state)
+{
+	state_storage_free(&state->storage);
+	state->format->free(state->format);
+	free(state->image);
+	free(state->of_path);
+	free(state->var_hash);
+	state_arena_free(state);
+	free(state);
+}
+
+static ssize_t test_save_load(struct device_node *node, const char *compression)
+{
+	struct state *state;
+	struct state_variable *sv;
+	struct state_string *string;
+	char path[] = "/tmp/state-compress-XXXXXX";
+	char value[STRING_SIZE + 1];
+	double t_save, t_load;
+	unsigned int i = 0;
+	ssize_t len;
+	int fd, ret;
+
+	fd = mkstemp(path);
+	if (fd < 0 || ftruncate(fd, EEPROM_SIZE)) {
+		perror("creating EEPROM file");
+		exit(1);
+	}
+	close(fd);
+
+	state = test_state_new(node, path, compression);
+	list_for_each_entry(sv, &state->variables, list) {
+		snprintf(value, sizeof(value), "/dev/mmcblk0p%u,rootfs.%u", i % 4, i);
+		string = to_state_string(sv);
+		state_string_copy_to_raw(string, value);
+		string->value = xstrdup(value);
+		i++;
+	}
+
+	state->dirty = 1;
+	t_save = now();
+	ret = state_save(state);
+	t_save = now() - t_save;
+	len = state->image_len;
+	test_state_free(state);
+	if (ret) {
+		fprintf(stderr, "saving state failed: %s\n", strerror(-ret));
+		exit(1);
+	}
+
+	state = test_state_new(node, path, compression);
+	t_load = now();
+	ret = state_load(state);
+	t_load = now() - t_load;
+	if (ret) {
+		fprintf(stderr, "loading state failed: %s\n", strerror(-ret));
+		exit(1);
+	}
+
+	i = 0;
+	list_for_each_entry(sv, &state->variables, list) {
+		string = to_state_string(sv);
+		snprintf(value, sizeof(value), "/dev/mmcblk0p%u,rootfs.%u", i % 4, i);
+		if (strncmp(string->raw, value, STRING_SIZE)) {
+			fprintf(stderr, "%s: expected '%s', got '%.*s'\n",
+				sv->name, value, STRING_SIZE, string->raw);
+			exit(1);
+		}
+		i++;
+	}
+
+	test_state_free(state);
+	unlink(path);
+
+	printf("%s: %zd bytes written per copy (%.1f ms at 400 kHz I2C), save %.3f ms, load %.3f ms\n",
+	       compression ? compression : "uncompressed", len,
+	       len * 1000.0 / I2C_BYTES_PER_SEC, t_save * 1000, t_load * 1000);
+
+	return len;
+}
+
+static void test_lzf(void)
+{
+	static uint8_t in[8192], out[8192 + 64], back[8192];
+	ssize_t len;
+	unsigned int i;
+
+	/* Incompressible data does not fit into a buffer of its own size */
+	srand(1);
+	for (i = 0; i < sizeof(in); i++)
+		in[i] = rand();
+
+	len = lzf_compress(in, sizeof(in), out, sizeof(in) - 1);
+	if (len != -ENOSPC) {
+		fprintf(stderr, "random data compressed to %zd bytes\n", len);
+		exit(1);
+	}
+
+	/* Runs, repetitions and literals all round-trip */
+	for (i = 0; i < sizeof(in); i++)
+		in[i] = i < 1024 ? 0 : i < 4096 ? "state"[i % 5] : in[i];
+
+	len = lzf_compress(in, sizeof(in), out, sizeof(out));
+	if (len <= 0 || len >= sizeof(in) ||
+	    lzf_decompress(out, len, back, sizeof(back)) != sizeof(in) ||
+	    memcmp(in, back, sizeof(in))) {
+		fprintf(stderr, "lzf round trip failed\n");
+		exit(1);
+	}
+
+	/* Corrupt data is rejected instead of read out of bounds */
+	out[0] = 0xff;
+	if (lzf_decompress(out, len, back, sizeof(back)) >= 0) {
+		fprintf(stderr, "corrupt lzf data decompressed\n");
+		exit(1);
+	}
+}
+
+int main(void)
+{
+	struct device_node *node;
+	ssize_t len_plain, len_lzf;
+
+	test_lzf();
+
+	node = test_create_node();
+
+	len_plain = test_save_load(node, NULL);
+	len_lzf = test_save_load(node, "lzf");
+
+	if (len_lzf >= len_plain) {
+		fprintf(stderr, "compression did not reduce the size\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,1012 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/* Copyright 2023 The DT-Utils Authors <oss-tools@pengutronix.de> */
+/*
+ * Writes and reads the state storage directly, with files standing in for an
+ * EEPROM and a NOR flash, and checks which of the redundant copies is used.
+ * The mtd ioctls are emulated for the flash file by replacing ioctl().
+ */
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/mtd/mtd-abi.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include <common.h>
+#include <crc.h>
+#include <malloc.h>
+
+#include "barebox-state/state.h"
+
+#define EEPROM_SIZE	0x3000
+#define EEPROM_STRIDE	0x1000
+#define DATA_LEN	64
+
+#define FLASH_BLOCKS	8
+#define FLASH_ERASESIZE	1024
+#define FLASH_WRITESIZE	16
+#define FLASH_SIZE	(FLASH_BLOCKS * FLASH_ERASESIZE)
+
+/* On-storage layout of the direct buckets */
+static const uint32_t direct_magic = 0x2354fdf3;
+static const uint32_t direct_generation_magic = 0x6e65472e;
+
+struct __attribute__((__packed__)) test_direct_meta {
+	uint32_t magic;
+	uint32_t written_length;
+};
+
+struct __attribute__((__packed__)) test_direct_generation {
+	uint32_t magic;
+	uint32_t generation;
+	uint32_t data_crc;
+};
+
+#define test_fail(fmt, ...) do {					\
+	fprintf(stderr, "%s: " fmt "\n", __func__, ##__VA_ARGS__);	\
+	exit(1);							\
+} while (0)
+
+/*
+ * The data starts with a magic like the real formats and is otherwise
+ * accepted as is, the storage is what is tested here. The buckets may return
+ * padding behind it.
+ */
+static const uint32_t test_magic = 0x74736574;
+
+/* Write granularity of the EEPROM, 0 writes the buckets completely */
+static uint32_t test_pagesize;
+
+static int test_format_verify(struct state_backend_format *format,
+			      uint32_t magic, const void *buf, ssize_t *lenp,
+			      enum state_flags flags)
+{
+	if (*lenp < DATA_LEN || memcmp(buf, &test_magic, sizeof(test_magic)))
+		return -EINVAL;
+
+	*lenp = DATA_LEN;
+
+	return 0;
+}
+
+static struct state_backend_format test_format = {
+	.verify = test_format_verify,
+	.name = "test",
+};
+
+/* The emulated flash */
+static dev_t flash_dev;
+static ino_t flash_ino;
+static unsigned int *flash_erases; /* Shared with child processes */
+static unsigned int flash_bad; /* Bitmask of bad eraseblocks */
+static unsigned int flash_erase_us; /* Time an erase takes */
+static const char *flash_storage_type;
+static size_t flash_read; /* Bytes read from the flash */
+
+static bool test_is_flash(int fd)
+{
+	struct stat st;
+
+	return flash_ino && !fstat(fd, &st) && st.st_dev == flash_dev &&
+	       st.st_ino == flash_ino;
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	struct mtd_info_user *info;
+	struct erase_info_user *erase;
+	uint8_t buf[FLASH_ERASESIZE];
+	loff_t *offs;
+	va_list ap;
+	void *arg;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (!test_is_flash(fd))
+		return syscall(SYS_ioctl, fd, request, arg);
+
+	switch (request) {
+	case MEMGETINFO:
+		info = arg;
+		memset(info, 0, sizeof(*info));
+		info->type = MTD_NORFLASH;
+		info->flags = MTD_CAP_NORFLASH;
+		info->size = FLASH_SIZE;
+		info->erasesize = FLASH_ERASESIZE;
+		info->writesize = FLASH_WRITESIZE;
+		return 0;
+	case MEMGETBADBLOCK:
+		offs = arg;
+		return !!(flash_bad & (1 << (*offs / FLASH_ERASESIZE)));
+	case MEMERASE:
+		erase = arg;
+		if (erase->start % FLASH_ERASESIZE ||
+		    erase->length != FLASH_ERASESIZE ||
+		    erase->start >= FLASH_SIZE)
+			test_fail("erasing 0x%x@0x%x", erase->length, erase->start);
+		if (flash_bad & (1 << (erase->start / FLASH_ERASESIZE)))
+			test_fail("erasing bad eraseblock at 0x%x", erase->start);
+		memset(buf, 0xff, sizeof(buf));
+		if (pwrite(fd, buf, sizeof(buf), erase->start) != sizeof(buf))
+			test_fail("erasing: %m");
+		flash_erases[erase->start / FLASH_ERASESIZE]++;
+		usleep(flash_erase_us);
+		return 0;
+	default:
+		errno = ENOTTY;
+		return -1;
+	}
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+	ssize_t ret;
+
+	ret = syscall(SYS_read, fd, buf, count);
+	if (ret > 0 && test_is_flash(fd))
+		flash_read += ret;
+
+	return ret;
+}
+
+/* Only erased flash can be written */
+ssize_t write(int fd, const void *buf, size_t count)
+{
+	uint8_t old[FLASH_ERASESIZE];
+	off_t offset;
+	size_t i;
+
+	if (test_is_flash(fd)) {
+		offset = lseek(fd, 0, SEEK_CUR);
+		if (count > sizeof(old) ||
+		    pread(fd, old, count, offset) != count)
+			test_fail("writing 0x%zx@0x%llx", count,
+				  (long long)offset);
+		for (i = 0; i < count; i++) {
+			if (old[i] != 0xff)
+				test_fail("writing to 0x%llx which is not erased",
+					  (long long)offset + i);
+		}
+		if (flash_bad & (1 << (offset / FLASH_ERASESIZE)))
+			test_fail("writing to bad eraseblock at 0x%llx",
+				  (long long)offset);
+	}
+
+	return syscall(SYS_write, fd, buf, count);
+}
+
+static char *test_create_eeprom(void)
+{
+	char *path = xstrdup("/tmp/state-storage-XXXXXX");
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd < 0 || ftruncate(fd, EEPROM_SIZE))
+		test_fail("creating EEPROM file: %m");
+	close(fd);
+
+	return path;
+}
+
+static char *test_create_flash(void)
+{
+	char *path = xstrdup("/tmp/state-storage-XXXXXX");
+	uint8_t buf[FLASH_SIZE];
+	struct stat st;
+	int fd;
+
+	memset(buf, 0xff, sizeof(buf));
+	fd = mkstemp(path);
+	if (fd < 0 || pwrite(fd, buf, sizeof(buf), 0) != sizeof(buf) ||
+	    fstat(fd, &st))
+		test_fail("creating flash file: %m");
+	close(fd);
+
+	/* One more counter tells whether a child process is done */
+	if (!flash_erases) {
+		flash_erases = mmap(NULL, (FLASH_BLOCKS + 1) * sizeof(*flash_erases),
+				    PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (flash_erases == MAP_FAILED)
+			test_fail("mapping shared memory: %m");
+	}
+
+	flash_dev = st.st_dev;
+	flash_ino = st.st_ino;
+	memset(flash_erases, 0, (FLASH_BLOCKS + 1) * sizeof(*flash_erases));
+	flash_bad = 0;
+	flash_erase_us = 0;
+	flash_storage_type = "rotating";
+
+	return path;
+}
+
+static void test_remove_flash(char *path)
+{
+	flash_ino = 0;
+	unlink(path);
+	free(path);
+}
+
+static struct state *test_state_new(const char *path)
+{
+	struct state *state;
+	int ret;
+
+	state = xzalloc(sizeof(*state));
+	dev_set_name(&state->dev, "test");
+
+	if (flash_ino)
+		ret = state_storage_init(state, path, 0, 0, 0, 0,
+					 flash_storage_type);
+	else
+		ret = state_storage_init(state, path, 0, EEPROM_SIZE,
+					 EEPROM_STRIDE, test_pagesize, "direct");
+	if (ret)
+		test_fail("initializing storage failed: %s", strerror(-ret));
+
+	return state;
+}
+
+static void test_state_free(struct state *state)
+{
+	state_storage_free(&state->storage);
+	free(state);
+}
+
+static void test_data(uint8_t *buf, uint8_t val)
+{
+	memset(buf, val, DATA_LEN);
+	memcpy(buf, &test_magic, sizeof(test_magic));
+}
+
+/* Writes the data as the next generation after @last */
+static void test_write(const char *path, uint32_t last, uint8_t val)
+{
+	struct state *state = test_state_new(path);
+	uint8_t buf[DATA_LEN];
+	int ret;
+
+	test_data(buf, val);
+	state->storage.generation = last;
+	ret = state_storage_write(&state->storage, buf, sizeof(buf));
+	if (ret)
+		test_fail("writing after generation %u failed: %s", last,
+			  strerror(-ret));
+
+	test_state_free(state);
+}
+
+/* Reads the storage and checks the data and generation used */
+static void test_read_data(const char *path, uint32_t generation,
+			   const uint8_t *expect, bool readonly)
+{
+	struct state *state = test_state_new(path);
+	ssize_t len;
+	void *buf;
+	int ret;
+
+	if (readonly)
+		state_storage_set_readonly(&state->storage);
+
+	ret = state_storage_read(&state->storage, &test_format, 0, &buf, &len, 0);
+	if (ret)
+		test_fail("reading failed: %s", strerror(-ret));
+
+	if (len != DATA_LEN || memcmp(buf, expect, DATA_LEN))
+		test_fail("expected data 0x%02x, got 0x%02x",
+			  expect[DATA_LEN - 1], ((uint8_t *)buf)[DATA_LEN - 1]);
+	if (state->storage.generation != generation)
+		test_fail("expected generation %u, got %u", generation,
+			  state->storage.generation);
+
+	free(buf);
+	test_state_free(state);
+}
+
+static void test_read(const char *path, uint32_t generation, uint8_t val,
+		      bool readonly)
+{
+	uint8_t expect[DATA_LEN];
+
+	test_data(expect, val);
+	test_read_data(path, generation, expect, readonly);
+}
+
+static void test_bucket_io(const char *path, int num, void *buf, bool write)
+{
+	off_t offset = num * EEPROM_STRIDE;
+	ssize_t ret;
+	int fd;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0)
+		test_fail("opening EEPROM file: %m");
+
+	if (write)
+		ret = pwrite(fd, buf, EEPROM_STRIDE, offset);
+	else
+		ret = pread(fd, buf, EEPROM_STRIDE, offset);
+	if (ret != EEPROM_STRIDE)
+		test_fail("accessing bucket %d: %m", num);
+
+	close(fd);
+}
+
+/* Writes a bucket as written by barebox or older versions, the trailer is kept */
+static void test_write_old_bucket(const char *path, int num, uint8_t val)
+{
+	struct test_direct_meta meta = {
+		.magic = direct_magic,
+		.written_length = DATA_LEN,
+	};
+	uint8_t buf[DATA_LEN];
+	int fd;
+
+	test_data(buf, val);
+
+	fd = open(path, O_RDWR);
+	if (fd < 0 ||
+	    pwrite(fd, &meta, sizeof(meta), num * EEPROM_STRIDE) != sizeof(meta) ||
+	    pwrite(fd, buf, sizeof(buf), num * EEPROM_STRIDE + sizeof(meta)) != sizeof(buf))
+		test_fail("writing old bucket: %m");
+	close(fd);
+}
+
+static uint32_t test_bucket_generation(const char *path, int num)
+{
+	struct test_direct_generation gen;
+	uint8_t buf[DATA_LEN];
+	off_t offset = num * EEPROM_STRIDE + sizeof(struct test_direct_meta);
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 ||
+	    pread(fd, buf, sizeof(buf), offset) != sizeof(buf) ||
+	    pread(fd, &gen, sizeof(gen), offset + sizeof(buf)) != sizeof(gen))
+		test_fail("reading bucket: %m");
+	close(fd);
+
+	if (gen.magic != direct_generation_magic ||
+	    gen.data_crc != crc32(0, buf, sizeof(buf)))
+		return 0;
+
+	return gen.generation;
+}
+
+static void test_check_generations(const char *path, uint32_t generation)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		if (test_bucket_generation(path, i) != generation)
+			test_fail("bucket %d has generation %u instead of %u", i,
+				  test_bucket_generation(path, i), generation);
+	}
+}
+
+/* The newest copy is used, wherever it is, and the others are restored */
+static void test_newest_wins(void)
+{
+	char *path = test_create_eeprom();
+	uint8_t old[EEPROM_STRIDE];
+	int newest, i;
+
+	for (newest = 0; newest < 3; newest++) {
+		test_write(path, 6, 0xb7);
+		test_bucket_io(path, 0, old, false);
+		test_write(path, 7, 0xb8);
+		for (i = 0; i < 3; i++) {
+			if (i != newest)
+				test_bucket_io(path, i, old, true);
+		}
+
+		test_read(path, 8, 0xb8, true);
+		test_read(path, 8, 0xb8, false);
+		test_check_generations(path, 8);
+	}
+
+	unlink(path);
+	free(path);
+}
+
+/* Data without generation is used in list order */
+static void test_no_generation(void)
+{
+	char *path = test_create_eeprom();
+
+	test_write_old_bucket(path, 0, 0xc0);
+	test_write_old_bucket(path, 1, 0xc1);
+	test_write_old_bucket(path, 2, 0xc2);
+	test_read(path, 0, 0xc0, true);
+
+	/* A stale trailer of a writer aware of generations is ignored */
+	test_write(path, 5, 0xc5);
+	test_write_old_bucket(path, 0, 0xc0);
+	if (test_bucket_generation(path, 0))
+		test_fail("stale trailer accepted");
+
+	/* Old data in the first bucket is not shadowed by a newer generation */
+	test_read(path, 0, 0xc0, true);
+	test_read(path, 6, 0xc0, false);
+
+	unlink(path);
+	free(path);
+}
+
+/* Generations wrap around to 1 and are still newer than before */
+static void test_generation_wrap(void)
+{
+	char *path = test_create_eeprom();
+	uint8_t old[EEPROM_STRIDE];
+
+	test_write(path, 0xfffffffe, 0xd0);
+	test_bucket_io(path, 0, old, false);
+
+	/* 0 marks data without generation and is skipped */
+	test_write(path, 0xffffffff, 0xd1);
+	test_check_generations(path, 1);
+
+	test_bucket_io(path, 0, old, true);
+	test_read(path, 1, 0xd1, false);
+	test_check_generations(path, 1);
+
+	unlink(path);
+	free(path);
+}
+
+/* Pages changed by another writer since the read are not taken as unchanged */
+static void test_partial_write(void)
+{
+	char *path = test_create_eeprom();
+	uint8_t buf[DATA_LEN];
+	struct state *state;
+	ssize_t len;
+	void *data;
+	int ret;
+
+	test_pagesize = 16;
+	test_write(path, 0, 0xe0);
+
+	state = test_state_new(path);
+	ret = state_storage_read(&state->storage, &test_format, 0, &data, &len, 0);
+	if (ret)
+		test_fail("reading failed: %s", strerror(-ret));
+	free(data);
+
+	test_write(path, 1, 0xe1);
+
+	/* Only the last page differs from what was read */
+	test_data(buf, 0xe0);
+	buf[DATA_LEN - 1] = 0xe2;
+	ret = state_storage_write(&state->storage, buf, sizeof(buf));
+	if (ret)
+		test_fail("writing failed: %s", strerror(-ret));
+	test_state_free(state);
+
+	test_read_data(path, 2, buf, false);
+	test_check_generations(path, 2);
+
+	test_pagesize = 0;
+	unlink(path);
+	free(path);
+}
+
+/* A storage read again sees what others wrote in between */
+static void test_reread(void)
+{
+	char *path = test_create_eeprom();
+	uint8_t expect[DATA_LEN];
+	struct state *state;
+	ssize_t len;
+	void *data;
+	int ret, i;
+
+	test_write(path, 0, 0xe4);
+	state = test_state_new(path);
+
+	for (i = 0; i < 2; i++) {
+		if (i)
+			test_write(path, 1, 0xe5);
+
+		ret = state_storage_read(&state->storage, &test_format, 0,
+					 &data, &len, 0);
+		if (ret)
+			test_fail("reading failed: %s", strerror(-ret));
+
+		test_data(expect, 0xe4 + i);
+		if (len != DATA_LEN || memcmp(data, expect, DATA_LEN))
+			test_fail("read %d returned outdated data", i);
+		if (state->storage.generation != 1 + i)
+			test_fail("read %d returned generation %u", i,
+				  state->storage.generation);
+		free(data);
+	}
+
+	test_state_free(state);
+	unlink(path);
+	free(path);
+}
+
+static int test_count_buckets(struct state *state)
+{
+	struct state_backend_storage_bucket *bucket;
+	int n = 0;
+
+	list_for_each_entry(bucket, &state->storage.buckets, bucket_list)
+		n++;
+
+	return n;
+}
+
+/*
+ * The rotating storage appends to the buckets holding the data until they are
+ * full and then erases the least worn other buckets. The newest data is found
+ * wherever it is.
+ */
+static void test_rotating(void)
+{
+	char *path = test_create_flash();
+	unsigned int min_erases = ~0, max_erases = 0;
+	struct state *state;
+	uint32_t generation;
+	int i;
+
+	state = test_state_new(path);
+	if (strcmp(state->storage.name, "circular") || !state->storage.rotating)
+		test_fail("wrong storage type %s", state->storage.name);
+	if (test_count_buckets(state) != FLASH_BLOCKS)
+		test_fail("%d buckets instead of %d", test_count_buckets(state),
+			  FLASH_BLOCKS);
+	test_state_free(state);
+
+	for (generation = 1; generation <= 500; generation++) {
+		test_write(path, generation - 1, generation);
+		test_read(path, generation, generation, true);
+
+		/* Blocks are only erased when the data does not fit anymore */
+		if (generation == 1 && flash_erases[0] + flash_erases[1] +
+		    flash_erases[2] != 3)
+			test_fail("first write did not erase the first blocks");
+		if (generation == 2 && flash_erases[3] + flash_erases[4] +
+		    flash_erases[5] + flash_erases[6] + flash_erases[7])
+			test_fail("second write did not append");
+	}
+
+	for (i = 0; i < FLASH_BLOCKS; i++) {
+		if (flash_erases[i] < min_erases)
+			min_erases = flash_erases[i];
+		if (flash_erases[i] > max_erases)
+			max_erases = flash_erases[i];
+	}
+
+	if (max_erases - min_erases > 1)
+		test_fail("erases not spread evenly, %u to %u erases",
+			  min_erases, max_erases);
+
+	/* Finding the data reads little more than the data itself */
+	flash_read = 0;
+	state = test_state_new(path);
+	test_state_free(state);
+	if (flash_read > FLASH_SIZE / 4)
+		test_fail("reading %zu bytes to initialize", flash_read);
+
+	test_remove_flash(path);
+}
+
+/* Bad blocks are neither used nor erased */
+static void test_rotating_bad_blocks(void)
+{
+	char *path = test_create_flash();
+	struct state *state;
+	uint32_t generation;
+
+	flash_bad = (1 << 0) | (1 << 4);
+
+	state = test_state_new(path);
+	if (test_count_buckets(state) != FLASH_BLOCKS - 2)
+		test_fail("%d buckets instead of %d", test_count_buckets(state),
+			  FLASH_BLOCKS - 2);
+	test_state_free(state);
+
+	for (generation = 1; generation <= 200; generation++) {
+		test_write(path, generation - 1, generation);
+		test_read(path, generation, generation, false);
+	}
+
+	if (!flash_erases[1] || !flash_erases[7])
+		test_fail("good blocks not used");
+
+	test_remove_flash(path);
+}
+
+static unsigned int test_count_erases(void)
+{
+	unsigned int n = 0;
+	int i;
+
+	for (i = 0; i < FLASH_BLOCKS; i++)
+		n += flash_erases[i];
+
+	return n;
+}
+
+/*
+ * Runs the steps of barebox-state saving with pre-erase enabled: the state is
+ * read and written with the lock held, then a child process inherits the lock
+ * and pre-erases the buckets for the next save. The parent closes its lock
+ * file descriptor without unlocking, which would unlock the child as well.
+ */
+static pid_t test_save_pre_erase(const char *path, const char *lock_path,
+				 uint32_t generation)
+{
+	unsigned int *child_done = &flash_erases[FLASH_BLOCKS];
+	struct state *state;
+	uint8_t buf[DATA_LEN];
+	unsigned int erases;
+	ssize_t len;
+	void *data;
+	int lock_fd, ret;
+	pid_t pid;
+
+	lock_fd = open(lock_path, O_RDWR | O_CLOEXEC);
+	if (lock_fd < 0 || flock(lock_fd, LOCK_EX))
+		test_fail("locking: %m");
+
+	/* The child of the last save is done once the lock is released */
+	if (generation > 1 && !*child_done)
+		test_fail("lock taken while the pre-erase is running");
+	*child_done = 0;
+
+	erases = test_count_erases();
+
+	state = test_state_new(path);
+	state_storage_set_pre_erase(&state->storage);
+
+	if (generation > 1) {
+		ret = state_storage_read(&state->storage, &test_format, 0,
+					 &data, &len, 0);
+		if (ret)
+			test_fail("reading failed: %s", strerror(-ret));
+		if (state->storage.generation != generation - 1 ||
+		    ((uint8_t *)data)[DATA_LEN - 1] != (uint8_t)(generation - 1))
+			test_fail("read generation %u instead of %u",
+				  state->storage.generation, generation - 1);
+		free(data);
+	}
+
+	test_data(buf, generation);
+	ret = state_storage_write(&state->storage, buf, sizeof(buf));
+	if (ret)
+		test_fail("writing failed: %s", strerror(-ret));
+
+	/* The buckets were erased in advance */
+	if (generation > 1 && test_count_erases() != erases)
+		test_fail("save of generation %u erased", generation);
+
+	pid = fork();
+	if (pid < 0)
+		test_fail("fork: %m");
+
+	if (!pid) {
+		ret = state_storage_pre_erase(&state->storage);
+		*child_done = 1;
+		_exit(ret ? 1 : 0);
+	}
+
+	close(lock_fd);
+	test_state_free(state);
+
+	return pid;
+}
+
+/*
+ * The next save waits for the pre-erasing child and finds the buckets it
+ * needs erased. The current data is never erased.
+ */
+static void test_pre_erase_child(void)
+{
+	char lock_path[] = "/tmp/state-storage-lock-XXXXXX";
+	char *path = test_create_flash();
+	uint32_t generation;
+	pid_t pid = 0, child;
+	int fd, status;
+
+	fd = mkstemp(lock_path);
+	if (fd < 0)
+		test_fail("creating lock file: %m");
+	close(fd);
+
+	flash_erase_us = 10000;
+
+	for (generation = 1; generation <= 50; generation++) {
+		child = test_save_pre_erase(path, lock_path, generation);
+		if (pid > 0 && (waitpid(pid, &status, 0) != pid ||
+				!WIFEXITED(status) || WEXITSTATUS(status)))
+			test_fail("pre-erase after generation %u failed",
+				  generation - 1);
+		pid = child;
+	}
+
+	waitpid(pid, &status, 0);
+
+	test_read(path, 50, 50, true);
+
+	/* Without pre-erase the writes above would have erased as well */
+	if (test_count_erases() < 50 * 3 / ((FLASH_ERASESIZE - FLASH_WRITESIZE) / 80))
+		test_fail("only %u erases", test_count_erases());
+
+	unlink(lock_path);
+	test_remove_flash(path);
+}
+
+static void test_patch(const char *path, off_t offset, const void *buf,
+		       size_t len)
+{
+	int fd;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0 || pwrite(fd, buf, len, offset) != len)
+		test_fail("patching: %m");
+	close(fd);
+}
+
+/* Offset of the first delta log record in a direct bucket */
+#define DIRECT_LOG_START	(sizeof(struct test_direct_meta) + DATA_LEN + \
+				 sizeof(struct test_direct_generation))
+/* Length of a record changing a single byte */
+#define DELTA_RECORD_LEN	(sizeof(struct state_delta_header) + 2 * 4 + 1)
+
+/*
+ * Saves @buf with byte @pos changed to @val. With the delta log this appends
+ * a record changing a single byte.
+ */
+static void test_delta_save(struct state *state, uint8_t *buf, int pos,
+			    uint8_t val)
+{
+	int ret;
+
+	buf[pos] = val;
+	ret = state_storage_write(&state->storage, buf, DATA_LEN);
+	if (ret)
+		test_fail("writing failed: %s", strerror(-ret));
+}
+
+/* Loads the data, a following save only writes the changes to it */
+static void test_delta_load(struct state *state, uint32_t generation)
+{
+	ssize_t len;
+	void *buf;
+	int ret;
+
+	ret = state_storage_read(&state->storage, &test_format, 0, &buf, &len, 0);
+	if (ret)
+		test_fail("reading failed: %s", strerror(-ret));
+	if (state->storage.generation != generation)
+		test_fail("expected generation %u, got %u", generation,
+			  state->storage.generation);
+
+	free(buf);
+}
+
+static struct state *test_delta_state_new(const char *path)
+{
+	struct state *state = test_state_new(path);
+
+	state_storage_set_delta_log(&state->storage);
+	if (!state->storage.delta_log)
+		test_fail("delta log not enabled");
+
+	return state;
+}
+
+/*
+ * The records of the delta log are replayed on top of the data. A torn or
+ * truncated record and everything behind it is ignored, the next save
+ * overwrites it.
+ */
+static void test_delta_direct(void)
+{
+	char *path = test_create_eeprom();
+	uint8_t buf[DATA_LEN], gen2[DATA_LEN];
+	struct state_delta_header header;
+	struct state *state;
+	off_t record;
+	uint8_t zero[DELTA_RECORD_LEN] = { 0 };
+	int i;
+
+	state = test_delta_state_new(path);
+	test_data(buf, 0x10);
+	test_delta_save(state, buf, 8, 0x10);
+	test_delta_save(state, buf, 10, 0x20);
+	memcpy(gen2, buf, sizeof(buf));
+	test_delta_save(state, buf, 20, 0x30);
+	test_state_free(state);
+
+	/* The data of generation 1 is left in place */
+	if (test_bucket_generation(path, 0) != 1)
+		test_fail("data rewritten instead of appending records");
+	test_read_data(path, 3, buf, true);
+
+	/* A torn record of generation 3 */
+	record = DIRECT_LOG_START + DELTA_RECORD_LEN;
+	for (i = 0; i < 3; i++)
+		test_patch(path, i * EEPROM_STRIDE + record + DELTA_RECORD_LEN - 1,
+			   zero, 1);
+	test_read_data(path, 2, gen2, true);
+
+	/* A record of which only the header was written */
+	for (i = 0; i < 3; i++)
+		test_patch(path, i * EEPROM_STRIDE + record + sizeof(header),
+			   zero, DELTA_RECORD_LEN - sizeof(header));
+	test_read_data(path, 2, gen2, true);
+
+	/* A record of which not even the header was written completely */
+	for (i = 0; i < 3; i++)
+		test_patch(path, i * EEPROM_STRIDE + record + 4, zero,
+			   DELTA_RECORD_LEN - 4);
+	test_read_data(path, 2, gen2, true);
+
+	/* The next save writes its record in place of the broken one */
+	state = test_delta_state_new(path);
+	test_delta_load(state, 2);
+	memcpy(buf, gen2, sizeof(buf));
+	test_delta_save(state, buf, 30, 0x40);
+	test_state_free(state);
+	test_read_data(path, 3, buf, true);
+	if (test_bucket_generation(path, 0) != 1)
+		test_fail("data rewritten instead of appending records");
+
+	unlink(path);
+	free(path);
+}
+
+/*
+ * A bucket without room for another record gets the complete data, which
+ * starts a new delta log.
+ */
+static void test_delta_compaction(void)
+{
+	char *path = test_create_eeprom();
+	uint8_t buf[DATA_LEN];
+	struct state *state;
+	uint32_t generation;
+	int records = (EEPROM_STRIDE - DIRECT_LOG_START) / DELTA_RECORD_LEN;
+
+	state = test_delta_state_new(path);
+	test_data(buf, 0x10);
+	test_delta_save(state, buf, 8, 0x10);
+
+	for (generation = 2; generation <= records + 1; generation++) {
+		test_delta_save(state, buf, 8 + generation % 32,
+				buf[8 + generation % 32] + 1);
+		if (test_bucket_generation(path, 0) != 1)
+			test_fail("data rewritten after %u records", generation - 2);
+	}
+
+	test_read_data(path, generation - 1, buf, true);
+
+	test_delta_save(state, buf, 8, buf[8] + 1);
+	if (test_bucket_generation(path, 0) != generation)
+		test_fail("data not rewritten with a full delta log");
+	test_read_data(path, generation, buf, true);
+
+	/* The records of the old log are not replayed on the new data */
+	test_delta_save(state, buf, 9, buf[9] + 1);
+	test_state_free(state);
+	test_read_data(path, generation + 1, buf, true);
+
+	unlink(path);
+	free(path);
+}
+
+/* End of the data written to the eraseblock @num of the flash */
+static off_t test_flash_write_area(const char *path, int num)
+{
+	uint8_t buf[FLASH_ERASESIZE];
+	off_t end;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 ||
+	    pread(fd, buf, sizeof(buf), num * FLASH_ERASESIZE) != sizeof(buf))
+		test_fail("reading flash: %m");
+	close(fd);
+
+	for (end = sizeof(buf); end > 0; end--) {
+		if (buf[end - 1] != 0xff)
+			break;
+	}
+
+	return num * FLASH_ERASESIZE + roundup(end, FLASH_WRITESIZE);
+}
+
+/*
+ * The circular buckets append the records like the data. A torn record is
+ * ignored, a full eraseblock is erased and gets the complete data.
+ */
+static void test_delta_circular(void)
+{
+	char *path = test_create_flash();
+	uint8_t buf[DATA_LEN], prev[DATA_LEN];
+	/* Record, padding and metadata of a single byte change */
+	off_t record_len = roundup(DELTA_RECORD_LEN + 8, FLASH_WRITESIZE);
+	struct state *state;
+	uint32_t generation;
+	unsigned int erases;
+	uint8_t zero = 0;
+	off_t end;
+	int i;
+
+	flash_storage_type = "circular";
+
+	state = test_delta_state_new(path);
+	test_data(buf, 0x10);
+	test_delta_save(state, buf, 8, 0x10);
+	end = test_flash_write_area(path, 0);
+
+	for (generation = 2; generation <= 5; generation++) {
+		memcpy(prev, buf, sizeof(buf));
+		test_delta_save(state, buf, 8 + generation, 0x20 + generation);
+		if (test_flash_write_area(path, 0) != end + record_len)
+			test_fail("record of generation %u not appended",
+				  generation);
+		end += record_len;
+	}
+	test_state_free(state);
+
+	test_read_data(path, 5, buf, true);
+
+	/* A torn record of generation 5 */
+	for (i = 0; i < 3; i++)
+		test_patch(path, test_flash_write_area(path, i) - record_len +
+			   DELTA_RECORD_LEN - 1, &zero, 1);
+	test_read_data(path, 4, prev, true);
+
+	/* The eraseblocks are erased when full */
+	state = test_delta_state_new(path);
+	test_delta_load(state, 4);
+	memcpy(buf, prev, sizeof(buf));
+	erases = flash_erases[0];
+	for (generation = 5; flash_erases[0] == erases; generation++) {
+		if (generation > 100)
+			test_fail("eraseblock never erased");
+		test_delta_save(state, buf, 8 + generation % 32,
+				buf[8 + generation % 32] + 1);
+	}
+	test_state_free(state);
+
+	if (test_flash_write_area(path, 0) != roundup(DATA_LEN + 16, FLASH_WRITESIZE))
+		test_fail("complete data not written after erasing");
+	test_read_data(path, generation - 1, buf, true);
+
+	test_remove_flash(path);
+}
+
+int main(void)
+{
+	test_newest_wins();
+	test_no_generation();
+	test_generation_wrap();
+	test_partial_write();
+	test_reread();
+	test_rotating();
+	test_rotating_bad_blocks();
+	test_pre_erase_child();
+	test_delta_direct();
+	test_delta_compaction();
+	test_delta_circular();
+
+	return 0;
+}